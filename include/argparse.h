@@ -187,7 +187,11 @@ void argparse_print_help(struct argparse_parser *parser) {
     for (size_t i = 0; i < parser->count; i++) {
         struct argument *item = &parser->items[i];
 
-        printf("  -%c, --%s", item->short_name, item->long_name);
+        if (item->short_name != '\0') {
+            printf("  -%c, --%s", item->short_name, item->long_name);
+        } else {
+            printf("      --%s", item->long_name);
+        }
 
         if (item->type == ARGUMENT_TYPE_VALUE) {
             printf(" <value>");
@@ -0,0 +1,28 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "filter.h"
+#include <stddef.h>
+
+#define BACKEND_AUTO_NAME "auto"
+
+// Every backend applies a kernel repeats times to img and leaves the result
+// in out, using the thread pool and scratch buffer of the filter context.
+// patch computes a region of one application on the CPU, and is what fused
+// pipelines run on the pool threads.
+struct backend {
+        const char *name;
+        int priority;
+        int (*available)(void);
+        int (*apply)(struct filter_context *ctx, struct image *img,
+                     struct kernel *k, struct image *out, int repeats);
+        image_patch_fn patch;
+};
+
+size_t backend_count(void);
+const struct backend *backend_at(size_t index);
+const struct backend *backend_find(const char *name);
+const struct backend *backend_best(void);
+const struct backend *backend_select(const char *name);
+
+#endif // BACKEND_H
@@ -0,0 +1,43 @@
+#ifndef BILATERAL_H
+#define BILATERAL_H
+
+#include "filter.h"
+#include "image.h"
+
+#define BILATERAL_MIN_SIGMA_S 0.5f
+#define BILATERAL_MAX_SIGMA_S 32.0f
+#define BILATERAL_MIN_SIGMA_R 1.0f
+#define BILATERAL_MAX_SIGMA_R 255.0f
+// Automatic mode takes the exact filter up to this spatial sigma, where its
+// window still has at most 13x13 pixels, and the grid from there on.
+#define BILATERAL_EXACT_MAX_SIGMA 3.0f
+// Smallest grid cells, in pixels and in levels, which bound the size of the
+// grid for small sigmas.
+#define BILATERAL_GRID_MIN_CELL 2.0f
+#define BILATERAL_GRID_MIN_RANGE_CELL 8.0f
+
+enum bilateral_mode {
+    BILATERAL_AUTO,
+    BILATERAL_EXACT,
+    BILATERAL_GRID,
+};
+
+// The mode that bilateral_filter runs for the given spatial sigma, which is
+// mode itself unless it is BILATERAL_AUTO.
+enum bilateral_mode bilateral_choose(float sigma_s, enum bilateral_mode mode);
+const char *bilateral_mode_name(enum bilateral_mode mode);
+
+// Edge preserving smoothing of every channel: a weighted mean of the window
+// clipped to the image, where every pixel weighs exp(-d^2 / 2 sigma_s^2) by
+// its distance d and exp(-e^2 / 2 sigma_r^2) by its difference e in value
+// to the center. The exact mode sums the window out to 2 sigma_s, with the
+// range weights looked up in a table of the 256 differences. The grid mode
+// is the bilateral grid of Chen, Paris and Durand: every pixel is added to
+// a grid of cells sigma_s pixels wide and sigma_r levels deep, the grid is
+// blurred, and the result read back at every pixel by trilinear
+// interpolation, at a cost per pixel that barely depends on the sigmas.
+int bilateral_filter(struct filter_context *ctx, struct image *img,
+                     float sigma_s, float sigma_r, enum bilateral_mode mode,
+                     struct image *out);
+
+#endif // BILATERAL_H
@@ -0,0 +1,18 @@
+#ifndef BOX_H
+#define BOX_H
+
+#include "filter.h"
+#include "image.h"
+
+// Largest box radius, which keeps the window sums of a full box of 255
+// values within 32 bits.
+#define BOX_MAX_RADIUS 1024
+
+// Mean of the (2 * radius + 1)^2 box around every pixel with the same zero
+// padding and truncation as applying the equivalent kernel, at a constant
+// cost per pixel whatever the radius: running sums along every row, then
+// running sums of those down every column.
+int box_blur(struct filter_context *ctx, struct image *img, int radius,
+             struct image *out);
+
+#endif // BOX_H
@@ -0,0 +1,29 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+#define BUFFER_POOL_PREFAULT (1u << 0)
+#define BUFFER_POOL_HUGEPAGES (1u << 1)
+
+#define BUFFER_POOL_MAX_CACHED_BYTES (512ul * 1024ul * 1024ul)
+
+struct buffer_pool_stats {
+        size_t hits;
+        size_t misses;
+        size_t frees;
+        size_t bytes_in_use;
+        size_t bytes_cached;
+        size_t peak_bytes_in_use;
+        size_t peak_bytes_mapped;
+};
+
+void buffer_pool_configure(unsigned int flags, size_t max_cached_bytes);
+void *buffer_pool_alloc(size_t size);
+void *buffer_pool_realloc(void *ptr, size_t size);
+void buffer_pool_free(void *ptr);
+void buffer_pool_get_stats(struct buffer_pool_stats *stats);
+void buffer_pool_print_stats(void);
+void buffer_pool_trim(void);
+
+#endif // BUFPOOL_H
@@ -0,0 +1,26 @@
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include "filter.h"
+#include "image.h"
+#include "kernel.h"
+
+// Smallest FFT tile edge. Tiles are at least four times the kernel size, so
+// at least three quarters of every tile is output.
+#define CONVOLVE_FFT_MIN_TILE 64
+// Added before truncating to 8 bits, so that results which are integers in
+// exact arithmetic do not drop by one through rounding errors.
+#define CONVOLVE_ROUNDING_BIAS 1e-3f
+
+// Whole-image alternatives to the direct patch functions for large kernels,
+// with the same zero padding and clamping. Sums are rounded differently, so
+// results may differ from the direct patch by one level. img and out must
+// be different images of the same size. Their buffers come out of the scratch
+// memory of ctx.
+int convolve_separable(struct filter_context *ctx, struct image *img,
+                       const float *row, const float *col, int size,
+                       struct image *out);
+int convolve_fft(struct filter_context *ctx, struct image *img,
+                 struct kernel *k, struct image *out);
+
+#endif // CONVOLVE_H
@@ -0,0 +1,46 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "image.h"
+#include "kernel.h"
+#include "threadpool.h"
+#include <stddef.h>
+
+struct backend;
+
+typedef int (*image_patch_fn)(struct image *img, struct kernel *k,
+                              int start_x, int start_y, int end_x, int end_y,
+                              struct image *out);
+
+// State that outlives a single image: the selected backend, the worker
+// threads, the scratch buffer used to ping-pong between repeats, the
+// per-thread band buffers of fused pipelines and the scratch memory of
+// operations.
+struct filter_context {
+        const struct backend *backend;
+        struct thread_pool *pool;
+        struct image tmp;
+        struct image bands;
+        void *scratch;
+        size_t scratch_size;
+};
+
+int filter_context_init(struct filter_context *ctx, int threads,
+                        const char *backend);
+int filter_context_apply(struct filter_context *ctx, struct image *img,
+                         struct kernel *k, struct image *out, int repeats);
+void *filter_context_scratch(struct filter_context *ctx, size_t size);
+void filter_context_destroy(struct filter_context *ctx);
+
+int image_apply_kernel_single_thread(struct image *img, struct kernel *k,
+                                     struct image *tmp, struct image *out,
+                                     int repeats);
+int image_apply_kernel_multi_thread(struct image *img, struct kernel *k,
+                                    struct thread_pool *pool,
+                                    struct image *tmp, struct image *out,
+                                    int repeats);
+int image_apply_kernel_simd(struct image *img, struct kernel *k,
+                            struct thread_pool *pool, struct image *tmp,
+                            struct image *out, int repeats);
+
+#endif // FILTER_H
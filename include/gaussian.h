@@ -0,0 +1,31 @@
+#ifndef GAUSSIAN_H
+#define GAUSSIAN_H
+
+#include "filter.h"
+#include "image.h"
+
+#define GAUSSIAN_MIN_SIGMA 0.5f
+#define GAUSSIAN_MAX_SIGMA 50.0f
+// Smaller sigmas are convolved with the sampled Gaussian, out to four sigma,
+// which takes kernels of at most GAUSSIAN_SAMPLED_MAX_SIZE taps.
+#define GAUSSIAN_RECURSIVE_MIN_SIGMA 2.5f
+#define GAUSSIAN_SAMPLED_MAX_SIZE 21
+// Largest difference to the exact convolution with the sampled Gaussian of
+// the same sigma, in 8-bit levels, measured at sigmas across the whole range
+// on noise and on a photograph. Below
+// GAUSSIAN_RECURSIVE_MIN_SIGMA the error is at most one level. The
+// recursion departs most from the Gaussian around sigma 3 to 12, on sharp
+// edges, and comes within three levels again from sigma 25 on; its mean
+// error is about one level throughout.
+#define GAUSSIAN_MAX_ERROR 6
+
+// Gaussian blur by the recursive filter of Young and van Vliet: a causal
+// and an anti-causal third order pass along the rows, then the same down the
+// columns, at a cost per pixel that does not depend on sigma. The image is
+// zero padded like the kernel filters: the causal passes start from rest
+// and the anti-causal ones from the exact response to the zeros beyond the
+// last pixel.
+int gaussian_blur(struct filter_context *ctx, struct image *img, float sigma,
+                  struct image *out);
+
+#endif // GAUSSIAN_H
@@ -0,0 +1,33 @@
+#ifndef GRADIENT_H
+#define GRADIENT_H
+
+#include "filter.h"
+#include "image.h"
+
+#define GRADIENT_MAX_SCALE 16.0f
+#define GRADIENT_MIN_SCALE (1.0f / 64.0f)
+
+// Weights of the 3x3 derivative: Sobel's 1 2 1 across the derivative, or
+// Scharr's 3 10 3, which is closer to rotation invariant.
+enum gradient_operator {
+    GRADIENT_SOBEL,
+    GRADIENT_SCHARR,
+};
+
+enum gradient_norm {
+    GRADIENT_L1 = 1,
+    GRADIENT_L2 = 2,
+};
+
+// Gradient magnitude of every channel, |Gx| + |Gy| or sqrt(Gx^2 + Gy^2),
+// times scale and clamped to 255 like the kernel filters. With direction
+// set, the angle atan2(Gy, Gx) is written instead, the full circle from the
+// x axis towards the y axis, which points down, mapped to 0..255, and 0
+// where the gradient vanishes. Both derivatives come from one sweep over the
+// 3x3 neighbourhoods, with the edge pixels repeated beyond the image, so
+// flat borders show no false edges.
+int gradient_filter(struct filter_context *ctx, struct image *img,
+                    enum gradient_operator op, enum gradient_norm norm,
+                    float scale, int direction, struct image *out);
+
+#endif // GRADIENT_H
@@ -2,24 +2,46 @@
 #define IMAGE_H
 
 #include "kernel.h"
+#include <stddef.h>
 
 #define NUM_CHANNELS 3
 
+struct integral;
+
+// The summed-area table of the pixels, when a filter has built one, is
+// owned by the image and freed with it.
 struct image {
         int width;
         int height;
         int channels;
         unsigned char *bytes;
+        size_t capacity;
+        struct integral *integral;
 };
 
 int image_init(struct image *img, int width, int height, int channels);
+int image_reserve(struct image *img, int width, int height, int channels);
 int image_load(struct image *img, const char *filename);
+// Loads with the given number of channels, or the channels of the file
+// itself when channels is 0.
+int image_load_channels(struct image *img, const char *filename,
+                        int channels);
+int image_load_from_memory(struct image *img, const unsigned char *buffer,
+                           size_t size);
 int image_apply_kernel(struct image *img, struct kernel *k, struct image *out);
 int image_apply_kernel_patch(struct image *img, struct kernel *k, int start_x,
                              int start_y, int end_x, int end_y,
                              struct image *out);
+int image_apply_kernel_patch_simd(struct image *img, struct kernel *k,
+                                  int start_x, int start_y, int end_x,
+                                  int end_y, struct image *out);
+int image_apply_kernel_patch_int(struct image *img, struct kernel *k,
+                                 int start_x, int start_y, int end_x,
+                                 int end_y, struct image *out);
+int image_cuda_available(void);
 int image_apply_kernel_cuda_wrapper(struct image *img, struct kernel *k,
                                     struct image *out, int repeats);
+void image_fill_random(struct image *img, unsigned long long seed);
 int image_write_pbm(struct image *img, const char *filename);
 void image_destroy(struct image *img);
 
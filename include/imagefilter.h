@@ -0,0 +1,84 @@
+#ifndef IMAGEFILTER_H
+#define IMAGEFILTER_H
+
+// Public API of libimagefilter.
+//
+// A context owns a thread pool and the scratch buffers of the filter engine.
+// Contexts created with max_width/max_height, or that have seen an image of
+// a given size, run kernels and pipelines of kernels on images up to that
+// size without allocating. Operations such as "box(5)" size their scratch
+// memory on their first call, so once a pipeline has run on an image of a
+// given size, further calls with it allocate nothing. Contexts are not
+// shared between threads, but any number of threads may each use their own
+// context concurrently.
+
+#include <stddef.h>
+
+#define IMAGEFILTER_VERSION_MAJOR 0
+#define IMAGEFILTER_VERSION_MINOR 1
+#define IMAGEFILTER_VERSION_PATCH 0
+#define IMAGEFILTER_VERSION "0.1.0"
+
+#if defined(__GNUC__)
+#define IMAGEFILTER_API __attribute__((visibility("default")))
+#else
+#define IMAGEFILTER_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum imagefilter_status {
+    IMAGEFILTER_OK = 0,
+    IMAGEFILTER_ERROR_ARGUMENT,
+    IMAGEFILTER_ERROR_FILTER,
+    IMAGEFILTER_ERROR_MEMORY,
+    IMAGEFILTER_ERROR_BACKEND,
+};
+
+struct imagefilter_options {
+        // Number of threads used for a single apply call, 0 means 1.
+        int threads;
+        // Image and band buffers are reserved for images up to this size
+        // and channel count at creation time, the scratch memory of
+        // operations on their first call. 0 defers all of it to the first
+        // apply call.
+        int max_width;
+        int max_height;
+        int max_channels;
+        // Backend name (scalar, threaded, simd, cuda), NULL or "auto" picks
+        // the fastest one available.
+        const char *backend;
+};
+
+struct imagefilter_context;
+
+IMAGEFILTER_API const char *imagefilter_version(void);
+IMAGEFILTER_API const char *
+imagefilter_status_string(enum imagefilter_status status);
+
+IMAGEFILTER_API struct imagefilter_context *
+imagefilter_context_new(const struct imagefilter_options *options);
+
+// Applies the named filter, or a pipeline such as "blur:2,sharpen", repeats
+// times to a width x height image with channels interleaved 8-bit channels.
+// Rows of src and dst are src_stride and dst_stride bytes apart. src and dst
+// may be the same buffer. Pipelines that change the size of the image, such
+// as "scale(0.5)", are rejected as unknown filters.
+IMAGEFILTER_API enum imagefilter_status
+imagefilter_apply(struct imagefilter_context *ctx, const char *filter,
+                  int repeats, const unsigned char *src, size_t src_stride,
+                  unsigned char *dst, size_t dst_stride, int width, int height,
+                  int channels);
+
+IMAGEFILTER_API const char *
+imagefilter_backend_name(const struct imagefilter_context *ctx);
+
+IMAGEFILTER_API void imagefilter_context_free(struct imagefilter_context *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IMAGEFILTER_H
@@ -0,0 +1,53 @@
+#ifndef INTEGRAL_H
+#define INTEGRAL_H
+
+#include "filter.h"
+#include "image.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest window radius of the region statistics operations.
+#define INTEGRAL_MAX_RADIUS 1024
+// Local standard deviation at which the adaptive box blur shrinks to its
+// smallest radius, by default.
+#define INTEGRAL_ADAPTIVE_CONTRAST 32
+
+// Summed-area table of an image: entry (x, y) of channel c holds the sum of
+// that channel over the pixels above and to the left of (x, y), so the
+// table has one more row and column than the image, both zero. Sums wrap
+// around in 32 bits, which keeps the sum of any window below 2^32 / 255
+// pixels exact, and the optional sums of squares use 64 bits. A table
+// attached to an image is rebuilt by image_integral whenever a filter needs
+// it, since the pixels may have changed in between, but its memory stays
+// with the image.
+struct integral {
+        int width;
+        int height;
+        int channels;
+        uint32_t *sums;
+        uint64_t *squares;
+        size_t capacity;
+        size_t squares_capacity;
+};
+
+int image_integral(struct image *img, struct thread_pool *pool, int squares);
+uint32_t integral_sum(const struct integral *t, int x0, int y0, int x1,
+                      int y1, int c);
+uint64_t integral_square_sum(const struct integral *t, int x0, int y0, int x1,
+                             int y1, int c);
+void integral_free(struct integral *t);
+
+// Filters answering every pixel with a constant number of table lookups.
+// Windows are clipped to the image and statistics taken over the pixels
+// inside it. img and out must be different images of the same size.
+int integral_mean(struct filter_context *ctx, struct image *img, int radius,
+                  struct image *out);
+int integral_stddev(struct filter_context *ctx, struct image *img, int radius,
+                    struct image *out);
+int integral_threshold(struct filter_context *ctx, struct image *img,
+                       int radius, int offset, struct image *out);
+int integral_adaptive_box(struct filter_context *ctx, struct image *img,
+                          int min_radius, int max_radius, int contrast,
+                          struct image *out);
+
+#endif // INTEGRAL_H
@@ -5,13 +5,44 @@
 #define SHARPEN_KERNEL_NAME "sharpen"
 #define EDGE_KERNEL_NAME "edge"
 #define EMBOSS_KERNEL_NAME "emboss"
+#define CUSTOM_KERNEL_NAME "custom"
 
+#define KERNEL_MAX_SIZE 63
+// Largest denominator tried when looking for integer weights.
+#define KERNEL_MAX_DIVISOR 4096
+// Relative tolerance of the float comparisons in the kernel analysis.
+#define KERNEL_EPSILON 1e-5f
+// Binary kernel files start with this magic, followed by the size as a
+// native int and size * size native floats, row by row.
+#define KERNEL_FILE_MAGIC "IFK1"
+
+// Properties found by kernel_analyze.
+#define KERNEL_SEPARABLE 0x1
+#define KERNEL_INTEGER 0x2
+#define KERNEL_SYMMETRIC 0x4
+
+// weights and divisor are only set for KERNEL_INTEGER kernels, where
+// values[i] is within KERNEL_EPSILON of weights[i] / divisor, so that 1/9
+// has the weights 1 and the divisor 9. The integer path sums exactly, and
+// may differ by one level from the float sums of image_apply_kernel.
+// KERNEL_SYMMETRIC kernels are mirror symmetric left to right.
 struct kernel {
         int size;
         const float *values;
+        const int *weights;
+        int divisor;
+        unsigned int flags;
 };
 
 int kernel_from(struct kernel *k, const char *name);
 float kernel_get_value_at(struct kernel *k, int x, int y);
+float *kernel_compose(const struct kernel *a, const struct kernel *b,
+                      int *size);
+int kernel_preserves_range(const struct kernel *k);
+int kernel_separate(const struct kernel *k, float *row, float *col);
+unsigned int kernel_analyze(const struct kernel *k, float *row, float *col,
+                            int *weights, int *divisor);
+int kernel_parse(float **values, int *size, const char *text);
+int kernel_load(float **values, int *size, const char *path);
 
 #endif // KERNEL_H
@@ -0,0 +1,24 @@
+#ifndef MEDIAN_H
+#define MEDIAN_H
+
+#include "filter.h"
+#include "image.h"
+
+// Largest median radius. Window counts stay within the 16-bit bins, and the
+// cost per pixel stays independent of the radius as long as the tiles are
+// much wider than the window.
+#define MEDIAN_MAX_RADIUS 63
+// Tiles that the threads take in turn, each with its own column histograms.
+#define MEDIAN_TILE_WIDTH 256
+#define MEDIAN_TILE_HEIGHT 128
+
+// Median of the (2 * radius + 1)^2 window around every pixel, per channel,
+// with the window clipped to the image; for an even count of pixels the
+// lower of the two middle values. Perreault and Hebert's constant time
+// algorithm: every column of a tile keeps a histogram of the window rows,
+// updated by one pixel per row, and the window histogram slides along the
+// row by adding one column histogram and subtracting another.
+int median_filter(struct filter_context *ctx, struct image *img, int radius,
+                  struct image *out);
+
+#endif // MEDIAN_H
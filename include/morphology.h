@@ -0,0 +1,30 @@
+#ifndef MORPHOLOGY_H
+#define MORPHOLOGY_H
+
+#include "filter.h"
+#include "image.h"
+
+// Largest radius of the structuring element along either axis.
+#define MORPHOLOGY_MAX_RADIUS 1024
+
+enum morphology_kind {
+    MORPHOLOGY_ERODE,
+    MORPHOLOGY_DILATE,
+    // Erosion followed by dilation, which removes bright specks smaller
+    // than the rectangle.
+    MORPHOLOGY_OPEN,
+    // Dilation followed by erosion, which fills dark holes.
+    MORPHOLOGY_CLOSE,
+};
+
+// Minimum (erosion) or maximum (dilation) of every channel over the
+// (2 * rx + 1) x (2 * ry + 1) rectangle around every pixel, with the
+// rectangle clipped to the image. The rectangle is separable into a row and
+// a column pass, and each pass uses the algorithm of van Herk and Gil and
+// Werman: prefix and suffix extremes within blocks of the window length,
+// so every value takes three comparisons whatever the radius.
+int morphology_filter(struct filter_context *ctx, struct image *img,
+                      enum morphology_kind kind, int rx, int ry,
+                      struct image *out);
+
+#endif // MORPHOLOGY_H
@@ -0,0 +1,50 @@
+#ifndef OPERATION_H
+#define OPERATION_H
+
+#include "filter.h"
+#include "image.h"
+#include <stddef.h>
+
+#define OPERATION_MAX_ARGS 4
+#define OPERATION_ARGS_OPEN '('
+#define OPERATION_ARGS_CLOSE ')'
+#define OPERATION_ARGS_SEPARATOR ','
+
+// One argument of an operation, with its accepted range and the value used
+// when it is left out. Integer arguments reject fractional values.
+struct operation_arg {
+        const char *name;
+        float min;
+        float max;
+        float value;
+        int integer;
+};
+
+// A filter that is not a convolution with a fixed kernel, such as a box blur
+// of arbitrary radius. Operations make up pipeline stages of their own,
+// written as their name followed by their arguments in parentheses, as in
+// "box(7)"; trailing arguments may be left out. apply reads the whole of img
+// and writes out, which is a different image, using the pool and scratch
+// memory of the filter context. Operations that pick between algorithms by
+// their arguments name the one they run in mode, and operations that change
+// the size of the image give the size of out in size; others leave them
+// NULL and write an image of the same size.
+struct operation {
+        const char *name;
+        const char *description;
+        int arg_count;
+        struct operation_arg args[OPERATION_MAX_ARGS];
+        int (*apply)(struct filter_context *ctx, struct image *img,
+                     struct image *out, const float *args);
+        const char *(*mode)(const float *args);
+        void (*size)(const float *args, int width, int height,
+                     int *out_width, int *out_height);
+};
+
+size_t operation_count(void);
+const struct operation *operation_at(size_t index);
+const struct operation *operation_find(const char *name, size_t length);
+int operation_parse_args(const struct operation *op, const char *text,
+                         size_t length, float *args);
+
+#endif // OPERATION_H
@@ -0,0 +1,40 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "threadpool.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#define PERF_CACHE_LINE_SIZE 64
+
+enum perf_counter {
+    PERF_COUNTER_CYCLES,
+    PERF_COUNTER_INSTRUCTIONS,
+    PERF_COUNTER_LLC_REFERENCES,
+    PERF_COUNTER_LLC_MISSES,
+    PERF_COUNTER_COUNT,
+};
+
+struct perf_thread {
+        int fds[PERF_COUNTER_COUNT];
+        uint64_t values[PERF_COUNTER_COUNT];
+};
+
+// Hardware counters of every thread in a pool. Each thread opens its own
+// counters, so the values can be attributed per thread.
+struct perf_session {
+        struct perf_thread *threads;
+        int count;
+        int available;
+};
+
+int perf_session_open(struct perf_session *s, struct thread_pool *pool);
+void perf_session_reset(struct perf_session *s);
+void perf_session_start(struct perf_session *s);
+void perf_session_stop(struct perf_session *s);
+void perf_session_total(struct perf_session *s,
+                        uint64_t values[PERF_COUNTER_COUNT]);
+void perf_session_print(struct perf_session *s, double pixels, FILE *file);
+void perf_session_close(struct perf_session *s);
+
+#endif // PERF_H
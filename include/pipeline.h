@@ -0,0 +1,88 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "filter.h"
+#include "image.h"
+#include "kernel.h"
+#include "operation.h"
+#include <stddef.h>
+
+#define PIPELINE_NAME_MAX 32
+#define PIPELINE_SEPARATOR ","
+#define PIPELINE_REPEAT_SEPARATOR ':'
+// Largest sum of kernel radii fused into one pass over the image. Longer
+// chains are split into several passes.
+#define PIPELINE_MAX_HALO 8
+// Target size of a band of rows, sized to stay within the L2 cache.
+#define PIPELINE_BAND_BYTES (256 * 1024)
+#define PIPELINE_MIN_BAND_ROWS 16
+// Bands are at least this many times taller than their halo, which bounds
+// the rows computed twice by neighbouring bands.
+#define PIPELINE_HALO_RATIO 4
+
+// Largest kernel that pipeline_optimize builds by composing stages.
+#define PIPELINE_MAX_FUSED_SIZE KERNEL_MAX_SIZE
+// Smallest kernels run as two 1D passes when separable, or through the FFT
+// otherwise, and the cost of those methods relative to one multiply-add of
+// the direct patch, measured on the simd backend.
+#define PIPELINE_SEPARABLE_MIN_SIZE 5
+#define PIPELINE_FFT_MIN_SIZE 11
+#define PIPELINE_SEPARABLE_COST 3
+#define PIPELINE_FFT_COST 128
+
+enum pipeline_method {
+    PIPELINE_DIRECT,
+    PIPELINE_INTEGER,
+    PIPELINE_SEPARABLE,
+    PIPELINE_FFT,
+    PIPELINE_OPERATION,
+};
+
+// One stage of a pipeline spec such as "blur:2,box(3),edge": a filter
+// applied repeats times in a row. Custom kernels and stages built by
+// pipeline_optimize own their kernel values, the row and column factors of
+// separable kernels and the weights of integer ones. Operation stages have
+// no kernel and keep their parsed arguments instead.
+struct pipeline_stage {
+        char name[PIPELINE_NAME_MAX];
+        struct kernel k;
+        int repeats;
+        enum pipeline_method method;
+        float *values;
+        float *row;
+        float *col;
+        int *weights;
+        const struct operation *op;
+        float args[OPERATION_MAX_ARGS];
+};
+
+struct pipeline {
+        struct pipeline_stage *items;
+        size_t count;
+        size_t capacity;
+};
+
+int pipeline_parse(struct pipeline *p, const char *spec,
+                   const struct kernel *custom);
+int pipeline_steps(struct pipeline *p);
+int pipeline_max_kernel_size(struct pipeline *p);
+void pipeline_size(struct pipeline *p, int repeats, int width, int height,
+                   int *out_width, int *out_height);
+// Pixels written by all the steps of the pipeline on a width x height
+// image, every step counted at the size of its output.
+double pipeline_pixels(struct pipeline *p, int repeats, int width,
+                       int height);
+int pipeline_optimize(struct pipeline *dst, struct pipeline *src,
+                      int repeats);
+const char *pipeline_method_name(enum pipeline_method method);
+int pipeline_apply(struct filter_context *ctx, struct pipeline *p,
+                   struct image *img, struct image *out, int repeats);
+// Reserves the intermediate image and the band buffers of fused passes in
+// ctx for images up to width x height, so that pipelines of kernels run on
+// them without allocating. Operations size their scratch memory on their
+// first call.
+int pipeline_reserve(struct filter_context *ctx, int width, int height,
+                     int channels);
+void pipeline_free(struct pipeline *p);
+
+#endif // PIPELINE_H
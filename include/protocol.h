@@ -0,0 +1,192 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// Wire protocol of the filter server. Every job is a single header line,
+// optionally followed by the raw bytes of an encoded image:
+//
+//   JOB <filter> <repeats> <output> FILE <input>\n
+//   JOB <filter> <repeats> <output> DATA <size>\n<size bytes>
+//
+// and is answered with one line:
+//
+//   OK <queue_us> <process_us> <total_us>\n
+//   ERR <message>\n
+//
+// A connection may carry any number of jobs, answered in order. File names
+// must not contain whitespace.
+
+#include <stddef.h>
+
+#define PROTOCOL_LINE_MAX 4096
+#define PROTOCOL_DATA_MAX (256u * 1024u * 1024u)
+
+struct protocol_reader {
+        int fd;
+        char buffer[PROTOCOL_LINE_MAX];
+        size_t start;
+        size_t end;
+};
+
+void protocol_reader_init(struct protocol_reader *r, int fd);
+int protocol_read_line(struct protocol_reader *r, char *line, size_t size);
+int protocol_read_exact(struct protocol_reader *r, void *data, size_t size);
+int protocol_write_all(int fd, const void *data, size_t size);
+
+int protocol_connect(const char *socket_path);
+int protocol_send_job(int fd, const char *filter, int repeats,
+                      const char *output, const char *input,
+                      const unsigned char *data, size_t size);
+
+#endif // PROTOCOL_H
+
+#ifdef PROTOCOL_IMPLEMENTATION
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+void protocol_reader_init(struct protocol_reader *r, int fd) {
+    r->fd = fd;
+    r->start = 0;
+    r->end = 0;
+}
+
+static int protocol_fill(struct protocol_reader *r) {
+    if (r->start > 0) {
+        memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+
+    for (;;) {
+        ssize_t n = read(r->fd, r->buffer + r->end, sizeof(r->buffer) - r->end);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+
+        r->end += n;
+        return 0;
+    }
+}
+
+// Reads one '\n' terminated line without the terminator. Returns 1 on end of
+// stream, error, or a line longer than size - 1 bytes.
+int protocol_read_line(struct protocol_reader *r, char *line, size_t size) {
+    for (;;) {
+        char *newline = memchr(r->buffer + r->start, '\n', r->end - r->start);
+        if (newline != NULL) {
+            size_t length = newline - (r->buffer + r->start);
+            if (length >= size) {
+                return 1;
+            }
+
+            memcpy(line, r->buffer + r->start, length);
+            line[length] = '\0';
+            r->start += length + 1;
+            return 0;
+        }
+
+        if (r->end - r->start >= sizeof(r->buffer) || protocol_fill(r) != 0) {
+            return 1;
+        }
+    }
+}
+
+int protocol_read_exact(struct protocol_reader *r, void *data, size_t size) {
+    size_t buffered = r->end - r->start;
+    if (buffered > size) {
+        buffered = size;
+    }
+
+    memcpy(data, r->buffer + r->start, buffered);
+    r->start += buffered;
+
+    size_t done = buffered;
+    while (done < size) {
+        ssize_t n = read(r->fd, (char *)data + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+int protocol_write_all(int fd, const void *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, (const char *)data + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+int protocol_connect(const char *socket_path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Sends the input as a file name, or inline when data is not NULL.
+int protocol_send_job(int fd, const char *filter, int repeats,
+                      const char *output, const char *input,
+                      const unsigned char *data, size_t size) {
+    char header[PROTOCOL_LINE_MAX];
+    int length;
+
+    if (data != NULL) {
+        length = snprintf(header, sizeof(header), "JOB %s %d %s DATA %zu\n",
+                          filter, repeats, output, size);
+    } else {
+        length = snprintf(header, sizeof(header), "JOB %s %d %s FILE %s\n",
+                          filter, repeats, output, input);
+    }
+
+    if (length < 0 || (size_t)length >= sizeof(header)) {
+        return 1;
+    }
+
+    if (protocol_write_all(fd, header, length) != 0) {
+        return 1;
+    }
+
+    if (data != NULL && protocol_write_all(fd, data, size) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+#endif // PROTOCOL_IMPLEMENTATION
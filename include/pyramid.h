@@ -0,0 +1,63 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include "filter.h"
+#include "image.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define PYRAMID_MAX_LEVELS 16
+// Laplacian levels are written out with this value added, so that a zero
+// difference shows as mid gray.
+#define PYRAMID_LAPLACIAN_OFFSET 128
+
+// Level l holds width * height * channels values at offset in the storage
+// of the pyramid, every set of levels packed one after the other.
+struct pyramid_level {
+        int width;
+        int height;
+        size_t offset;
+};
+
+// Gaussian pyramid of an image, and optionally its Laplacian pyramid. Level
+// 0 of the Gaussian pyramid is the image itself, and every next level is
+// the one before blurred by the binomial kernel 1 4 6 4 1 / 16 along both
+// axes and decimated by two, (width + 1) / 2 by (height + 1) / 2, in exact
+// integer arithmetic with the edge pixels repeated beyond the level. Only
+// the kept pixels are ever computed. Laplacian level l is Gaussian level l
+// minus the expansion of level l + 1, the difference between them, and the
+// last level is the last Gaussian level itself, so that collapsing the
+// Laplacian pyramid gives back the image exactly. The storage stays with
+// the pyramid for the next build.
+struct pyramid {
+        int levels;
+        int channels;
+        struct pyramid_level level[PYRAMID_MAX_LEVELS];
+        unsigned char *gaussian;
+        int16_t *laplacian;
+        size_t capacity;
+        size_t laplacian_capacity;
+};
+
+// Builds up to levels levels of img, fewer when the image shrinks to a
+// single pixel before, in one pass over the thread pool: every thread
+// computes its share of the rows of a level from a ring of the five
+// decimated rows of the level above around them, then meets the others
+// before the next level. The Laplacian levels follow, when asked for, from
+// the Gaussian ones.
+int pyramid_build(struct filter_context *ctx, struct image *img, int levels,
+                  int laplacian, struct pyramid *p);
+unsigned char *pyramid_gaussian(const struct pyramid *p, int level);
+int16_t *pyramid_laplacian(const struct pyramid *p, int level);
+// Reconstructs level 0 from the Laplacian pyramid into out, expanding every
+// level into the next from the top, with values clamped to 0..255 in case
+// the levels were edited.
+int pyramid_collapse(struct filter_context *ctx, const struct pyramid *p,
+                     struct image *out);
+// Copies a level into out, Laplacian levels but the last one offset by
+// PYRAMID_LAPLACIAN_OFFSET and clamped to 0..255.
+int pyramid_level_image(const struct pyramid *p, int level, int laplacian,
+                        struct image *out);
+void pyramid_destroy(struct pyramid *p);
+
+#endif // PYRAMID_H
@@ -0,0 +1,14 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+
+struct queue;
+
+struct queue *queue_new(size_t capacity);
+int queue_push(struct queue *q, void *item);
+int queue_pop(struct queue *q, void **item);
+void queue_close(struct queue *q);
+void queue_free(struct queue *q);
+
+#endif // QUEUE_H
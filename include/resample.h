@@ -0,0 +1,36 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "filter.h"
+#include "image.h"
+
+// Largest width or height of a resampled image.
+#define RESAMPLE_MAX_SIZE 32768
+#define RESAMPLE_MIN_SCALE (1.0f / 64.0f)
+#define RESAMPLE_MAX_SCALE 16.0f
+
+enum resample_filter {
+    RESAMPLE_BOX,
+    RESAMPLE_BILINEAR,
+    RESAMPLE_LANCZOS3,
+};
+
+// Size of width x height resized to target_width x target_height, where a
+// zero target keeps the aspect ratio of the other one and two zeros keep
+// the size, clamped to 1..RESAMPLE_MAX_SIZE.
+void resample_size(int width, int height, int target_width, int target_height,
+                   int *out_width, int *out_height);
+
+// Resamples img to width x height into out, which is reserved to that size.
+// Every output pixel of an axis is a weighted sum of the input pixels
+// around its center, the filter stretched by the scale when downscaling so
+// that every input pixel contributes, with the weights of both axes
+// computed once per call and normalized over the pixels inside the image.
+// The axes are separate passes, rows first into a byte image of the output
+// width, then columns, both split over the threads of the pool; an axis
+// that keeps its size is not resampled at all.
+int resample_image(struct filter_context *ctx, struct image *img, int width,
+                   int height, enum resample_filter filter,
+                   struct image *out);
+
+#endif // RESAMPLE_H
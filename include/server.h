@@ -0,0 +1,11 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+
+#define SERVER_QUEUE_CAPACITY 64
+
+int server_run(const char *socket_path, int workers, size_t queue_capacity,
+               const char *backend);
+
+#endif // SERVER_H
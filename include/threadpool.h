@@ -0,0 +1,15 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+typedef void (*thread_pool_task)(void *args, int index, int count);
+
+struct thread_pool;
+
+struct thread_pool *thread_pool_new(int threads);
+int thread_pool_size(struct thread_pool *pool);
+void thread_pool_run(struct thread_pool *pool, thread_pool_task task,
+                     void *args);
+void thread_pool_barrier(struct thread_pool *pool);
+void thread_pool_free(struct thread_pool *pool);
+
+#endif // THREADPOOL_H
@@ -0,0 +1,35 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define TIMING_NAME_MAX 32
+
+struct timing_point {
+        long wall_ns;
+        long cpu_ns;
+};
+
+struct timing_stage {
+        char name[TIMING_NAME_MAX];
+        long wall_ns;
+        long cpu_ns;
+};
+
+struct timings {
+        struct timing_stage *items;
+        size_t count;
+        size_t capacity;
+};
+
+void timing_now(struct timing_point *point);
+long timing_peak_rss_kb(void);
+
+void timings_add(struct timings *t, const char *name,
+                 struct timing_point *start);
+void timings_print(struct timings *t, FILE *file);
+void timings_print_json(struct timings *t, FILE *file);
+void timings_free(struct timings *t);
+
+#endif // TIMING_H
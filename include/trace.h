@@ -0,0 +1,25 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Lightweight event recording for the Chrome trace format (chrome://tracing,
+// ui.perfetto.dev). Every thread records into its own ring buffer, so the
+// hot path takes no locks; when the ring wraps the oldest events are
+// overwritten. Event names must be string literals.
+//
+//     long start = trace_start();
+//     ... work ...
+//     trace_event("patch", start);
+
+#define TRACE_MAX_THREADS 256
+#define TRACE_RING_SIZE 16384
+#define TRACE_THREAD_NAME_MAX 32
+
+void trace_enable(void);
+int trace_enabled(void);
+void trace_set_thread_name(const char *format, int index);
+long trace_start(void);
+void trace_event(const char *name, long start_ns);
+int trace_write(const char *filename);
+void trace_free(void);
+
+#endif // TRACE_H
@@ -0,0 +1,42 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stddef.h>
+
+#define TUNE_CPU_MAX 128
+#define TUNE_BACKEND_MAX 16
+#define TUNE_PROFILE_ENV "IMAGEFILTER_TUNE_PROFILE"
+#define TUNE_PROFILE_NAME ".imagefilter_tune"
+#define TUNE_ITERATIONS 5
+
+// Best configuration found for one CPU model and problem shape. Shapes are
+// bucketed: size_class is floor(log4(pixels)) and repeats_class is
+// floor(log2(repeats)), so nearby problems share an entry.
+struct tune_entry {
+        char cpu[TUNE_CPU_MAX];
+        int size_class;
+        int kernel_size;
+        int repeats_class;
+        char backend[TUNE_BACKEND_MAX];
+        int threads;
+        double median_ms;
+};
+
+struct tune_profile {
+        struct tune_entry *items;
+        size_t count;
+        size_t capacity;
+};
+
+void tune_cpu_model(char *cpu, size_t size);
+int tune_profile_path(char *path, size_t size);
+int tune_profile_load(struct tune_profile *p, const char *path);
+int tune_profile_save(struct tune_profile *p, const char *path);
+const struct tune_entry *tune_profile_lookup(struct tune_profile *p,
+                                             const char *cpu, int width,
+                                             int height, int kernel_size,
+                                             int repeats);
+int tune_run(struct tune_profile *p, int max_threads);
+void tune_profile_free(struct tune_profile *p);
+
+#endif // TUNE_H
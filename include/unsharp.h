@@ -0,0 +1,23 @@
+#ifndef UNSHARP_H
+#define UNSHARP_H
+
+#include "filter.h"
+#include "image.h"
+
+#define UNSHARP_MIN_SIGMA 0.5f
+#define UNSHARP_MAX_SIGMA 20.0f
+#define UNSHARP_MAX_AMOUNT 10.0f
+
+// Unsharp mask: every value v moves away from its Gaussian blur b by
+// amount times their difference, v + amount * (v - b), wherever |v - b| is
+// at least threshold, and stays as it is elsewhere, so that noise below the
+// threshold is not sharpened. The blur is the sampled Gaussian out to three
+// sigma with the edge pixels repeated beyond the image. Blur and mix are
+// fused: every thread blurs its rows into a ring of 2 * radius + 1
+// horizontally filtered rows, sums the ring down into one blurred row and
+// mixes it into the output at once, so the blurred image never exists as a
+// whole.
+int unsharp_mask(struct filter_context *ctx, struct image *img, float sigma,
+                 float amount, int threshold, struct image *out);
+
+#endif // UNSHARP_H
@@ -0,0 +1,104 @@
+#include "backend.h"
+#include "util.h"
+#include <string.h>
+
+static int backend_always_available(void) { return 1; }
+
+static int backend_scalar_apply(struct filter_context *ctx, struct image *img,
+                                struct kernel *k, struct image *out,
+                                int repeats) {
+    return image_apply_kernel_single_thread(img, k, &ctx->tmp, out, repeats);
+}
+
+static int backend_threaded_apply(struct filter_context *ctx,
+                                  struct image *img, struct kernel *k,
+                                  struct image *out, int repeats) {
+    return image_apply_kernel_multi_thread(img, k, ctx->pool, &ctx->tmp, out,
+                                           repeats);
+}
+
+static int backend_simd_apply(struct filter_context *ctx, struct image *img,
+                              struct kernel *k, struct image *out,
+                              int repeats) {
+    return image_apply_kernel_simd(img, k, ctx->pool, &ctx->tmp, out, repeats);
+}
+
+#ifdef IMAGEFILTER_CUDA
+static int backend_cuda_available(void) { return image_cuda_available(); }
+
+static int backend_cuda_apply(struct filter_context *ctx, struct image *img,
+                              struct kernel *k, struct image *out,
+                              int repeats) {
+    (void)ctx;
+    return image_apply_kernel_cuda_wrapper(img, k, out, repeats);
+}
+#endif
+
+// Ordered from the reference implementation to the fastest one; automatic
+// selection picks the available backend with the highest priority.
+static const struct backend backends[] = {
+    {"scalar", 0, backend_always_available, backend_scalar_apply,
+     image_apply_kernel_patch},
+    {"threaded", 10, backend_always_available, backend_threaded_apply,
+     image_apply_kernel_patch},
+    {"simd", 20, backend_always_available, backend_simd_apply,
+     image_apply_kernel_patch_simd},
+#ifdef IMAGEFILTER_CUDA
+    {"cuda", 30, backend_cuda_available, backend_cuda_apply,
+     image_apply_kernel_patch},
+#endif
+};
+
+size_t backend_count(void) { return sizeof(backends) / sizeof(backends[0]); }
+
+const struct backend *backend_at(size_t index) {
+    if (index >= backend_count()) {
+        return NULL;
+    }
+
+    return &backends[index];
+}
+
+const struct backend *backend_find(const char *name) {
+    for (size_t i = 0; i < backend_count(); i++) {
+        if (strcmp(backends[i].name, name) == 0) {
+            return &backends[i];
+        }
+    }
+
+    return NULL;
+}
+
+const struct backend *backend_best(void) {
+    const struct backend *best = NULL;
+
+    for (size_t i = 0; i < backend_count(); i++) {
+        if (backends[i].available() &&
+            (best == NULL || backends[i].priority > best->priority)) {
+            best = &backends[i];
+        }
+    }
+
+    return best;
+}
+
+// NULL or "auto" selects the best backend, anything else must name a
+// compiled-in backend that is usable on this machine.
+const struct backend *backend_select(const char *name) {
+    if (name == NULL || strcmp(name, BACKEND_AUTO_NAME) == 0) {
+        return backend_best();
+    }
+
+    const struct backend *backend = backend_find(name);
+    if (backend == NULL) {
+        LOG_ERROR("Unknown backend: %s", name);
+        return NULL;
+    }
+
+    if (!backend->available()) {
+        LOG_ERROR("Backend is not available: %s", name);
+        return NULL;
+    }
+
+    return backend;
+}
@@ -0,0 +1,443 @@
+#include "bilateral.h"
+#include "convolve.h"
+#include "trace.h"
+#include "util.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BILATERAL_LANES 8
+// Empty cells on either side of the grid, so that the blur of the
+// outermost filled cells fits in it.
+#define BILATERAL_GRID_PAD 2
+
+typedef uint8_t bilateral_u8 __attribute__((vector_size(BILATERAL_LANES)));
+typedef int32_t bilateral_i32
+    __attribute__((vector_size(BILATERAL_LANES * 4)));
+typedef float bilateral_f32 __attribute__((vector_size(BILATERAL_LANES * 4)));
+
+// Sum of the values added to a cell of the grid, and their count, or their
+// weights once blurred.
+struct bilateral_cell {
+        float sum;
+        float weight;
+};
+
+// The exact mode uses radius, spatial and range. The grid mode uses the
+// scales from pixels and levels to cells, the grid, blurred into blurred,
+// and a line of cells per thread.
+struct bilateral_args {
+        struct image *img;
+        int radius;
+        const float *spatial;
+        const float *range;
+        float scale;
+        float range_scale;
+        int grid_width;
+        int grid_height;
+        int grid_depth;
+        struct bilateral_cell *grid;
+        struct bilateral_cell *blurred;
+        struct bilateral_cell *lines;
+        struct thread_pool *pool;
+        struct image *out;
+};
+
+enum bilateral_mode bilateral_choose(float sigma_s, enum bilateral_mode mode) {
+    if (mode != BILATERAL_AUTO) {
+        return mode;
+    }
+
+    return sigma_s <= BILATERAL_EXACT_MAX_SIGMA ? BILATERAL_EXACT
+                                                : BILATERAL_GRID;
+}
+
+const char *bilateral_mode_name(enum bilateral_mode mode) {
+    switch (mode) {
+    case BILATERAL_AUTO:
+        return "auto";
+    case BILATERAL_EXACT:
+        return "exact";
+    case BILATERAL_GRID:
+        return "grid";
+    }
+
+    return "unknown";
+}
+
+static unsigned char bilateral_clamp(float value) {
+    value += CONVOLVE_ROUNDING_BIAS;
+    if (value < 0.0f) {
+        value = 0.0f;
+    } else if (value > 255.0f) {
+        value = 255.0f;
+    }
+
+    return (unsigned char)value;
+}
+
+// The exact filter of channel c of pixel x of row y, with the window
+// clipped to the image.
+static unsigned char bilateral_value(const struct bilateral_args *a, int y,
+                                     int x, int c) {
+    int width = a->img->width;
+    int height = a->img->height;
+    int channels = a->img->channels;
+    int r = a->radius;
+    const unsigned char *bytes = a->img->bytes;
+    int center = bytes[((size_t)y * width + x) * channels + c];
+    float sum = 0.0f, weight = 0.0f;
+
+    for (int dy = -r; dy <= r; dy++) {
+        if (y + dy < 0 || y + dy >= height) {
+            continue;
+        }
+        for (int dx = -r; dx <= r; dx++) {
+            if (x + dx < 0 || x + dx >= width) {
+                continue;
+            }
+            int value =
+                bytes[((size_t)(y + dy) * width + x + dx) * channels + c];
+            float w = a->spatial[(dy + r) * (2 * r + 1) + dx + r] *
+                      a->range[value > center ? value - center
+                                              : center - value];
+            sum += w * value;
+            weight += w;
+        }
+    }
+
+    return bilateral_clamp(sum / weight);
+}
+
+// The exact filter of the values [from, to) of row y, whose windows lie
+// within the image horizontally, in whole vectors, returning where they
+// stop. Every vector keeps its sums in registers over the whole window, and
+// only the range weights are looked up lane by lane.
+__attribute__((target_clones("avx2", "default"))) static size_t
+bilateral_span(const struct bilateral_args *a, int y, size_t from, size_t to) {
+    int height = a->img->height;
+    int channels = a->img->channels;
+    size_t row_size = (size_t)a->img->width * channels;
+    int r = a->radius;
+    int y0 = y - r < 0 ? 0 : y - r;
+    int y1 = y + r >= height ? height - 1 : y + r;
+    const unsigned char *row = a->img->bytes + y * row_size;
+    unsigned char *dst = a->out->bytes + y * row_size;
+    size_t i = from;
+
+    for (; i + BILATERAL_LANES <= to; i += BILATERAL_LANES) {
+        bilateral_u8 bytes;
+        memcpy(&bytes, row + i, sizeof(bytes));
+        bilateral_i32 center = __builtin_convertvector(bytes, bilateral_i32);
+        bilateral_f32 sum = {0}, weight = {0};
+
+        for (int sy = y0; sy <= y1; sy++) {
+            const float *spatial = a->spatial + (sy - y + r) * (2 * r + 1);
+            const unsigned char *src =
+                a->img->bytes + sy * row_size + i - r * channels;
+            for (int dx = 0; dx <= 2 * r; dx++) {
+                memcpy(&bytes, src + dx * channels, sizeof(bytes));
+                bilateral_i32 s = __builtin_convertvector(bytes, bilateral_i32);
+                bilateral_i32 d = center - s;
+                bilateral_i32 sign = d >> 31;
+                d = (d ^ sign) - sign;
+
+                bilateral_f32 w;
+                for (int l = 0; l < BILATERAL_LANES; l++) {
+                    w[l] = a->range[d[l]];
+                }
+                w *= spatial[dx];
+                sum += w * __builtin_convertvector(s, bilateral_f32);
+                weight += w;
+            }
+        }
+
+        bilateral_i32 v = __builtin_convertvector(
+            sum / weight + CONVOLVE_ROUNDING_BIAS, bilateral_i32);
+        bytes = __builtin_convertvector(v, bilateral_u8);
+        memcpy(dst + i, &bytes, sizeof(bytes));
+    }
+
+    return i;
+}
+
+// Every thread takes its own rows. Values whose window reaches past the
+// left or right edge, and those left over from whole vectors, are filtered
+// one by one.
+static void bilateral_exact_thread(void *args, int index, int count) {
+    struct bilateral_args *a = (struct bilateral_args *)args;
+    int width = a->img->width;
+    int height = a->img->height;
+    int channels = a->img->channels;
+    size_t row_size = (size_t)width * channels;
+    size_t border = (size_t)a->radius * channels;
+    unsigned char *bytes = a->out->bytes;
+
+    int start_y = height / count * index;
+    int end_y = index == count - 1 ? height : height / count * (index + 1);
+
+    long start = trace_start();
+    for (int y = start_y; y < end_y; y++) {
+        size_t i = 0;
+        if (row_size > 2 * border) {
+            for (; i < border; i++) {
+                bytes[y * row_size + i] =
+                    bilateral_value(a, y, i / channels, i % channels);
+            }
+            i = bilateral_span(a, y, border, row_size - border);
+        }
+        for (; i < row_size; i++) {
+            bytes[y * row_size + i] =
+                bilateral_value(a, y, i / channels, i % channels);
+        }
+    }
+    trace_event("bilateral exact", start);
+}
+
+static int bilateral_exact(struct filter_context *ctx, struct image *img,
+                           float sigma_s, float sigma_r, struct image *out) {
+    int radius = (int)ceilf(2.0f * sigma_s);
+    int size = 2 * radius + 1;
+    float spatial[size * size];
+    float range[256];
+
+    for (int dy = -radius; dy <= radius; dy++) {
+        for (int dx = -radius; dx <= radius; dx++) {
+            spatial[(dy + radius) * size + dx + radius] =
+                expf(-(float)(dx * dx + dy * dy) / (2.0f * sigma_s * sigma_s));
+        }
+    }
+    for (int d = 0; d < 256; d++) {
+        range[d] = expf(-(float)(d * d) / (2.0f * sigma_r * sigma_r));
+    }
+
+    struct bilateral_args args = {
+        .img = img,
+        .radius = radius,
+        .spatial = spatial,
+        .range = range,
+        .out = out,
+    };
+
+    thread_pool_run(ctx->pool, bilateral_exact_thread, &args);
+
+    return 0;
+}
+
+// Blurs n cells, stride cells apart, with 1 4 6 4 1 in place. The scale of
+// the weights cancels out when the sums are divided by the weights.
+static void bilateral_blur(struct bilateral_cell *cells, int n, size_t stride,
+                           struct bilateral_cell *line) {
+    static const float taps[5] = {1.0f, 4.0f, 6.0f, 4.0f, 1.0f};
+
+    for (int i = 0; i < n; i++) {
+        line[i] = cells[i * stride];
+    }
+    for (int i = 0; i < n; i++) {
+        struct bilateral_cell c = {0.0f, 0.0f};
+        for (int k = -2; k <= 2; k++) {
+            if (i + k >= 0 && i + k < n) {
+                c.sum += taps[k + 2] * line[i + k].sum;
+                c.weight += taps[k + 2] * line[i + k].weight;
+            }
+        }
+        cells[i * stride] = c;
+    }
+}
+
+// Blurs the grid along y into blurred, one row of cells, stride floats, at
+// a time.
+__attribute__((target_clones("avx2", "default"))) static void
+bilateral_blur_rows(float *restrict dst, const float *restrict src, int gy,
+                    int rows, size_t stride) {
+    static const float taps[5] = {1.0f, 4.0f, 6.0f, 4.0f, 1.0f};
+
+    memset(dst, 0, stride * sizeof(float));
+    for (int k = -2; k <= 2; k++) {
+        if (gy + k < 0 || gy + k >= rows) {
+            continue;
+        }
+        const float *row = src + (gy + k) * stride;
+        for (size_t i = 0; i < stride; i++) {
+            dst[i] += taps[k + 2] * row[i];
+        }
+    }
+}
+
+// Interpolates the sum or the weight of the two cells of c along z.
+static float bilateral_lerp(const struct bilateral_cell *c, float tz,
+                            int weight) {
+    float a = weight ? c[0].weight : c[0].sum;
+    float b = weight ? c[1].weight : c[1].sum;
+    return a + tz * (b - a);
+}
+
+// Reads the blurred grid at a fractional position by trilinear
+// interpolation of the sums and the weights of the eight cells around it,
+// along z first. row points at the cells of row fy, next row at those of
+// the row after.
+static float bilateral_slice(const struct bilateral_cell *row,
+                             const struct bilateral_cell *next, int depth,
+                             float fx, float ty, float fz) {
+    int ix = (int)fx, iz = (int)fz;
+    float tx = fx - ix, tz = fz - iz;
+    size_t i = (size_t)ix * depth + iz;
+    float values[2];
+
+    for (int w = 0; w < 2; w++) {
+        float v00 = bilateral_lerp(row + i, tz, w);
+        float v01 = bilateral_lerp(row + i + depth, tz, w);
+        float v10 = bilateral_lerp(next + i, tz, w);
+        float v11 = bilateral_lerp(next + i + depth, tz, w);
+        float v0 = v00 + tx * (v01 - v00);
+        float v1 = v10 + tx * (v11 - v10);
+        values[w] = v0 + ty * (v1 - v0);
+    }
+
+    return values[0] / values[1];
+}
+
+// One channel after another: every thread fills and blurs along x and z its
+// own band of grid rows, which only the image rows nearest to them fall
+// into, then blurs its band along y once every band is filled, and finally
+// reads back its share of the image rows once every band is blurred.
+static void bilateral_grid_thread(void *args, int index, int count) {
+    struct bilateral_args *a = (struct bilateral_args *)args;
+    int width = a->img->width;
+    int height = a->img->height;
+    int channels = a->img->channels;
+    int gw = a->grid_width, gh = a->grid_height, gd = a->grid_depth;
+    size_t stride = (size_t)gw * gd;
+    struct bilateral_cell *line =
+        a->lines + (size_t)index * (gw > gd ? gw : gd);
+
+    int first = gh / count * index;
+    int last = index == count - 1 ? gh : gh / count * (index + 1);
+    int start_y = height / count * index;
+    int end_y = index == count - 1 ? height : height / count * (index + 1);
+
+    for (int c = 0; c < channels; c++) {
+        long start = trace_start();
+        memset(a->grid + first * stride, 0,
+               (last - first) * stride * sizeof(struct bilateral_cell));
+        for (int y = 0; y < height; y++) {
+            int gy = (int)(y * a->scale + 0.5f) + BILATERAL_GRID_PAD;
+            if (gy < first || gy >= last) {
+                continue;
+            }
+            const unsigned char *src =
+                a->img->bytes + (size_t)y * width * channels + c;
+            for (int x = 0; x < width; x++) {
+                int value = src[x * channels];
+                int gx = (int)(x * a->scale + 0.5f) + BILATERAL_GRID_PAD;
+                int gz = (int)(value * a->range_scale + 0.5f) +
+                         BILATERAL_GRID_PAD;
+                struct bilateral_cell *cell =
+                    a->grid + gy * stride + (size_t)gx * gd + gz;
+                cell->sum += value;
+                cell->weight += 1.0f;
+            }
+        }
+        for (int gy = first; gy < last; gy++) {
+            struct bilateral_cell *row = a->grid + gy * stride;
+            for (int gx = 0; gx < gw; gx++) {
+                bilateral_blur(row + (size_t)gx * gd, gd, 1, line);
+            }
+            for (int gz = 0; gz < gd; gz++) {
+                bilateral_blur(row + gz, gw, gd, line);
+            }
+        }
+        trace_event("bilateral grid splat", start);
+
+        thread_pool_barrier(a->pool);
+
+        start = trace_start();
+        for (int gy = first; gy < last; gy++) {
+            bilateral_blur_rows((float *)(a->blurred + gy * stride),
+                                (const float *)a->grid, gy, gh, 2 * stride);
+        }
+        trace_event("bilateral grid blur", start);
+
+        thread_pool_barrier(a->pool);
+
+        start = trace_start();
+        for (int y = start_y; y < end_y; y++) {
+            const unsigned char *src =
+                a->img->bytes + (size_t)y * width * channels + c;
+            unsigned char *dst =
+                a->out->bytes + (size_t)y * width * channels + c;
+            float fy = y * a->scale + BILATERAL_GRID_PAD;
+            const struct bilateral_cell *row = a->blurred + (int)fy * stride;
+            float ty = fy - (int)fy;
+            float scale = a->scale, range_scale = a->range_scale;
+            for (int x = 0; x < width; x++) {
+                float fx = x * scale + BILATERAL_GRID_PAD;
+                float fz =
+                    src[x * channels] * range_scale + BILATERAL_GRID_PAD;
+                dst[x * channels] = bilateral_clamp(
+                    bilateral_slice(row, row + stride, gd, fx, ty, fz));
+            }
+        }
+        trace_event("bilateral grid slice", start);
+    }
+}
+
+static int bilateral_grid(struct filter_context *ctx, struct image *img,
+                          float sigma_s, float sigma_r, struct image *out) {
+    struct bilateral_args args = {
+        .img = img,
+        .scale = 1.0f / (sigma_s > BILATERAL_GRID_MIN_CELL
+                             ? sigma_s
+                             : BILATERAL_GRID_MIN_CELL),
+        .range_scale = 1.0f / (sigma_r > BILATERAL_GRID_MIN_RANGE_CELL
+                                   ? sigma_r
+                                   : BILATERAL_GRID_MIN_RANGE_CELL),
+        .pool = ctx->pool,
+        .out = out,
+    };
+
+    // The nearest cells of the pixels and levels, the pad on either side,
+    // and one more for the interpolation past the last of them.
+    args.grid_width = (int)((img->width - 1) * args.scale) +
+                      2 * BILATERAL_GRID_PAD + 2;
+    args.grid_height = (int)((img->height - 1) * args.scale) +
+                       2 * BILATERAL_GRID_PAD + 2;
+    args.grid_depth = (int)(255.0f * args.range_scale) +
+                      2 * BILATERAL_GRID_PAD + 2;
+
+    int threads = thread_pool_size(ctx->pool);
+    size_t cells =
+        (size_t)args.grid_width * args.grid_height * args.grid_depth;
+    size_t line = args.grid_width > args.grid_depth ? args.grid_width
+                                                    : args.grid_depth;
+    struct bilateral_cell *scratch = filter_context_scratch(
+        ctx, (2 * cells + threads * line) * sizeof(struct bilateral_cell));
+    if (scratch == NULL) {
+        return 1;
+    }
+    args.grid = scratch;
+    args.blurred = scratch + cells;
+    args.lines = scratch + 2 * cells;
+
+    thread_pool_run(ctx->pool, bilateral_grid_thread, &args);
+
+    return 0;
+}
+
+int bilateral_filter(struct filter_context *ctx, struct image *img,
+                     float sigma_s, float sigma_r, enum bilateral_mode mode,
+                     struct image *out) {
+    if (!(sigma_s >= BILATERAL_MIN_SIGMA_S &&
+          sigma_s <= BILATERAL_MAX_SIGMA_S) ||
+        !(sigma_r >= BILATERAL_MIN_SIGMA_R &&
+          sigma_r <= BILATERAL_MAX_SIGMA_R)) {
+        LOG_ERROR("Bilateral sigmas out of range: %g, %g", sigma_s, sigma_r);
+        return 1;
+    }
+
+    if (bilateral_choose(sigma_s, mode) == BILATERAL_EXACT) {
+        return bilateral_exact(ctx, img, sigma_s, sigma_r, out);
+    }
+
+    return bilateral_grid(ctx, img, sigma_s, sigma_r, out);
+}
@@ -0,0 +1,132 @@
+#include "box.h"
+#include "trace.h"
+#include "util.h"
+#include <stdint.h>
+
+struct box_args {
+        struct image *img;
+        int radius;
+        uint32_t *sums;
+        uint32_t *columns;
+        struct thread_pool *pool;
+        struct image *out;
+};
+
+// Sum of the 2 * radius + 1 values around every value of a row, per
+// channel, sliding the window one pixel at a time.
+static void box_row(const unsigned char *src, int width, int channels,
+                    int radius, uint32_t *dst) {
+    for (int c = 0; c < channels; c++) {
+        uint32_t sum = 0;
+        for (int x = 0; x <= radius && x < width; x++) {
+            sum += src[x * channels + c];
+        }
+
+        for (int x = 0; x < width; x++) {
+            dst[x * channels + c] = sum;
+            if (x + radius + 1 < width) {
+                sum += src[(x + radius + 1) * channels + c];
+            }
+            if (x - radius >= 0) {
+                sum -= src[(x - radius) * channels + c];
+            }
+        }
+    }
+}
+
+// Every thread first sums the rows of its own horizontal patch, then, once
+// all rows are done, slides a column window down its patch, which reads the
+// row sums of its neighbours within the radius.
+static void box_thread(void *args, int index, int count) {
+    struct box_args *a = (struct box_args *)args;
+    int width = a->img->width;
+    int height = a->img->height;
+    int channels = a->img->channels;
+    size_t row_size = (size_t)width * channels;
+    int radius = a->radius;
+
+    int start_y = height / count * index;
+    int end_y = index == count - 1 ? height : height / count * (index + 1);
+
+    long start = trace_start();
+    for (int y = start_y; y < end_y; y++) {
+        box_row(a->img->bytes + y * row_size, width, channels, radius,
+                a->sums + y * row_size);
+    }
+    trace_event("box rows", start);
+
+    thread_pool_barrier(a->pool);
+    if (start_y == end_y) {
+        return;
+    }
+
+    start = trace_start();
+    uint32_t *column = a->columns + index * row_size;
+    for (size_t i = 0; i < row_size; i++) {
+        column[i] = 0;
+    }
+    for (int y = start_y - radius; y <= start_y + radius; y++) {
+        if (y < 0 || y >= height) {
+            continue;
+        }
+        const uint32_t *sum = a->sums + y * row_size;
+        for (size_t i = 0; i < row_size; i++) {
+            column[i] += sum[i];
+        }
+    }
+
+    // Rounding up by half a unit keeps exact quotients from landing just
+    // below an integer, and the gap to the next integer is far larger than
+    // the error of the double reciprocal.
+    double scale = 1.0 / ((double)(2 * radius + 1) * (2 * radius + 1));
+    for (int y = start_y; y < end_y; y++) {
+        unsigned char *dst = a->out->bytes + y * row_size;
+        for (size_t i = 0; i < row_size; i++) {
+            dst[i] = (unsigned char)((column[i] + 0.5) * scale);
+        }
+
+        if (y + radius + 1 < height) {
+            const uint32_t *add = a->sums + (y + radius + 1) * row_size;
+            for (size_t i = 0; i < row_size; i++) {
+                column[i] += add[i];
+            }
+        }
+        if (y - radius >= 0) {
+            const uint32_t *sub = a->sums + (y - radius) * row_size;
+            for (size_t i = 0; i < row_size; i++) {
+                column[i] -= sub[i];
+            }
+        }
+    }
+    trace_event("box columns", start);
+}
+
+int box_blur(struct filter_context *ctx, struct image *img, int radius,
+             struct image *out) {
+    int threads = thread_pool_size(ctx->pool);
+    size_t row_size = (size_t)img->width * img->channels;
+
+    if (radius < 0 || radius > BOX_MAX_RADIUS) {
+        LOG_ERROR("Box radius out of range: %d", radius);
+        return 1;
+    }
+
+    uint32_t *sums = filter_context_scratch(
+        ctx, ((size_t)img->height + threads) * row_size * sizeof(uint32_t));
+    if (sums == NULL) {
+        return 1;
+    }
+
+    struct box_args args = {
+        .img = img,
+        .radius = radius,
+        .sums = sums,
+        .columns = sums + (size_t)img->height * row_size,
+        .pool = ctx->pool,
+        .out = out,
+    };
+
+    thread_pool_run(ctx->pool, box_thread, &args);
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include "bufpool.h"
+#include "util.h"
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Blocks are mmap'ed and carry a header in front of the returned pointer.
+// Sizes up to 16 KiB are rounded to whole pages, larger ones to four classes
+// per power of two, so at most 25% of a block is wasted. Freed blocks are
+// kept on per-class free lists until max_cached_bytes is reached.
+#define BUFFER_POOL_HEADER_SIZE 64
+#define BUFFER_POOL_PAGE_SIZE 4096ul
+#define BUFFER_POOL_SMALL_CLASSES 4
+#define BUFFER_POOL_MAX_SHIFT 47
+#define BUFFER_POOL_CLASSES                                                    \
+    (BUFFER_POOL_SMALL_CLASSES + (BUFFER_POOL_MAX_SHIFT - 14) * 4)
+#define BUFFER_POOL_HUGEPAGE_SIZE (2ul * 1024ul * 1024ul)
+
+struct buffer_pool_block {
+        size_t mapped;
+        int index;
+        struct buffer_pool_block *next;
+};
+
+struct buffer_pool {
+        pthread_mutex_t mutex;
+        unsigned int flags;
+        size_t max_cached_bytes;
+        struct buffer_pool_block *free_lists[BUFFER_POOL_CLASSES];
+        struct buffer_pool_stats stats;
+};
+
+static struct buffer_pool pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .flags = 0,
+    .max_cached_bytes = BUFFER_POOL_MAX_CACHED_BYTES,
+};
+
+static size_t buffer_pool_round(size_t size, int *index) {
+    if (size <= BUFFER_POOL_SMALL_CLASSES * BUFFER_POOL_PAGE_SIZE) {
+        size_t pages = (size + BUFFER_POOL_PAGE_SIZE - 1) / BUFFER_POOL_PAGE_SIZE;
+        *index = pages - 1;
+        return pages * BUFFER_POOL_PAGE_SIZE;
+    }
+
+    int shift = 63 - __builtin_clzl(size - 1);
+    size_t base = (size_t)1 << shift;
+    size_t step = base / 4;
+    size_t k = (size - base + step - 1) / step;
+
+    if (shift >= BUFFER_POOL_MAX_SHIFT) {
+        *index = -1;
+    } else {
+        *index = BUFFER_POOL_SMALL_CLASSES + (shift - 14) * 4 + (k - 1);
+    }
+
+    return base + k * step;
+}
+
+static struct buffer_pool_block *buffer_pool_map(size_t mapped,
+                                                 unsigned int flags) {
+    int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (flags & BUFFER_POOL_PREFAULT) {
+        mmap_flags |= MAP_POPULATE;
+    }
+
+    void *ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if ((flags & BUFFER_POOL_HUGEPAGES) && mapped >= BUFFER_POOL_HUGEPAGE_SIZE) {
+        madvise(ptr, mapped, MADV_HUGEPAGE);
+    }
+#endif
+
+    return (struct buffer_pool_block *)ptr;
+}
+
+void buffer_pool_configure(unsigned int flags, size_t max_cached_bytes) {
+    pthread_mutex_lock(&pool.mutex);
+    pool.flags = flags;
+    pool.max_cached_bytes = max_cached_bytes;
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+static void buffer_pool_track(size_t mapped) {
+    pool.stats.bytes_in_use += mapped;
+    if (pool.stats.bytes_in_use > pool.stats.peak_bytes_in_use) {
+        pool.stats.peak_bytes_in_use = pool.stats.bytes_in_use;
+    }
+
+    size_t bytes_mapped = pool.stats.bytes_in_use + pool.stats.bytes_cached;
+    if (bytes_mapped > pool.stats.peak_bytes_mapped) {
+        pool.stats.peak_bytes_mapped = bytes_mapped;
+    }
+}
+
+void *buffer_pool_alloc(size_t size) {
+    int index;
+    size_t mapped = buffer_pool_round(size + BUFFER_POOL_HEADER_SIZE, &index);
+    struct buffer_pool_block *block = NULL;
+
+    pthread_mutex_lock(&pool.mutex);
+    if (index >= 0 && pool.free_lists[index] != NULL) {
+        block = pool.free_lists[index];
+        pool.free_lists[index] = block->next;
+        pool.stats.hits++;
+        pool.stats.bytes_cached -= mapped;
+        buffer_pool_track(mapped);
+        pthread_mutex_unlock(&pool.mutex);
+
+        block->next = NULL;
+        return (char *)block + BUFFER_POOL_HEADER_SIZE;
+    }
+    unsigned int flags = pool.flags;
+    pthread_mutex_unlock(&pool.mutex);
+
+    block = buffer_pool_map(mapped, flags);
+    if (block == NULL) {
+        LOG_ERROR("Could not map %zu bytes", mapped);
+        return NULL;
+    }
+    block->mapped = mapped;
+    block->index = index;
+    block->next = NULL;
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.stats.misses++;
+    buffer_pool_track(mapped);
+    pthread_mutex_unlock(&pool.mutex);
+
+    return (char *)block + BUFFER_POOL_HEADER_SIZE;
+}
+
+static struct buffer_pool_block *buffer_pool_block_of(void *ptr) {
+    return (struct buffer_pool_block *)((char *)ptr - BUFFER_POOL_HEADER_SIZE);
+}
+
+void *buffer_pool_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return buffer_pool_alloc(size);
+    }
+
+    struct buffer_pool_block *block = buffer_pool_block_of(ptr);
+    size_t usable = block->mapped - BUFFER_POOL_HEADER_SIZE;
+    if (size <= usable) {
+        return ptr;
+    }
+
+    void *resized = buffer_pool_alloc(size);
+    if (resized == NULL) {
+        return NULL;
+    }
+
+    memcpy(resized, ptr, usable);
+    buffer_pool_free(ptr);
+
+    return resized;
+}
+
+void buffer_pool_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    struct buffer_pool_block *block = buffer_pool_block_of(ptr);
+    size_t mapped = block->mapped;
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.stats.frees++;
+    pool.stats.bytes_in_use -= mapped;
+    if (block->index >= 0 &&
+        pool.stats.bytes_cached + mapped <= pool.max_cached_bytes) {
+        block->next = pool.free_lists[block->index];
+        pool.free_lists[block->index] = block;
+        pool.stats.bytes_cached += mapped;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    if (block != NULL) {
+        munmap(block, mapped);
+    }
+}
+
+void buffer_pool_get_stats(struct buffer_pool_stats *stats) {
+    pthread_mutex_lock(&pool.mutex);
+    *stats = pool.stats;
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void buffer_pool_print_stats(void) {
+    struct buffer_pool_stats stats;
+    buffer_pool_get_stats(&stats);
+
+    LOG_INFO("buffer pool: %zu hits, %zu misses, %zu frees", stats.hits,
+             stats.misses, stats.frees);
+    LOG_INFO("buffer pool: %zu bytes in use, %zu cached, peak %zu in use, "
+             "peak %zu mapped",
+             stats.bytes_in_use, stats.bytes_cached, stats.peak_bytes_in_use,
+             stats.peak_bytes_mapped);
+}
+
+// Returns every cached block to the system.
+void buffer_pool_trim(void) {
+    struct buffer_pool_block *blocks = NULL;
+
+    pthread_mutex_lock(&pool.mutex);
+    for (int i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        while (pool.free_lists[i] != NULL) {
+            struct buffer_pool_block *block = pool.free_lists[i];
+            pool.free_lists[i] = block->next;
+            block->next = blocks;
+            blocks = block;
+        }
+    }
+    pool.stats.bytes_cached = 0;
+    pthread_mutex_unlock(&pool.mutex);
+
+    while (blocks != NULL) {
+        struct buffer_pool_block *next = blocks->next;
+        munmap(blocks, blocks->mapped);
+        blocks = next;
+    }
+}
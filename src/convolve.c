@@ -0,0 +1,274 @@
+#include "convolve.h"
+#include "trace.h"
+#include <complex.h>
+#include <math.h>
+#include <string.h>
+
+struct convolve_separable_args {
+        struct image *img;
+        const float *row;
+        const float *col;
+        int size;
+        float *buffers;
+        size_t buffer_floats;
+        struct image *out;
+};
+
+struct convolve_fft_args {
+        struct image *img;
+        int size;
+        int n;
+        const double complex *spectrum;
+        const double complex *twiddles;
+        double complex *tiles;
+        struct image *out;
+};
+
+static unsigned char convolve_store(float accum) {
+    accum += CONVOLVE_ROUNDING_BIAS;
+    if (accum < 0.0f) {
+        accum = 0.0f;
+    } else if (accum > 255.0f) {
+        accum = 255.0f;
+    }
+
+    return (unsigned char)accum;
+}
+
+// Every thread convolves the rows of its own horizontal patch, plus the
+// rows above and below it that the vertical pass reads, into a float buffer
+// and then runs the vertical pass out of that buffer.
+static void convolve_separable_thread(void *args, int index, int count) {
+    struct convolve_separable_args *a = (struct convolve_separable_args *)args;
+    int height = a->img->height;
+    int channels = a->img->channels;
+    int row_size = a->img->width * channels;
+    int radius = a->size / 2;
+
+    int start_y = height / count * index;
+    int end_y = index == count - 1 ? height : height / count * (index + 1);
+    if (start_y == end_y) {
+        return;
+    }
+
+    int rows = end_y - start_y + 2 * radius;
+    float *buffer = a->buffers + (size_t)index * a->buffer_floats;
+    float *acc = buffer + (size_t)rows * row_size;
+
+    long start = trace_start();
+    for (int r = 0; r < rows; r++) {
+        int y = start_y - radius + r;
+        float *dst = buffer + (size_t)r * row_size;
+        memset(dst, 0, row_size * sizeof(float));
+        if (y < 0 || y >= height) {
+            continue;
+        }
+
+        const unsigned char *src = a->img->bytes + (size_t)y * row_size;
+        for (int kx = 0; kx < a->size; kx++) {
+            float weight = a->row[a->size - kx - 1];
+            int shift = (kx - radius) * channels;
+            int lo = shift < 0 ? -shift : 0;
+            int hi = shift > 0 ? row_size - shift : row_size;
+            for (int i = lo; i < hi; i++) {
+                dst[i] += weight * src[i + shift];
+            }
+        }
+    }
+    trace_event("separable rows", start);
+
+    start = trace_start();
+    for (int y = start_y; y < end_y; y++) {
+        memset(acc, 0, row_size * sizeof(float));
+        for (int ky = 0; ky < a->size; ky++) {
+            float weight = a->col[a->size - ky - 1];
+            const float *src =
+                buffer + (size_t)(y - start_y + ky) * row_size;
+            for (int i = 0; i < row_size; i++) {
+                acc[i] += weight * src[i];
+            }
+        }
+
+        unsigned char *dst = a->out->bytes + (size_t)y * row_size;
+        for (int i = 0; i < row_size; i++) {
+            dst[i] = convolve_store(acc[i]);
+        }
+    }
+    trace_event("separable columns", start);
+}
+
+int convolve_separable(struct filter_context *ctx, struct image *img,
+                       const float *row, const float *col, int size,
+                       struct image *out) {
+    // Every thread gets room for the rows of the last, largest patch plus
+    // its margins and one accumulator row.
+    int threads = thread_pool_size(ctx->pool);
+    int rows = img->height / threads + img->height % threads + size - 1;
+    size_t buffer_floats =
+        ((size_t)rows + 1) * img->width * img->channels;
+    float *buffers = filter_context_scratch(
+        ctx, (size_t)threads * buffer_floats * sizeof(float));
+    if (buffers == NULL) {
+        return 1;
+    }
+
+    struct convolve_separable_args args = {
+        .img = img,
+        .row = row,
+        .col = col,
+        .size = size,
+        .buffers = buffers,
+        .buffer_floats = buffer_floats,
+        .out = out,
+    };
+
+    thread_pool_run(ctx->pool, convolve_separable_thread, &args);
+
+    return 0;
+}
+
+// In-place radix-2 FFT of n values stride apart. twiddles holds
+// exp(-2 pi i k / n) for k < n / 2; the inverse transform is unscaled.
+static void convolve_fft_1d(double complex *data, int n, int stride,
+                            const double complex *twiddles, int inverse) {
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j |= bit;
+        if (i < j) {
+            double complex t = data[i * stride];
+            data[i * stride] = data[j * stride];
+            data[j * stride] = t;
+        }
+    }
+
+    for (int length = 2; length <= n; length <<= 1) {
+        int step = n / length;
+        for (int i = 0; i < n; i += length) {
+            for (int j = 0; j < length / 2; j++) {
+                double complex w = twiddles[j * step];
+                if (inverse) {
+                    w = conj(w);
+                }
+                double complex u = data[(i + j) * stride];
+                double complex v = data[(i + j + length / 2) * stride] * w;
+                data[(i + j) * stride] = u + v;
+                data[(i + j + length / 2) * stride] = u - v;
+            }
+        }
+    }
+}
+
+static void convolve_fft_2d(double complex *data, int n,
+                            const double complex *twiddles, int inverse) {
+    for (int i = 0; i < n; i++) {
+        convolve_fft_1d(data + (size_t)i * n, n, 1, twiddles, inverse);
+    }
+    for (int i = 0; i < n; i++) {
+        convolve_fft_1d(data + i, n, n, twiddles, inverse);
+    }
+}
+
+// Overlap-save: every n x n tile starts one kernel radius before the outputs
+// it produces, and the circular convolution is exact from size - 1 on, so
+// each tile yields n - size + 1 rows and columns.
+static void convolve_fft_thread(void *args, int index, int count) {
+    struct convolve_fft_args *a = (struct convolve_fft_args *)args;
+    int width = a->img->width;
+    int height = a->img->height;
+    int channels = a->img->channels;
+    int n = a->n;
+    int margin = a->size - 1;
+    int step = n - margin;
+    int tiles_x = (width + step - 1) / step;
+    int tiles_y = (height + step - 1) / step;
+    double scale = 1.0 / ((double)n * n);
+    double complex *data = a->tiles + (size_t)index * n * n;
+
+    for (int t = index; t < tiles_x * tiles_y; t += count) {
+        long start = trace_start();
+        int tx = t % tiles_x * step;
+        int ty = t / tiles_x * step;
+
+        for (int c = 0; c < channels; c++) {
+            for (int i = 0; i < n; i++) {
+                int y = ty - margin / 2 + i;
+                for (int j = 0; j < n; j++) {
+                    int x = tx - margin / 2 + j;
+                    double value = 0.0;
+                    if (x >= 0 && x < width && y >= 0 && y < height) {
+                        value = a->img->bytes[((size_t)y * width + x) *
+                                                  channels +
+                                              c];
+                    }
+                    data[(size_t)i * n + j] = value;
+                }
+            }
+
+            convolve_fft_2d(data, n, a->twiddles, 0);
+            for (size_t i = 0; i < (size_t)n * n; i++) {
+                data[i] *= a->spectrum[i];
+            }
+            convolve_fft_2d(data, n, a->twiddles, 1);
+
+            for (int y = ty; y < ty + step && y < height; y++) {
+                for (int x = tx; x < tx + step && x < width; x++) {
+                    double value = creal(data[(size_t)(y - ty + margin) * n +
+                                              x - tx + margin]) *
+                                   scale;
+                    a->out->bytes[((size_t)y * width + x) * channels + c] =
+                        convolve_store((float)value);
+                }
+            }
+        }
+        trace_event("fft tile", start);
+    }
+}
+
+int convolve_fft(struct filter_context *ctx, struct image *img,
+                 struct kernel *k, struct image *out) {
+    int n = CONVOLVE_FFT_MIN_TILE;
+    while (n < 4 * k->size) {
+        n <<= 1;
+    }
+
+    // Scratch holds the kernel spectrum, one tile per thread and the
+    // twiddles, in that order.
+    int threads = thread_pool_size(ctx->pool);
+    size_t tile = (size_t)n * n;
+    double complex *spectrum = filter_context_scratch(
+        ctx, ((threads + 1) * tile + n / 2) * sizeof(double complex));
+    if (spectrum == NULL) {
+        return 1;
+    }
+    double complex *tiles = spectrum + tile;
+    double complex *twiddles = tiles + threads * tile;
+
+    memset(spectrum, 0, tile * sizeof(double complex));
+    for (int i = 0; i < n / 2; i++) {
+        twiddles[i] = cexp(-2.0 * M_PI * I * i / n);
+    }
+
+    for (int y = 0; y < k->size; y++) {
+        for (int x = 0; x < k->size; x++) {
+            spectrum[(size_t)y * n + x] = k->values[y * k->size + x];
+        }
+    }
+    convolve_fft_2d(spectrum, n, twiddles, 0);
+
+    struct convolve_fft_args args = {
+        .img = img,
+        .size = k->size,
+        .n = n,
+        .spectrum = spectrum,
+        .twiddles = twiddles,
+        .tiles = tiles,
+        .out = out,
+    };
+
+    thread_pool_run(ctx->pool, convolve_fft_thread, &args);
+
+    return 0;
+}
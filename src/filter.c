@@ -0,0 +1,165 @@
+#include "filter.h"
+#include "backend.h"
+#include "bufpool.h"
+#include "trace.h"
+#include "util.h"
+#include <string.h>
+
+int image_apply_kernel_single_thread(struct image *img, struct kernel *k,
+                                     struct image *tmp, struct image *out,
+                                     int repeats) {
+    if (image_reserve(tmp, img->width, img->height, img->channels) != 0) {
+        return 1;
+    }
+    memcpy(tmp->bytes, img->bytes, img->width * img->height * img->channels);
+
+    for (int i = 0; i < repeats; i++) {
+        long start = trace_start();
+        image_apply_kernel(tmp, k, out);
+        trace_event("patch", start);
+
+        start = trace_start();
+        memcpy(tmp->bytes, out->bytes, out->width * out->height * out->channels);
+        trace_event("memcpy", start);
+    }
+
+    return 0;
+}
+
+struct thread_args {
+        struct image *img;
+        struct kernel *k;
+        int repeats;
+        struct thread_pool *pool;
+        image_patch_fn patch;
+        struct image *out;
+};
+
+static void image_apply_kernel_patch_thread(void *args, int index, int count) {
+    struct thread_args *a = (struct thread_args *)args;
+
+    int patch_height = a->img->height / count;
+    int start_y = index * patch_height;
+    int end_y = (index + 1) * patch_height;
+    if (index == count - 1) {
+        end_y = a->img->height;
+    }
+
+    int offset = a->img->width * start_y * a->img->channels;
+    int size = a->img->width * (end_y - start_y) * a->img->channels;
+
+    for (int i = 0; i < a->repeats; i++) {
+        long start = trace_start();
+        a->patch(a->img, a->k, 0, start_y, a->img->width, end_y, a->out);
+        trace_event("patch", start);
+
+        start = trace_start();
+        thread_pool_barrier(a->pool);
+        trace_event("barrier", start);
+
+        start = trace_start();
+        memcpy(a->img->bytes + offset, a->out->bytes + offset, size);
+        trace_event("memcpy", start);
+
+        // Neighbouring patches read our border rows on the next repeat.
+        start = trace_start();
+        thread_pool_barrier(a->pool);
+        trace_event("barrier", start);
+    }
+}
+
+static int image_apply_kernel_pool(struct image *img, struct kernel *k,
+                                   struct thread_pool *pool,
+                                   image_patch_fn patch, struct image *tmp,
+                                   struct image *out, int repeats) {
+    if (image_reserve(tmp, img->width, img->height, img->channels) != 0) {
+        return 1;
+    }
+    memcpy(tmp->bytes, img->bytes, img->width * img->height * img->channels);
+
+    struct thread_args args = {
+        .img = tmp,
+        .k = k,
+        .repeats = repeats,
+        .pool = pool,
+        .patch = patch,
+        .out = out,
+    };
+
+    thread_pool_run(pool, image_apply_kernel_patch_thread, &args);
+
+    return 0;
+}
+
+int image_apply_kernel_multi_thread(struct image *img, struct kernel *k,
+                                    struct thread_pool *pool,
+                                    struct image *tmp, struct image *out,
+                                    int repeats) {
+    return image_apply_kernel_pool(img, k, pool, image_apply_kernel_patch, tmp,
+                                   out, repeats);
+}
+
+int image_apply_kernel_simd(struct image *img, struct kernel *k,
+                            struct thread_pool *pool, struct image *tmp,
+                            struct image *out, int repeats) {
+    return image_apply_kernel_pool(img, k, pool, image_apply_kernel_patch_simd,
+                                   tmp, out, repeats);
+}
+
+int filter_context_init(struct filter_context *ctx, int threads,
+                        const char *backend) {
+    ctx->tmp = (struct image){0};
+    ctx->bands = (struct image){0};
+    ctx->scratch = NULL;
+    ctx->scratch_size = 0;
+    ctx->pool = NULL;
+    ctx->backend = backend_select(backend);
+    if (ctx->backend == NULL) {
+        return 1;
+    }
+
+    ctx->pool = thread_pool_new(threads);
+    if (ctx->pool == NULL) {
+        return 1;
+    }
+
+    return 0;
+}
+
+int filter_context_apply(struct filter_context *ctx, struct image *img,
+                         struct kernel *k, struct image *out, int repeats) {
+    if (image_reserve(out, img->width, img->height, img->channels) != 0) {
+        return 1;
+    }
+
+    return ctx->backend->apply(ctx, img, k, out, repeats);
+}
+
+// At least size bytes of memory that stays with the context, so operations
+// reuse it across images. Its contents do not survive the next call.
+void *filter_context_scratch(struct filter_context *ctx, size_t size) {
+    if (ctx->scratch != NULL && ctx->scratch_size >= size) {
+        return ctx->scratch;
+    }
+
+    buffer_pool_free(ctx->scratch);
+    ctx->scratch_size = 0;
+    ctx->scratch = buffer_pool_alloc(size);
+    if (ctx->scratch == NULL) {
+        LOG_ERROR("Could not allocate scratch memory");
+        return NULL;
+    }
+    ctx->scratch_size = size;
+
+    return ctx->scratch;
+}
+
+void filter_context_destroy(struct filter_context *ctx) {
+    image_destroy(&ctx->tmp);
+    image_destroy(&ctx->bands);
+    buffer_pool_free(ctx->scratch);
+    ctx->scratch = NULL;
+    ctx->scratch_size = 0;
+    thread_pool_free(ctx->pool);
+    ctx->pool = NULL;
+}
@@ -0,0 +1,291 @@
+#include "gaussian.h"
+#include "convolve.h"
+#include "trace.h"
+#include "util.h"
+#include <math.h>
+#include <string.h>
+
+// Rows are filtered GAUSSIAN_LANES at a time, one row per vector lane.
+#define GAUSSIAN_LANES 8
+// Values per column chunk, whose recursion state stays in L1 while the
+// chunk is walked down the whole image.
+#define GAUSSIAN_CHUNK 512
+
+typedef float gaussian_f32 __attribute__((vector_size(GAUSSIAN_LANES * 4)));
+typedef double gaussian_f64 __attribute__((vector_size(GAUSSIAN_LANES * 8)));
+
+// Coefficients of w[n] = b * x[n] + a[0] w[n-1] + a[1] w[n-2] + a[2] w[n-3]
+// and of its anti-causal mirror image. tail maps the last three causal
+// outputs w[n-1], w[n-2], w[n-3] of a line to the first three anti-causal
+// outputs beyond it, y[n], y[n+1], y[n+2], when the input continues with
+// zeros.
+struct gaussian_coefficients {
+        double b;
+        double a[3];
+        double tail[3][3];
+};
+
+// values is the float image, lines holds a line of lanes per thread.
+struct gaussian_args {
+        struct image *img;
+        const struct gaussian_coefficients *g;
+        float *values;
+        gaussian_f32 *lines;
+        struct thread_pool *pool;
+        struct image *out;
+};
+
+// Young, van Vliet and van Ginkel: q from sigma, and the normalized
+// coefficients of the third order recursion.
+static void gaussian_coefficients_init(struct gaussian_coefficients *g,
+                                       float sigma) {
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+                            : 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+    double b3 = 0.422205 * q * q * q;
+    double *a = g->a;
+
+    a[0] = b1 / b0;
+    a[1] = b2 / b0;
+    a[2] = b3 / b0;
+    g->b = 1.0 - a[0] - a[1] - a[2];
+
+    // The tail follows from running the causal recursion on with zero input
+    // until it has died out, and the anti-causal one back from there, once
+    // for every one of the three causal outputs it depends on.
+    int length = (int)ceil(10.0 * sigma) + 64;
+    double w[length + 3], y[length + 3];
+    for (int j = 0; j < 3; j++) {
+        memset(w, 0, sizeof(w));
+        memset(y, 0, sizeof(y));
+        w[2 - j] = 1.0;
+        for (int n = 3; n < length + 3; n++) {
+            w[n] = a[0] * w[n - 1] + a[1] * w[n - 2] + a[2] * w[n - 3];
+        }
+        for (int n = length - 1; n >= 3; n--) {
+            y[n] = g->b * w[n] + a[0] * y[n + 1] + a[1] * y[n + 2] +
+                   a[2] * y[n + 3];
+        }
+        for (int k = 0; k < 3; k++) {
+            g->tail[k][j] = y[3 + k];
+        }
+    }
+}
+
+static unsigned char gaussian_clamp(float value) {
+    value += CONVOLVE_ROUNDING_BIAS;
+    if (value < 0.0f) {
+        value = 0.0f;
+    } else if (value > 255.0f) {
+        value = 255.0f;
+    }
+
+    return (unsigned char)value;
+}
+
+// Filters one channel of GAUSSIAN_LANES rows, gathered from the image into
+// line, a vector per pixel, and scatters the result to the float image. The
+// recursion runs in double precision: for large sigma its poles are close to
+// one, and float state drifts by several levels over a line.
+static void gaussian_rows(const struct gaussian_args *a, int y0, int rows,
+                          int c, gaussian_f32 *line) {
+    const struct gaussian_coefficients *g = a->g;
+    int width = a->img->width;
+    int channels = a->img->channels;
+    size_t row_size = (size_t)width * channels;
+
+    for (int x = 0; x < width; x++) {
+        gaussian_f32 v = {0};
+        for (int l = 0; l < rows; l++) {
+            v[l] = a->img->bytes[(y0 + l) * row_size + x * channels + c];
+        }
+        line[x] = v;
+    }
+
+    gaussian_f64 w1 = {0}, w2 = {0}, w3 = {0};
+    for (int x = 0; x < width; x++) {
+        gaussian_f64 w = g->b * __builtin_convertvector(line[x], gaussian_f64) +
+                         g->a[0] * w1 + g->a[1] * w2 + g->a[2] * w3;
+        line[x] = __builtin_convertvector(w, gaussian_f32);
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
+    }
+
+    gaussian_f64 y1 = g->tail[0][0] * w1 + g->tail[0][1] * w2 +
+                      g->tail[0][2] * w3;
+    gaussian_f64 y2 = g->tail[1][0] * w1 + g->tail[1][1] * w2 +
+                      g->tail[1][2] * w3;
+    gaussian_f64 y3 = g->tail[2][0] * w1 + g->tail[2][1] * w2 +
+                      g->tail[2][2] * w3;
+    for (int x = width - 1; x >= 0; x--) {
+        gaussian_f64 y = g->b * __builtin_convertvector(line[x], gaussian_f64) +
+                         g->a[0] * y1 + g->a[1] * y2 + g->a[2] * y3;
+        line[x] = __builtin_convertvector(y, gaussian_f32);
+        y3 = y2;
+        y2 = y1;
+        y1 = y;
+    }
+
+    for (int x = 0; x < width; x++) {
+        for (int l = 0; l < rows; l++) {
+            a->values[(y0 + l) * row_size + x * channels + c] = line[x][l];
+        }
+    }
+}
+
+// One step of the recursion for n values: the new state from the input row
+// and the three previous states, stored back as the output row too.
+__attribute__((target_clones("avx2", "default"))) static void
+gaussian_step(const struct gaussian_coefficients *g, float *restrict row,
+              double *restrict s0, const double *restrict s1,
+              const double *restrict s2, const double *restrict s3, int n) {
+    for (int i = 0; i < n; i++) {
+        s0[i] = g->b * row[i] + g->a[0] * s1[i] + g->a[1] * s2[i] +
+                g->a[2] * s3[i];
+        row[i] = (float)s0[i];
+    }
+}
+
+// Runs both passes down columns [from, from + n) of the float image, keeping
+// the last four rows of state of the chunk in a small ring.
+static void gaussian_chunk(const struct gaussian_args *a, size_t from, int n,
+                           double state[4][GAUSSIAN_CHUNK]) {
+    const struct gaussian_coefficients *g = a->g;
+    int height = a->img->height;
+    size_t row_size = (size_t)a->img->width * a->img->channels;
+
+    memset(state, 0, 4 * sizeof(state[0]));
+    for (int y = 0; y < height; y++) {
+        gaussian_step(g, a->values + y * row_size + from, state[y % 4],
+                      state[(y + 3) % 4], state[(y + 2) % 4],
+                      state[(y + 1) % 4], n);
+    }
+
+    // The causal outputs of the last three rows are in the ring, and zero
+    // for rows before the first.
+    double tails[3][GAUSSIAN_CHUNK];
+    for (int k = 0; k < 3; k++) {
+        for (int i = 0; i < n; i++) {
+            tails[k][i] = 0.0;
+            for (int j = 0; j < 3; j++) {
+                tails[k][i] += g->tail[k][j] * state[(height + 3 - j) % 4][i];
+            }
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        memcpy(state[(height + k) % 4], tails[k], n * sizeof(double));
+    }
+
+    for (int y = height - 1; y >= 0; y--) {
+        float *row = a->values + y * row_size + from;
+        gaussian_step(g, row, state[y % 4], state[(y + 1) % 4],
+                      state[(y + 2) % 4], state[(y + 3) % 4], n);
+
+        unsigned char *dst = a->out->bytes + y * row_size + from;
+        for (int i = 0; i < n; i++) {
+            dst[i] = gaussian_clamp(row[i]);
+        }
+    }
+}
+
+static void gaussian_thread(void *args, int index, int count) {
+    struct gaussian_args *a = (struct gaussian_args *)args;
+    int width = a->img->width;
+    int height = a->img->height;
+    int channels = a->img->channels;
+    size_t row_size = (size_t)width * channels;
+
+    // Rows: every thread takes a share of the groups of lanes.
+    int groups = (height + GAUSSIAN_LANES - 1) / GAUSSIAN_LANES;
+    int first = groups / count * index;
+    int last = index == count - 1 ? groups : groups / count * (index + 1);
+    gaussian_f32 *line = a->lines + (size_t)index * width;
+
+    long start = trace_start();
+    for (int group = first; group < last; group++) {
+        int y0 = group * GAUSSIAN_LANES;
+        int rows = height - y0 < GAUSSIAN_LANES ? height - y0 : GAUSSIAN_LANES;
+        for (int c = 0; c < channels; c++) {
+            gaussian_rows(a, y0, rows, c, line);
+        }
+    }
+    trace_event("gaussian rows", start);
+
+    thread_pool_barrier(a->pool);
+
+    // Columns: the chunks of a row are dealt out to the threads.
+    double state[4][GAUSSIAN_CHUNK];
+    size_t chunks = (row_size + GAUSSIAN_CHUNK - 1) / GAUSSIAN_CHUNK;
+
+    start = trace_start();
+    for (size_t chunk = index; chunk < chunks; chunk += count) {
+        size_t from = chunk * GAUSSIAN_CHUNK;
+        size_t n = row_size - from < GAUSSIAN_CHUNK ? row_size - from
+                                                     : GAUSSIAN_CHUNK;
+        gaussian_chunk(a, from, (int)n, state);
+    }
+    trace_event("gaussian columns", start);
+}
+
+// Small sigmas, where the recursion is least accurate, are convolved with
+// the sampled Gaussian instead, truncated at four sigma and normalized. The
+// kernel stays short enough to cost about as much as the recursion.
+static int gaussian_sampled(struct filter_context *ctx, struct image *img,
+                            float sigma, struct image *out) {
+    float weights[GAUSSIAN_SAMPLED_MAX_SIZE];
+    int radius = (int)ceilf(4.0f * sigma);
+    int size = 2 * radius + 1;
+    float sum = 0.0f;
+
+    for (int i = 0; i < size; i++) {
+        float d = (float)(i - radius);
+        weights[i] = expf(-d * d / (2.0f * sigma * sigma));
+        sum += weights[i];
+    }
+    for (int i = 0; i < size; i++) {
+        weights[i] /= sum;
+    }
+
+    return convolve_separable(ctx, img, weights, weights, size, out);
+}
+
+int gaussian_blur(struct filter_context *ctx, struct image *img, float sigma,
+                  struct image *out) {
+    if (!(sigma >= GAUSSIAN_MIN_SIGMA && sigma <= GAUSSIAN_MAX_SIGMA)) {
+        LOG_ERROR("Gaussian sigma out of range: %g", sigma);
+        return 1;
+    }
+    if (sigma < GAUSSIAN_RECURSIVE_MIN_SIGMA) {
+        return gaussian_sampled(ctx, img, sigma, out);
+    }
+
+    struct gaussian_coefficients g;
+    gaussian_coefficients_init(&g, sigma);
+
+    // The lines of lanes start at a whole vector after the float image.
+    int threads = thread_pool_size(ctx->pool);
+    size_t floats = (size_t)img->height * img->width * img->channels;
+    floats = (floats + GAUSSIAN_LANES - 1) / GAUSSIAN_LANES * GAUSSIAN_LANES;
+    size_t size = floats * sizeof(float) +
+                  (size_t)threads * img->width * sizeof(gaussian_f32);
+    float *values = filter_context_scratch(ctx, size);
+    if (values == NULL) {
+        return 1;
+    }
+
+    struct gaussian_args args = {
+        .img = img,
+        .g = &g,
+        .values = values,
+        .lines = (gaussian_f32 *)(values + floats),
+        .pool = ctx->pool,
+        .out = out,
+    };
+
+    thread_pool_run(ctx->pool, gaussian_thread, &args);
+
+    return 0;
+}
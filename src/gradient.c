@@ -0,0 +1,220 @@
+#include "gradient.h"
+#include "convolve.h"
+#include "trace.h"
+#include "util.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Values of a row computed at once, 16-bit derivatives in a vector each.
+#define GRADIENT_LANES 16
+
+typedef uint8_t gradient_u8 __attribute__((vector_size(GRADIENT_LANES)));
+typedef int16_t gradient_i16 __attribute__((vector_size(GRADIENT_LANES * 2)));
+typedef int32_t gradient_i32 __attribute__((vector_size(GRADIENT_LANES * 4)));
+typedef float gradient_f32 __attribute__((vector_size(GRADIENT_LANES * 4)));
+
+struct gradient_args {
+        struct image *img;
+        int side;
+        int center;
+        enum gradient_norm norm;
+        float scale;
+        int direction;
+        struct image *out;
+};
+
+static unsigned char gradient_clamp(float value) {
+    value += CONVOLVE_ROUNDING_BIAS;
+    if (value < 0.0f) {
+        value = 0.0f;
+    } else if (value > 255.0f) {
+        value = 255.0f;
+    }
+
+    return (unsigned char)value;
+}
+
+static unsigned char gradient_angle(int gx, int gy) {
+    if (gx == 0 && gy == 0) {
+        return 0;
+    }
+
+    float t = atan2f((float)gy, (float)gx) * (128.0f / (float)M_PI);
+    if (t < 0.0f) {
+        t += 256.0f;
+    }
+
+    // Angles just below the full circle can round up to it.
+    return t < 255.0f ? (unsigned char)t : 255;
+}
+
+static unsigned char gradient_value(const struct gradient_args *a, int gx,
+                                    int gy) {
+    if (a->direction) {
+        return gradient_angle(gx, gy);
+    }
+
+    float m = a->norm == GRADIENT_L1 ? (float)(abs(gx) + abs(gy))
+                                     : sqrtf((float)(gx * gx + gy * gy));
+    return gradient_clamp(m * a->scale);
+}
+
+// One value at index i of the rows above, at and below the output row,
+// whose left and right neighbours are left and right bytes away.
+static unsigned char gradient_scalar(const struct gradient_args *a,
+                                     const unsigned char *above,
+                                     const unsigned char *row,
+                                     const unsigned char *below, size_t i,
+                                     size_t left, size_t right) {
+    int gx = a->side * (above[i + right] - above[i - left]) +
+             a->center * (row[i + right] - row[i - left]) +
+             a->side * (below[i + right] - below[i - left]);
+    int gy = a->side * (below[i - left] - above[i - left]) +
+             a->center * (below[i] - above[i]) +
+             a->side * (below[i + right] - above[i + right]);
+
+    return gradient_value(a, gx, gy);
+}
+
+static void gradient_load(const unsigned char *p, gradient_i16 *v) {
+    gradient_u8 bytes;
+    memcpy(&bytes, p, sizeof(bytes));
+    *v = __builtin_convertvector(bytes, gradient_i16);
+}
+
+// Values [from, to) of a row, none of them in the first or last pixel, in
+// whole vectors, returning where they stop. The eight neighbour loads are
+// shared by both derivatives, and the magnitude is taken in the same
+// registers.
+__attribute__((target_clones("avx2", "default"))) static size_t
+gradient_span(const struct gradient_args *a, const unsigned char *above,
+              const unsigned char *row, const unsigned char *below,
+              size_t from, size_t to, size_t channels, unsigned char *dst) {
+    int16_t side = (int16_t)a->side, center = (int16_t)a->center;
+    size_t i = from;
+
+    for (; i + GRADIENT_LANES <= to; i += GRADIENT_LANES) {
+        gradient_i16 a0, a1, a2, r0, r2, b0, b1, b2;
+        gradient_load(above + i - channels, &a0);
+        gradient_load(above + i, &a1);
+        gradient_load(above + i + channels, &a2);
+        gradient_load(row + i - channels, &r0);
+        gradient_load(row + i + channels, &r2);
+        gradient_load(below + i - channels, &b0);
+        gradient_load(below + i, &b1);
+        gradient_load(below + i + channels, &b2);
+
+        gradient_i16 gx =
+            side * (a2 - a0) + center * (r2 - r0) + side * (b2 - b0);
+        gradient_i16 gy =
+            side * (b0 - a0) + center * (b1 - a1) + side * (b2 - a2);
+
+        if (a->direction) {
+            for (int l = 0; l < GRADIENT_LANES; l++) {
+                dst[i + l] = gradient_angle(gx[l], gy[l]);
+            }
+            continue;
+        }
+
+        gradient_f32 m;
+        if (a->norm == GRADIENT_L1) {
+            gradient_i16 sx = gx >> 15, sy = gy >> 15;
+            gradient_i16 sum = ((gx ^ sx) - sx) + ((gy ^ sy) - sy);
+            m = __builtin_convertvector(sum, gradient_f32);
+        } else {
+            gradient_f32 fx = __builtin_convertvector(gx, gradient_f32);
+            gradient_f32 fy = __builtin_convertvector(gy, gradient_f32);
+            m = fx * fx + fy * fy;
+            for (int l = 0; l < GRADIENT_LANES; l++) {
+                m[l] = sqrtf(m[l]);
+            }
+        }
+
+        // Magnitudes are never negative, so only the top needs clamping.
+        gradient_i32 v =
+            __builtin_convertvector(m * a->scale + CONVOLVE_ROUNDING_BIAS,
+                                    gradient_i32);
+        gradient_i32 top = v > 255;
+        v = (v & ~top) | (255 & top);
+        gradient_u8 bytes = __builtin_convertvector(v, gradient_u8);
+        memcpy(dst + i, &bytes, sizeof(bytes));
+    }
+
+    return i;
+}
+
+static void gradient_row(const struct gradient_args *a, int y) {
+    int width = a->img->width;
+    int height = a->img->height;
+    size_t channels = a->img->channels;
+    size_t row_size = width * channels;
+    const unsigned char *row = a->img->bytes + y * row_size;
+    const unsigned char *above = y > 0 ? row - row_size : row;
+    const unsigned char *below = y < height - 1 ? row + row_size : row;
+    unsigned char *dst = a->out->bytes + y * row_size;
+
+    // The first and last pixels repeat themselves as their missing
+    // neighbours.
+    if (width == 1) {
+        for (size_t i = 0; i < row_size; i++) {
+            dst[i] = gradient_scalar(a, above, row, below, i, 0, 0);
+        }
+        return;
+    }
+    for (size_t i = 0; i < channels; i++) {
+        dst[i] = gradient_scalar(a, above, row, below, i, 0, channels);
+    }
+
+    size_t i = gradient_span(a, above, row, below, channels,
+                             row_size - channels, channels, dst);
+    for (; i < row_size - channels; i++) {
+        dst[i] = gradient_scalar(a, above, row, below, i, channels, channels);
+    }
+
+    for (; i < row_size; i++) {
+        dst[i] = gradient_scalar(a, above, row, below, i, channels, 0);
+    }
+}
+
+static void gradient_thread(void *args, int index, int count) {
+    struct gradient_args *a = (struct gradient_args *)args;
+    int height = a->img->height;
+
+    int start_y = height / count * index;
+    int end_y = index == count - 1 ? height : height / count * (index + 1);
+
+    long start = trace_start();
+    for (int y = start_y; y < end_y; y++) {
+        gradient_row(a, y);
+    }
+    trace_event("gradient", start);
+}
+
+int gradient_filter(struct filter_context *ctx, struct image *img,
+                    enum gradient_operator op, enum gradient_norm norm,
+                    float scale, int direction, struct image *out) {
+    if (norm != GRADIENT_L1 && norm != GRADIENT_L2) {
+        LOG_ERROR("Gradient norm must be 1 or 2: %d", norm);
+        return 1;
+    }
+    if (!(scale >= GRADIENT_MIN_SCALE && scale <= GRADIENT_MAX_SCALE)) {
+        LOG_ERROR("Gradient scale out of range: %g", scale);
+        return 1;
+    }
+
+    struct gradient_args args = {
+        .img = img,
+        .side = op == GRADIENT_SCHARR ? 3 : 1,
+        .center = op == GRADIENT_SCHARR ? 10 : 2,
+        .norm = norm,
+        .scale = scale,
+        .direction = direction,
+        .out = out,
+    };
+
+    thread_pool_run(ctx->pool, gradient_thread, &args);
+
+    return 0;
+}
@@ -1,7 +1,12 @@
 #include "image.h"
+#include "bufpool.h"
+#include "integral.h"
+#define STBI_MALLOC(size) buffer_pool_alloc(size)
+#define STBI_REALLOC(ptr, size) buffer_pool_realloc(ptr, size)
+#define STBI_FREE(ptr) buffer_pool_free(ptr)
+#define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include "util.h"
-#include <stdlib.h>
 
 #define NUM_CHANNELS 3
 
@@ -11,24 +16,73 @@ int image_init(struct image *img, int width, int height, int channels) {
     img->width = width;
     img->height = height;
     img->channels = channels;
-    img->bytes = malloc(width * height * channels * sizeof(stbi_uc));
+    img->capacity = (size_t)width * height * channels * sizeof(stbi_uc);
+    img->bytes = buffer_pool_alloc(img->capacity);
 
     if (img->bytes == NULL) {
         LOG_ERROR("Could not allocate memory for image bytes");
+        img->capacity = 0;
         return 1;
     }
 
     return 0;
 }
 
+// Like image_init, but keeps the existing buffer when it is already large
+// enough, so the same image can be reused across inputs of varying sizes.
+// The image must have been zeroed or initialized before the first call.
+int image_reserve(struct image *img, int width, int height, int channels) {
+    size_t size = (size_t)width * height * channels * sizeof(stbi_uc);
+
+    if (img->bytes != NULL && img->capacity >= size) {
+        img->width = width;
+        img->height = height;
+        img->channels = channels;
+        return 0;
+    }
+
+    image_destroy(img);
+
+    return image_init(img, width, height, channels);
+}
+
 int image_load(struct image *img, const char *filename) {
+    return image_load_channels(img, filename, NUM_CHANNELS);
+}
+
+int image_load_channels(struct image *img, const char *filename,
+                        int channels) {
     img->bytes = stbi_load(filename, &img->width, &img->height, &img->channels,
-                           NUM_CHANNELS);
+                           channels);
     if (img->bytes == NULL) {
         LOG_ERROR("Could not load image: %s", filename);
+        img->capacity = 0;
         return 1;
     }
 
+    if (channels != 0) {
+        img->channels = channels;
+    }
+    img->capacity = (size_t)img->width * img->height * img->channels;
+
+    return 0;
+}
+
+int image_load_from_memory(struct image *img, const unsigned char *buffer,
+                           size_t size) {
+    img->bytes = stbi_load_from_memory(buffer, (int)size, &img->width,
+                                       &img->height, &img->channels,
+                                       NUM_CHANNELS);
+    if (img->bytes == NULL) {
+        LOG_ERROR("Could not decode image from memory: %s",
+                  stbi_failure_reason());
+        img->capacity = 0;
+        return 1;
+    }
+
+    img->channels = NUM_CHANNELS;
+    img->capacity = (size_t)img->width * img->height * img->channels;
+
     return 0;
 }
 
@@ -72,6 +126,19 @@ int image_apply_kernel_patch(struct image *img, struct kernel *k, int start_x,
     return 0;
 }
 
+// xorshift64 keeps synthetic images identical across runs and machines.
+void image_fill_random(struct image *img, unsigned long long seed) {
+    unsigned long long state = seed ? seed : 1;
+    size_t size = (size_t)img->width * img->height * img->channels;
+
+    for (size_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        img->bytes[i] = (stbi_uc)(state >> 56);
+    }
+}
+
 int image_write_pbm(struct image *img, const char *filename) {
     FILE *file = fopen(filename, "wb");
     int result = 0;
@@ -98,10 +165,18 @@ defer:
     if (file)
         fclose(file);
 
-    return 0;
+    return result;
 }
 
-void image_destroy(struct image *img) { stbi_image_free(img->bytes); }
+// Decoded images come from stb_image, whose allocator is also routed
+// through the buffer pool, so both kinds of buffers are released the same way.
+void image_destroy(struct image *img) {
+    buffer_pool_free(img->bytes);
+    img->bytes = NULL;
+    img->capacity = 0;
+    integral_free(img->integral);
+    img->integral = NULL;
+}
 
 static stbi_uc image_get_pixel(struct image *img, int x, int y, int c) {
     if (x < 0 || x >= img->width || y < 0 || y >= img->height || c < 0 ||
@@ -62,6 +62,15 @@ static int imageApplyKernel(unsigned char *d_img_bytes, int width, int height,
 extern "C" {
 #include "image.h"
 
+int image_cuda_available(void) {
+    int count = 0;
+    if (cudaGetDeviceCount(&count) != cudaSuccess) {
+        return 0;
+    }
+
+    return count > 0;
+}
+
 int image_apply_kernel_cuda_wrapper(struct image *img, struct kernel *k,
                                     struct image *out, int repeats) {
     int result = 0;
@@ -132,6 +141,8 @@ defer:
         cudaFree(d_img_bytes);
     if (d_out_bytes)
         cudaFree(d_out_bytes);
+    if (d_kernel)
+        cudaFree(d_kernel);
 
     return result;
 }
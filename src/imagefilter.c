@@ -0,0 +1,146 @@
+#include "imagefilter.h"
+#include "backend.h"
+#include "filter.h"
+#include "pipeline.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct imagefilter_context {
+        struct filter_context filter;
+        struct pipeline pipeline;
+        struct image input;
+        struct image output;
+};
+
+const char *imagefilter_version(void) { return IMAGEFILTER_VERSION; }
+
+const char *imagefilter_status_string(enum imagefilter_status status) {
+    switch (status) {
+    case IMAGEFILTER_OK:
+        return "ok";
+    case IMAGEFILTER_ERROR_ARGUMENT:
+        return "invalid argument";
+    case IMAGEFILTER_ERROR_FILTER:
+        return "unknown filter";
+    case IMAGEFILTER_ERROR_MEMORY:
+        return "out of memory";
+    case IMAGEFILTER_ERROR_BACKEND:
+        return "backend failure";
+    }
+
+    return "unknown status";
+}
+
+static int imagefilter_reserve(struct imagefilter_context *ctx, int width,
+                               int height, int channels) {
+    if (image_reserve(&ctx->input, width, height, channels) != 0 ||
+        image_reserve(&ctx->output, width, height, channels) != 0 ||
+        pipeline_reserve(&ctx->filter, width, height, channels) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+struct imagefilter_context *
+imagefilter_context_new(const struct imagefilter_options *options) {
+    int threads = 1;
+    if (options != NULL && options->threads > 0) {
+        threads = options->threads;
+    }
+
+    struct imagefilter_context *ctx =
+        calloc(1, sizeof(struct imagefilter_context));
+    if (ctx == NULL) {
+        LOG_ERROR("Could not allocate memory for imagefilter context");
+        return NULL;
+    }
+
+    const char *backend = options != NULL ? options->backend : NULL;
+    if (filter_context_init(&ctx->filter, threads, backend) != 0) {
+        filter_context_destroy(&ctx->filter);
+        free(ctx);
+        return NULL;
+    }
+
+    if (options != NULL && options->max_width > 0 && options->max_height > 0) {
+        int channels =
+            options->max_channels > 0 ? options->max_channels : NUM_CHANNELS;
+        if (imagefilter_reserve(ctx, options->max_width, options->max_height,
+                                channels) != 0) {
+            imagefilter_context_free(ctx);
+            return NULL;
+        }
+    }
+
+    return ctx;
+}
+
+enum imagefilter_status
+imagefilter_apply(struct imagefilter_context *ctx, const char *filter,
+                  int repeats, const unsigned char *src, size_t src_stride,
+                  unsigned char *dst, size_t dst_stride, int width, int height,
+                  int channels) {
+    if (ctx == NULL || filter == NULL || src == NULL || dst == NULL ||
+        width <= 0 || height <= 0 || channels <= 0 || repeats <= 0) {
+        return IMAGEFILTER_ERROR_ARGUMENT;
+    }
+
+    size_t row_size = (size_t)width * channels;
+    if (src_stride < row_size || dst_stride < row_size) {
+        return IMAGEFILTER_ERROR_ARGUMENT;
+    }
+
+    // The stage array is kept across calls, only its contents are parsed.
+    ctx->pipeline.count = 0;
+    if (pipeline_parse(&ctx->pipeline, filter, NULL) != 0) {
+        return IMAGEFILTER_ERROR_FILTER;
+    }
+
+    // dst has the size of src, which rules out resampling stages that
+    // change it.
+    int out_width, out_height;
+    pipeline_size(&ctx->pipeline, repeats, width, height, &out_width,
+                  &out_height);
+    if (out_width != width || out_height != height) {
+        return IMAGEFILTER_ERROR_FILTER;
+    }
+
+    if (imagefilter_reserve(ctx, width, height, channels) != 0) {
+        return IMAGEFILTER_ERROR_MEMORY;
+    }
+
+    for (int y = 0; y < height; y++) {
+        memcpy(ctx->input.bytes + y * row_size, src + y * src_stride,
+               row_size);
+    }
+
+    if (pipeline_apply(&ctx->filter, &ctx->pipeline, &ctx->input,
+                       &ctx->output, repeats) != 0) {
+        return IMAGEFILTER_ERROR_BACKEND;
+    }
+
+    for (int y = 0; y < height; y++) {
+        memcpy(dst + y * dst_stride, ctx->output.bytes + y * row_size,
+               row_size);
+    }
+
+    return IMAGEFILTER_OK;
+}
+
+const char *imagefilter_backend_name(const struct imagefilter_context *ctx) {
+    return ctx->filter.backend->name;
+}
+
+void imagefilter_context_free(struct imagefilter_context *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+
+    image_destroy(&ctx->input);
+    image_destroy(&ctx->output);
+    pipeline_free(&ctx->pipeline);
+    filter_context_destroy(&ctx->filter);
+    free(ctx);
+}
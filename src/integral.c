@@ -0,0 +1,344 @@
+#include "integral.h"
+#include "bufpool.h"
+#include "trace.h"
+#include "util.h"
+#include <math.h>
+#include <stdlib.h>
+
+enum integral_filter {
+    INTEGRAL_MEAN,
+    INTEGRAL_STDDEV,
+    INTEGRAL_THRESHOLD,
+    INTEGRAL_ADAPTIVE_BOX,
+};
+
+struct integral_build_args {
+        struct image *img;
+        struct integral *t;
+        struct thread_pool *pool;
+};
+
+struct integral_filter_args {
+        struct image *img;
+        enum integral_filter filter;
+        int radius;
+        int min_radius;
+        int offset;
+        int contrast;
+        struct image *out;
+};
+
+static int integral_min(int a, int b) { return a < b ? a : b; }
+
+static int integral_max(int a, int b) { return a > b ? a : b; }
+
+static size_t integral_index(const struct integral *t, int x, int y, int c) {
+    return ((size_t)y * (t->width + 1) + x) * t->channels + c;
+}
+
+// Rows are summed independently, every thread its own. The columns are then
+// summed down the whole table, every thread over its own share of each row,
+// which keeps the accesses of a thread contiguous.
+static void integral_build_thread(void *args, int index, int count) {
+    struct integral_build_args *a = (struct integral_build_args *)args;
+    struct integral *t = a->t;
+    int width = t->width;
+    int height = t->height;
+    int channels = t->channels;
+    size_t row_size = (size_t)(width + 1) * channels;
+
+    int start_y = height / count * index;
+    int end_y = index == count - 1 ? height : height / count * (index + 1);
+
+    long start = trace_start();
+    if (index == 0) {
+        for (size_t i = 0; i < row_size; i++) {
+            t->sums[i] = 0;
+            if (t->squares != NULL) {
+                t->squares[i] = 0;
+            }
+        }
+    }
+    for (int y = start_y; y < end_y; y++) {
+        const unsigned char *src = a->img->bytes + (size_t)y * width * channels;
+        uint32_t *sums = t->sums + (y + 1) * row_size;
+        uint64_t *squares =
+            t->squares != NULL ? t->squares + (y + 1) * row_size : NULL;
+
+        for (int c = 0; c < channels; c++) {
+            sums[c] = 0;
+            if (squares != NULL) {
+                squares[c] = 0;
+            }
+        }
+        for (size_t i = 0; i < (size_t)width * channels; i++) {
+            uint32_t value = src[i];
+            sums[i + channels] = sums[i] + value;
+            if (squares != NULL) {
+                squares[i + channels] = squares[i] + value * value;
+            }
+        }
+    }
+    trace_event("integral rows", start);
+
+    thread_pool_barrier(a->pool);
+
+    start = trace_start();
+    size_t from = row_size / count * index;
+    size_t to = index == count - 1 ? row_size : row_size / count * (index + 1);
+    for (int y = 1; y <= height; y++) {
+        uint32_t *sums = t->sums + y * row_size;
+        const uint32_t *above = sums - row_size;
+        for (size_t i = from; i < to; i++) {
+            sums[i] += above[i];
+        }
+
+        if (t->squares != NULL) {
+            uint64_t *squares = t->squares + y * row_size;
+            const uint64_t *squares_above = squares - row_size;
+            for (size_t i = from; i < to; i++) {
+                squares[i] += squares_above[i];
+            }
+        }
+    }
+    trace_event("integral columns", start);
+}
+
+// Builds the summed-area table of img, with sums of squares when asked to,
+// into the table attached to img, allocating it on first use.
+int image_integral(struct image *img, struct thread_pool *pool, int squares) {
+    size_t size =
+        (size_t)(img->width + 1) * (img->height + 1) * img->channels;
+
+    if (img->integral == NULL) {
+        img->integral = calloc(1, sizeof(struct integral));
+        if (img->integral == NULL) {
+            LOG_ERROR("Could not allocate memory for integral image");
+            return 1;
+        }
+    }
+
+    struct integral *t = img->integral;
+    if (t->capacity < size) {
+        buffer_pool_free(t->sums);
+        t->capacity = 0;
+        t->sums = buffer_pool_alloc(size * sizeof(uint32_t));
+        if (t->sums == NULL) {
+            LOG_ERROR("Could not allocate memory for integral image");
+            return 1;
+        }
+        t->capacity = size;
+    }
+    if (squares && t->squares_capacity < size) {
+        buffer_pool_free(t->squares);
+        t->squares_capacity = 0;
+        t->squares = buffer_pool_alloc(size * sizeof(uint64_t));
+        if (t->squares == NULL) {
+            LOG_ERROR("Could not allocate memory for integral image");
+            return 1;
+        }
+        t->squares_capacity = size;
+    }
+
+    t->width = img->width;
+    t->height = img->height;
+    t->channels = img->channels;
+
+    // Tables without squares keep their buffer for later, but must not
+    // spend time filling it.
+    uint64_t *kept = t->squares;
+    if (!squares) {
+        t->squares = NULL;
+    }
+
+    struct integral_build_args args = {
+        .img = img,
+        .t = t,
+        .pool = pool,
+    };
+    thread_pool_run(pool, integral_build_thread, &args);
+
+    t->squares = kept;
+
+    return 0;
+}
+
+// Sum of channel c over the pixels [x0, x1) x [y0, y1).
+uint32_t integral_sum(const struct integral *t, int x0, int y0, int x1,
+                      int y1, int c) {
+    return t->sums[integral_index(t, x1, y1, c)] -
+           t->sums[integral_index(t, x0, y1, c)] -
+           t->sums[integral_index(t, x1, y0, c)] +
+           t->sums[integral_index(t, x0, y0, c)];
+}
+
+uint64_t integral_square_sum(const struct integral *t, int x0, int y0, int x1,
+                             int y1, int c) {
+    return t->squares[integral_index(t, x1, y1, c)] -
+           t->squares[integral_index(t, x0, y1, c)] -
+           t->squares[integral_index(t, x1, y0, c)] +
+           t->squares[integral_index(t, x0, y0, c)];
+}
+
+void integral_free(struct integral *t) {
+    if (t == NULL) {
+        return;
+    }
+
+    buffer_pool_free(t->sums);
+    buffer_pool_free(t->squares);
+    free(t);
+}
+
+// Standard deviation over a window of n pixels, from the exact integer
+// variance times n^2.
+static int integral_window_stddev(const struct integral *t, int x0, int y0,
+                                  int x1, int y1, int c) {
+    uint64_t n = (uint64_t)(x1 - x0) * (y1 - y0);
+    uint64_t sum = integral_sum(t, x0, y0, x1, y1, c);
+    uint64_t squares = integral_square_sum(t, x0, y0, x1, y1, c);
+
+    return (int)(sqrt((double)(n * squares - sum * sum)) / (double)n);
+}
+
+static void integral_filter_thread(void *args, int index, int count) {
+    struct integral_filter_args *a = (struct integral_filter_args *)args;
+    const struct integral *t = a->img->integral;
+    int width = a->img->width;
+    int height = a->img->height;
+    int channels = a->img->channels;
+
+    int start_y = height / count * index;
+    int end_y = index == count - 1 ? height : height / count * (index + 1);
+
+    long start = trace_start();
+    for (int y = start_y; y < end_y; y++) {
+        int y0 = integral_max(0, y - a->radius);
+        int y1 = integral_min(height, y + a->radius + 1);
+        const unsigned char *src = a->img->bytes + (size_t)y * width * channels;
+        unsigned char *dst = a->out->bytes + (size_t)y * width * channels;
+
+        for (int x = 0; x < width; x++) {
+            int x0 = integral_max(0, x - a->radius);
+            int x1 = integral_min(width, x + a->radius + 1);
+            uint32_t n = (uint32_t)(x1 - x0) * (y1 - y0);
+
+            for (int c = 0; c < channels; c++) {
+                int i = x * channels + c;
+                switch (a->filter) {
+                case INTEGRAL_MEAN:
+                    dst[i] = integral_sum(t, x0, y0, x1, y1, c) / n;
+                    break;
+                case INTEGRAL_STDDEV:
+                    dst[i] = integral_window_stddev(t, x0, y0, x1, y1, c);
+                    break;
+                case INTEGRAL_THRESHOLD: {
+                    int64_t sum = integral_sum(t, x0, y0, x1, y1, c);
+                    dst[i] = ((int64_t)src[i] + a->offset) * n > sum ? 255 : 0;
+                    break;
+                }
+                case INTEGRAL_ADAPTIVE_BOX: {
+                    // Flat regions get the largest radius and regions at
+                    // or above the contrast the smallest.
+                    int stddev = integral_min(
+                        a->contrast,
+                        integral_window_stddev(t, x0, y0, x1, y1, c));
+                    int r = a->radius - (a->radius - a->min_radius) *
+                                            stddev / a->contrast;
+                    int bx0 = integral_max(0, x - r);
+                    int bx1 = integral_min(width, x + r + 1);
+                    int by0 = integral_max(0, y - r);
+                    int by1 = integral_min(height, y + r + 1);
+                    dst[i] = integral_sum(t, bx0, by0, bx1, by1, c) /
+                             ((uint32_t)(bx1 - bx0) * (by1 - by0));
+                    break;
+                }
+                }
+            }
+        }
+    }
+    trace_event("integral filter", start);
+}
+
+static int integral_filter_run(struct filter_context *ctx,
+                               struct integral_filter_args *args) {
+    if (args->radius < 0 || args->radius > INTEGRAL_MAX_RADIUS) {
+        LOG_ERROR("Window radius out of range: %d", args->radius);
+        return 1;
+    }
+
+    int squares = args->filter == INTEGRAL_STDDEV ||
+                  args->filter == INTEGRAL_ADAPTIVE_BOX;
+    if (image_integral(args->img, ctx->pool, squares) != 0) {
+        return 1;
+    }
+
+    thread_pool_run(ctx->pool, integral_filter_thread, args);
+
+    return 0;
+}
+
+// Mean of the window around every pixel, truncated.
+int integral_mean(struct filter_context *ctx, struct image *img, int radius,
+                  struct image *out) {
+    struct integral_filter_args args = {
+        .img = img,
+        .filter = INTEGRAL_MEAN,
+        .radius = radius,
+        .out = out,
+    };
+
+    return integral_filter_run(ctx, &args);
+}
+
+// Standard deviation of the window around every pixel, truncated.
+int integral_stddev(struct filter_context *ctx, struct image *img, int radius,
+                    struct image *out) {
+    struct integral_filter_args args = {
+        .img = img,
+        .filter = INTEGRAL_STDDEV,
+        .radius = radius,
+        .out = out,
+    };
+
+    return integral_filter_run(ctx, &args);
+}
+
+// 255 where a pixel plus offset exceeds the mean of its window and 0
+// elsewhere, per channel.
+int integral_threshold(struct filter_context *ctx, struct image *img,
+                       int radius, int offset, struct image *out) {
+    struct integral_filter_args args = {
+        .img = img,
+        .filter = INTEGRAL_THRESHOLD,
+        .radius = radius,
+        .offset = offset,
+        .out = out,
+    };
+
+    return integral_filter_run(ctx, &args);
+}
+
+// Box mean whose radius shrinks linearly from max_radius to min_radius as
+// the standard deviation within max_radius grows from 0 to contrast, which
+// smooths flat regions strongly while keeping edges.
+int integral_adaptive_box(struct filter_context *ctx, struct image *img,
+                          int min_radius, int max_radius, int contrast,
+                          struct image *out) {
+    if (min_radius < 0 || min_radius > max_radius || contrast <= 0) {
+        LOG_ERROR("Invalid adaptive box: radius %d to %d, contrast %d",
+                  min_radius, max_radius, contrast);
+        return 1;
+    }
+
+    struct integral_filter_args args = {
+        .img = img,
+        .filter = INTEGRAL_ADAPTIVE_BOX,
+        .radius = max_radius,
+        .min_radius = min_radius,
+        .contrast = contrast,
+        .out = out,
+    };
+
+    return integral_filter_run(ctx, &args);
+}
@@ -1,5 +1,9 @@
 #include "kernel.h"
 #include "util.h"
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 const int BLUR_KERNEL_SIZE = 3;
@@ -22,6 +26,9 @@ const float EMBOSS_KERNEL[] = {-2.0f, -1.0f, 0.0f, -1.0f, 1.0f,
 static void kernel_init(struct kernel *k, int size, const float *values) {
     k->size = size;
     k->values = values;
+    k->weights = NULL;
+    k->divisor = 0;
+    k->flags = 0;
 }
 
 int kernel_from(struct kernel *k, const char *name) {
@@ -48,3 +55,290 @@ float kernel_get_value_at(struct kernel *k, int x, int y) {
 
     return k->values[y * k->size + x];
 }
+
+// Kernel of applying a and then b, without rounding or clamping in between:
+// the full 2D convolution of the two, of size a->size + b->size - 1. The
+// values are allocated with malloc and owned by the caller.
+float *kernel_compose(const struct kernel *a, const struct kernel *b,
+                      int *size) {
+    int n = a->size + b->size - 1;
+    float *values = calloc((size_t)n * n, sizeof(float));
+    if (values == NULL) {
+        LOG_ERROR("Could not allocate memory for kernel");
+        return NULL;
+    }
+
+    for (int ay = 0; ay < a->size; ay++) {
+        for (int ax = 0; ax < a->size; ax++) {
+            float va = a->values[ay * a->size + ax];
+            for (int by = 0; by < b->size; by++) {
+                for (int bx = 0; bx < b->size; bx++) {
+                    values[(ay + by) * n + ax + bx] +=
+                        va * b->values[by * b->size + bx];
+                }
+            }
+        }
+    }
+
+    *size = n;
+    return values;
+}
+
+// Whether every output of k stays within [0, 255] for inputs in that range,
+// so that clamping it never changes a value: no negative weights and a sum
+// of at most one.
+int kernel_preserves_range(const struct kernel *k) {
+    float sum = 0.0f;
+
+    for (int i = 0; i < k->size * k->size; i++) {
+        if (k->values[i] < 0.0f) {
+            return 0;
+        }
+        sum += k->values[i];
+    }
+
+    return sum <= 1.0f + KERNEL_EPSILON;
+}
+
+// Splits a rank one kernel into k[y][x] = col[y] * row[x]. Returns 0 when k
+// is separable, 1 otherwise.
+int kernel_separate(const struct kernel *k, float *row, float *col) {
+    int n = k->size;
+    int pivot = 0;
+    float max = 0.0f;
+
+    for (int i = 0; i < n * n; i++) {
+        if (fabsf(k->values[i]) > max) {
+            max = fabsf(k->values[i]);
+            pivot = i;
+        }
+    }
+
+    if (max == 0.0f) {
+        return 1;
+    }
+
+    int py = pivot / n, px = pivot % n;
+    for (int i = 0; i < n; i++) {
+        row[i] = k->values[py * n + i];
+        col[i] = k->values[i * n + px] / k->values[pivot];
+    }
+
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            float error = k->values[y * n + x] - col[y] * row[x];
+            if (fabsf(error) > KERNEL_EPSILON * max) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Smallest divisor that turns every value into an integer, such that the
+// weighted sum of 8-bit values cannot overflow an int. Returns 0 when there
+// is none up to KERNEL_MAX_DIVISOR.
+static int kernel_integer_weights(const struct kernel *k, int *weights) {
+    int count = k->size * k->size;
+
+    for (int divisor = 1; divisor <= KERNEL_MAX_DIVISOR; divisor++) {
+        double total = 0.0;
+        int i = 0;
+
+        for (; i < count; i++) {
+            double scaled = (double)k->values[i] * divisor;
+            double rounded = round(scaled);
+            if (fabs(scaled - rounded) > KERNEL_EPSILON * divisor) {
+                break;
+            }
+            weights[i] = (int)rounded;
+            total += fabs(rounded) * 255.0;
+        }
+
+        if (i == count) {
+            return total <= INT_MAX ? divisor : 0;
+        }
+    }
+
+    return 0;
+}
+
+static int kernel_symmetric(const struct kernel *k) {
+    int n = k->size;
+
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n / 2; x++) {
+            if (k->values[y * n + x] != k->values[y * n + n - 1 - x]) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// Finds the properties that allow faster execution paths. row and col
+// receive the factors of separable kernels, weights and divisor the integer
+// form of integer kernels; all of them have room for k->size values, and
+// weights for k->size * k->size.
+unsigned int kernel_analyze(const struct kernel *k, float *row, float *col,
+                            int *weights, int *divisor) {
+    unsigned int flags = 0;
+
+    if (kernel_separate(k, row, col) == 0) {
+        flags |= KERNEL_SEPARABLE;
+    }
+
+    *divisor = kernel_integer_weights(k, weights);
+    if (*divisor != 0) {
+        flags |= KERNEL_INTEGER;
+    }
+
+    if (kernel_symmetric(k)) {
+        flags |= KERNEL_SYMMETRIC;
+    }
+
+    return flags;
+}
+
+static int kernel_check_size(int count, int *size) {
+    int n = (int)sqrt((double)count);
+    while (n * n < count) {
+        n++;
+    }
+
+    if (count == 0 || n * n != count || n % 2 == 0 || n > KERNEL_MAX_SIZE) {
+        LOG_ERROR("Kernel must have an odd square number of values of at "
+                  "most %dx%d, got %d",
+                  KERNEL_MAX_SIZE, KERNEL_MAX_SIZE, count);
+        return 1;
+    }
+
+    *size = n;
+    return 0;
+}
+
+// Parses numbers separated by whitespace, commas or semicolons, row by
+// row; '#' starts a comment that runs to the end of the line. The values are
+// allocated with malloc and owned by the caller.
+int kernel_parse(float **values, int *size, const char *text) {
+    int result = 0;
+    size_t count = 0, capacity = 0;
+    float *items = NULL;
+    const char *p = text;
+
+    while (*p != '\0') {
+        if (*p == '#') {
+            p += strcspn(p, "\n");
+            continue;
+        }
+        if (strchr(" \t\r\n,;", *p) != NULL) {
+            p++;
+            continue;
+        }
+
+        char *end;
+        float value = strtof(p, &end);
+        if (end == p || !isfinite(value)) {
+            LOG_ERROR("Invalid kernel value: %.16s", p);
+            return_defer(1);
+        }
+        p = end;
+
+        if (count == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            float *grown = realloc(items, capacity * sizeof(float));
+            if (grown == NULL) {
+                LOG_ERROR("Could not allocate memory for kernel");
+                return_defer(1);
+            }
+            items = grown;
+        }
+        items[count++] = value;
+    }
+
+    if (kernel_check_size((int)count, size) != 0) {
+        return_defer(1);
+    }
+
+    *values = items;
+    items = NULL;
+
+defer:
+    free(items);
+    return result;
+}
+
+static int kernel_load_binary(float **values, int *size, FILE *file) {
+    int n;
+    if (fread(&n, sizeof(n), 1, file) != 1 || n <= 0 ||
+        n > KERNEL_MAX_SIZE || n % 2 == 0) {
+        LOG_ERROR("Invalid binary kernel size");
+        return 1;
+    }
+
+    float *items = malloc((size_t)n * n * sizeof(float));
+    if (items == NULL) {
+        LOG_ERROR("Could not allocate memory for kernel");
+        return 1;
+    }
+
+    if (fread(items, sizeof(float), (size_t)n * n, file) != (size_t)n * n) {
+        LOG_ERROR("Truncated binary kernel");
+        free(items);
+        return 1;
+    }
+
+    for (int i = 0; i < n * n; i++) {
+        if (!isfinite(items[i])) {
+            LOG_ERROR("Invalid kernel value at index %d", i);
+            free(items);
+            return 1;
+        }
+    }
+
+    *values = items;
+    *size = n;
+    return 0;
+}
+
+// Loads a binary kernel file when it starts with KERNEL_FILE_MAGIC, and
+// parses it as text otherwise.
+int kernel_load(float **values, int *size, const char *path) {
+    int result = 0;
+    char *text = NULL;
+    char magic[sizeof(KERNEL_FILE_MAGIC) - 1];
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        LOG_ERROR("Could not open kernel file: %s", path);
+        return 1;
+    }
+
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+        memcmp(magic, KERNEL_FILE_MAGIC, sizeof(magic)) == 0) {
+        return_defer(kernel_load_binary(values, size, file));
+    }
+
+    if (fseek(file, 0, SEEK_END) != 0) {
+        LOG_ERROR("Could not read kernel file: %s", path);
+        return_defer(1);
+    }
+    long length = ftell(file);
+    rewind(file);
+
+    text = malloc(length + 1);
+    if (text == NULL || fread(text, 1, length, file) != (size_t)length) {
+        LOG_ERROR("Could not read kernel file: %s", path);
+        return_defer(1);
+    }
+    text[length] = '\0';
+
+    result = kernel_parse(values, size, text);
+
+defer:
+    free(text);
+    fclose(file);
+    return result;
+}
@@ -1,133 +1,355 @@
+#include <dirent.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #define ARGPARSE_IMPLEMENTATION
 #include "argparse.h"
+#include "bufpool.h"
+#include "filter.h"
 #include "image.h"
-#include "kernel.h"
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#include "perf.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "queue.h"
+#include "server.h"
+#include "timing.h"
+#include "trace.h"
+#include "tune.h"
 #include "util.h"
 
-int image_apply_kernel_single_thread(struct image *img, struct kernel *k,
-                                     struct image *out, int repeats) {
-    struct image tmp;
-    if (image_init(&tmp, img->width, img->height, img->channels) != 0) {
+#define BATCH_SLOTS 3
+#define BATCH_OUTPUT_EXTENSION ".pbm"
+
+struct batch_job {
+        char *input;
+        char *output;
+};
+
+struct batch_jobs {
+        struct batch_job *items;
+        size_t count;
+        size_t capacity;
+};
+
+struct batch_slot {
+        struct batch_job *job;
+        struct image img;
+        struct image out;
+        int result;
+};
+
+struct batch {
+        struct batch_jobs *jobs;
+        struct queue *free;
+        struct queue *decoded;
+        struct queue *filtered;
+        size_t failed;
+};
+
+static void batch_jobs_free(struct batch_jobs *jobs) {
+    for (size_t i = 0; i < jobs->count; i++) {
+        free(jobs->items[i].input);
+        free(jobs->items[i].output);
+    }
+    free(jobs->items);
+}
+
+static int batch_name_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Every regular file in input_dir becomes a job writing
+// output_dir/<stem>.pbm. Files are processed in name order.
+static int batch_jobs_from_dir(struct batch_jobs *jobs, const char *input_dir,
+                               const char *output_dir) {
+    DIR *dir = opendir(input_dir);
+    if (dir == NULL) {
+        LOG_ERROR("Could not open directory: %s", input_dir);
         return 1;
     }
-    memcpy(tmp.bytes, img->bytes, img->width * img->height * img->channels);
 
-    for (int i = 0; i < repeats; i++) {
-        image_apply_kernel(&tmp, k, out);
-        memcpy(tmp.bytes, out->bytes, out->width * out->height * out->channels);
+    struct {
+            char **items;
+            size_t count;
+            size_t capacity;
+    } names = {0};
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        da_append(&names, strdup(entry->d_name));
     }
+    closedir(dir);
+
+    qsort(names.items, names.count, sizeof(char *), batch_name_compare);
 
-    image_destroy(&tmp);
+    for (size_t i = 0; i < names.count; i++) {
+        char *name = names.items[i];
+        size_t input_size = strlen(input_dir) + strlen(name) + 2;
+        char *input = malloc(input_size);
+        snprintf(input, input_size, "%s/%s", input_dir, name);
+
+        struct stat st;
+        if (stat(input, &st) != 0 || !S_ISREG(st.st_mode)) {
+            free(input);
+            free(name);
+            continue;
+        }
+
+        char *dot = strrchr(name, '.');
+        if (dot != NULL) {
+            *dot = '\0';
+        }
+
+        size_t output_size = strlen(output_dir) + strlen(name) +
+                             strlen(BATCH_OUTPUT_EXTENSION) + 2;
+        char *output = malloc(output_size);
+        snprintf(output, output_size, "%s/%s%s", output_dir, name,
+                 BATCH_OUTPUT_EXTENSION);
+
+        struct batch_job job = {.input = input, .output = output};
+        da_append(jobs, job);
+        free(name);
+    }
+    free(names.items);
 
     return 0;
 }
 
-struct thread_args {
-        struct image *img;
-        struct kernel *k;
-        int start_y;
-        int end_y;
-        int repeats;
-        pthread_barrier_t *barrier;
-        struct image *out;
-};
+// A list file holds one "<input> <output>" pair per line. Blank lines and
+// lines starting with '#' are ignored.
+static int batch_jobs_from_list(struct batch_jobs *jobs, const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        LOG_ERROR("Could not open batch list: %s", filename);
+        return 1;
+    }
+
+    int result = 0;
+    char line[4096];
+    size_t line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+
+        char *input = strtok(line, " \t\r\n");
+        if (input == NULL || input[0] == '#') {
+            continue;
+        }
+
+        char *output = strtok(NULL, " \t\r\n");
+        if (output == NULL) {
+            LOG_ERROR("%s:%zu: missing output file name", filename,
+                      line_number);
+            return_defer(1);
+        }
+
+        struct batch_job job = {.input = strdup(input),
+                                .output = strdup(output)};
+        da_append(jobs, job);
+    }
+
+defer:
+    fclose(file);
 
-void *image_apply_kernel_patch_thread(void *args) {
-    struct thread_args *a = (struct thread_args *)args;
+    return result;
+}
 
-    for (int i = 0; i < a->repeats; i++) {
-        image_apply_kernel_patch(a->img, a->k, 0, a->start_y, a->img->width,
-                                 a->end_y, a->out);
+static void *batch_decode_thread(void *args) {
+    struct batch *b = (struct batch *)args;
 
-        pthread_barrier_wait(a->barrier);
+    trace_set_thread_name("decode", 0);
 
-        int offset = a->img->width * a->start_y * a->img->channels;
-        int size = a->img->width * (a->end_y - a->start_y) * a->img->channels;
+    for (size_t i = 0; i < b->jobs->count; i++) {
+        void *item;
+        if (queue_pop(b->free, &item) != 0) {
+            break;
+        }
 
-        memcpy(a->img->bytes + offset, a->out->bytes + offset, size);
+        struct batch_slot *slot = (struct batch_slot *)item;
+        slot->job = &b->jobs->items[i];
+
+        long start = trace_start();
+        slot->result = image_load(&slot->img, slot->job->input);
+        trace_event("decode", start);
+
+        if (queue_push(b->decoded, slot) != 0) {
+            break;
+        }
     }
 
+    queue_close(b->decoded);
+
     return NULL;
 }
 
-int image_apply_kernel_multi_thread_impl(struct image *img, struct kernel *k,
-                                         int threads, struct image *out,
-                                         int repeats) {
-    pthread_barrier_t barrier;
-    pthread_barrier_init(&barrier, NULL, threads);
+static void *batch_encode_thread(void *args) {
+    struct batch *b = (struct batch *)args;
+    void *item;
 
-    pthread_t thread_ids[threads];
-    int width = img->width;
-    int height = img->height;
-    int channels = img->channels;
-    int patch_height = height / threads;
+    trace_set_thread_name("encode", 0);
 
-    struct thread_args args[threads];
-    for (int i = 0; i < threads; i++) {
-        int start_y = i * patch_height;
-        int end_y = (i + 1) * patch_height;
-        if (i == threads - 1) {
-            end_y = height;
-        }
+    while (queue_pop(b->filtered, &item) == 0) {
+        struct batch_slot *slot = (struct batch_slot *)item;
 
-        args[i].img = img;
-        args[i].k = k;
-        args[i].start_y = start_y;
-        args[i].end_y = end_y;
-        args[i].repeats = repeats;
-        args[i].barrier = &barrier;
-        args[i].out = out;
+        if (slot->result == 0) {
+            long start = trace_start();
+            slot->result = image_write_pbm(&slot->out, slot->job->output);
+            trace_event("encode", start);
+        }
+        if (slot->result != 0) {
+            LOG_ERROR("Could not process image: %s", slot->job->input);
+            b->failed++;
+        }
 
-        pthread_create(&thread_ids[i], NULL, image_apply_kernel_patch_thread,
-                       args + i);
+        queue_push(b->free, slot);
     }
 
-    int results[threads];
-    for (int i = 0; i < threads; i++) {
-        pthread_join(thread_ids[i], (void *)&results[i]);
+    return NULL;
+}
+
+// Decoding of image N+1 and encoding of image N-1 run on their own threads
+// while the calling thread filters image N. BATCH_SLOTS slots cycle through
+// the free -> decoded -> filtered queues, so the output buffers are reused
+// from one image to the next.
+static int batch_run(struct filter_context *ctx, struct batch_jobs *jobs,
+                     struct pipeline *pipeline, int repeats,
+                     struct perf_session *perf) {
+    int result = 0;
+    double pixels = 0;
+    struct batch_slot slots[BATCH_SLOTS] = {0};
+    struct batch b = {
+        .jobs = jobs,
+        .free = queue_new(BATCH_SLOTS),
+        .decoded = queue_new(BATCH_SLOTS),
+        .filtered = queue_new(BATCH_SLOTS),
+        .failed = 0,
+    };
+
+    if (b.free == NULL || b.decoded == NULL || b.filtered == NULL) {
+        return_defer(1);
     }
 
-    pthread_barrier_destroy(&barrier);
+    for (int i = 0; i < BATCH_SLOTS; i++) {
+        queue_push(b.free, &slots[i]);
+    }
 
-    for (int i = 0; i < threads; i++) {
-        if (results[i] != 0) {
-            return 1;
+    pthread_t decoder, encoder;
+    pthread_create(&decoder, NULL, batch_decode_thread, &b);
+    pthread_create(&encoder, NULL, batch_encode_thread, &b);
+
+    void *item;
+    while (queue_pop(b.decoded, &item) == 0) {
+        struct batch_slot *slot = (struct batch_slot *)item;
+
+        if (slot->result == 0) {
+            long start = trace_start();
+            if (perf != NULL) {
+                perf_session_start(perf);
+            }
+            slot->result = pipeline_apply(ctx, pipeline, &slot->img,
+                                          &slot->out, repeats);
+            if (perf != NULL) {
+                perf_session_stop(perf);
+            }
+            trace_event("filter", start);
+            pixels += pipeline_pixels(pipeline, repeats, slot->img.width,
+                                      slot->img.height);
+            image_destroy(&slot->img);
         }
+
+        queue_push(b.filtered, slot);
     }
 
-    return 0;
-}
+    queue_close(b.filtered);
+    pthread_join(decoder, NULL);
+    pthread_join(encoder, NULL);
 
-int image_apply_kernel_multi_thread(struct image *img, struct kernel *k,
-                                    int threads, struct image *out,
-                                    int repeats) {
-    struct image tmp;
-    if (image_init(&tmp, img->width, img->height, img->channels) != 0) {
-        return 1;
+    LOG_INFO("processed %zu images, %zu failed", jobs->count, b.failed);
+    if (perf != NULL) {
+        perf_session_print(perf, pixels, stdout);
+    }
+    if (b.failed > 0) {
+        return_defer(1);
     }
-    memcpy(tmp.bytes, img->bytes, img->width * img->height * img->channels);
-
-    image_apply_kernel_multi_thread_impl(&tmp, k, threads, out, repeats);
 
-    image_destroy(&tmp);
+defer:
+    for (int i = 0; i < BATCH_SLOTS; i++) {
+        image_destroy(&slots[i].img);
+        image_destroy(&slots[i].out);
+    }
+    queue_free(b.free);
+    queue_free(b.decoded);
+    queue_free(b.filtered);
 
-    return 0;
+    return result;
 }
 
-int image_apply_kernel_cuda(struct image *img, struct kernel *k,
-                            struct image *out, int repeats) {
-    return image_apply_kernel_cuda_wrapper(img, k, out, repeats);
+// Writes levels 1 on of the Gaussian pyramid of img next to output, level l
+// to <stem>-<l><ext>, and with laplacian every level of the Laplacian
+// pyramid as well, to <stem>-laplacian-<l><ext>.
+static int pyramid_write(struct filter_context *ctx, struct image *img,
+                         int levels, int laplacian, const char *output) {
+    int result = 0;
+    struct pyramid p = {0};
+    struct image level = {0};
+    char path[PATH_MAX];
+
+    const char *slash = strrchr(output, '/');
+    const char *dot = strrchr(output, '.');
+    if (dot == NULL || (slash != NULL && dot < slash)) {
+        dot = output + strlen(output);
+    }
+    int stem = (int)(dot - output);
+
+    long start = trace_start();
+    if (pyramid_build(ctx, img, levels, laplacian, &p) != 0) {
+        return_defer(1);
+    }
+    trace_event("pyramid", start);
+
+    for (int l = laplacian ? 0 : 1; l < p.levels; l++) {
+        if (l > 0) {
+            snprintf(path, sizeof(path), "%.*s-%d%s", stem, output, l, dot);
+            if (pyramid_level_image(&p, l, 0, &level) != 0 ||
+                image_write_pbm(&level, path) != 0) {
+                return_defer(1);
+            }
+        }
+        if (laplacian) {
+            snprintf(path, sizeof(path), "%.*s-laplacian-%d%s", stem, output,
+                     l, dot);
+            if (pyramid_level_image(&p, l, 1, &level) != 0 ||
+                image_write_pbm(&level, path) != 0) {
+                return_defer(1);
+            }
+        }
+    }
+
+defer:
+    pyramid_destroy(&p);
+    image_destroy(&level);
+    return result;
 }
 
 int main(int argc, char *argv[]) {
     int result = 0;
-    struct image img, out;
-    struct kernel k;
+    struct image img = {0}, out = {0};
+    struct pipeline pipeline = {0};
+    float *custom_values = NULL;
+    struct filter_context ctx = {0};
+    struct batch_jobs jobs = {0};
+    unsigned int pool_stats = 0;
+    struct timings timings = {0};
+    char *trace_file = NULL;
+    struct perf_session perf = {0};
+    struct tune_profile profile = {0};
 
     struct argparse_parser *parser = argparse_new(
         "image filter", "image filter basic implementation", "0.0.1");
@@ -137,16 +359,92 @@ int main(int argc, char *argv[]) {
                           ARGUMENT_TYPE_FLAG);
     argparse_add_argument(parser, 'i', "input", "input file name",
                           ARGUMENT_TYPE_VALUE);
-    argparse_add_argument(parser, 'o', "output", "output file name",
+    argparse_add_argument(parser, 'o', "output",
+                          "output file name (output directory with --batch "
+                          "<dir>)",
                           ARGUMENT_TYPE_VALUE);
     argparse_add_argument(parser, 'f', "filter",
-                          "filter name: blur,edge,sharpen,emboss",
+                          "filter name (blur,edge,sharpen,emboss), an "
+                          "operation with arguments (box(radius)), or a "
+                          "pipeline such as blur:2,box(3),edge",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "kernel",
+                          "custom kernel values, row by row, used by the "
+                          "\"custom\" filter",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "kernel-file",
+                          "read the custom kernel from a text or binary file",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "divisor",
+                          "divide the custom kernel values by this number",
                           ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "normalize",
+                          "divide the custom kernel values by their sum",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, '\0', "fuse-kernels",
+                          "compose runs of linear filters into single "
+                          "kernels (results may differ by rounding and at "
+                          "the borders)",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, '\0', "pyramid",
+                          "also write this many levels of the Gaussian "
+                          "pyramid of the output, next to it",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "laplacian",
+                          "also write the Laplacian pyramid levels, with "
+                          "--pyramid",
+                          ARGUMENT_TYPE_FLAG);
     argparse_add_argument(parser, 'p', "threads", "number of threads",
                           ARGUMENT_TYPE_VALUE);
-    argparse_add_argument(parser, 'r', "repeats", "number of repeats",
+    argparse_add_argument(parser, 'r', "repeats",
+                          "number of repeats of the whole filter pipeline",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'c', "cuda", "use cuda, same as --backend cuda",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, '\0', "backend",
+                          "backend name: auto,scalar,threaded,simd,cuda",
                           ARGUMENT_TYPE_VALUE);
-    argparse_add_argument(parser, 'c', "cuda", "use cuda", ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, 'b', "batch",
+                          "list file of \"<input> <output>\" lines, or an "
+                          "input directory",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 's', "serve",
+                          "serve jobs on this unix socket path, with -p "
+                          "worker threads",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'q', "queue",
+                          "maximum number of queued jobs in server mode",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "prefault",
+                          "pre-fault newly mapped image buffers",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, '\0', "hugepages",
+                          "back large image buffers with transparent huge "
+                          "pages",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, '\0', "timings",
+                          "print per stage timings of a single image run: "
+                          "text,json",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "trace",
+                          "write a chrome trace of the thread activity to "
+                          "this file",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "perf-counters",
+                          "report hardware performance counters of the "
+                          "filter stage per thread",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, '\0', "autotune",
+                          "benchmark backends and thread counts and store the "
+                          "best ones in the tuning profile",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, '\0', "profile",
+                          "tuning profile file (default "
+                          "$" TUNE_PROFILE_ENV " or ~/" TUNE_PROFILE_NAME ")",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "pool-stats",
+                          "print buffer pool statistics on exit",
+                          ARGUMENT_TYPE_FLAG);
 
     argparse_parse(parser, argc, argv);
 
@@ -165,8 +463,22 @@ int main(int argc, char *argv[]) {
     char *input = argparse_get_value(parser, "input");
     char *output = argparse_get_value(parser, "output");
     char *filter = argparse_get_value(parser, "filter");
+    char *kernel_str = argparse_get_value(parser, "kernel");
+    char *kernel_file = argparse_get_value(parser, "kernel-file");
+    if (filter == NULL && (kernel_str != NULL || kernel_file != NULL)) {
+        filter = CUSTOM_KERNEL_NAME;
+    }
+    char *batch = argparse_get_value(parser, "batch");
+    char *serve = argparse_get_value(parser, "serve");
+    unsigned int autotune = argparse_get_flag(parser, "autotune");
+
+    struct stat batch_stat;
+    unsigned int batch_is_dir = batch != NULL && stat(batch, &batch_stat) == 0 &&
+                                S_ISDIR(batch_stat.st_mode);
 
-    if (input == NULL || output == NULL || filter == NULL) {
+    if (serve == NULL && !autotune && (filter == NULL ||
+        (batch == NULL && (input == NULL || output == NULL)) ||
+        (batch_is_dir && output == NULL))) {
         LOG_ERROR("input, output and filter are required");
         argparse_print_help(parser);
 
@@ -193,35 +505,307 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    unsigned int use_cuda = argparse_get_flag(parser, "cuda");
+    int pyramid_levels = 0;
+    char *pyramid_str = argparse_get_value(parser, "pyramid");
+    if (pyramid_str) {
+        pyramid_levels = atoi(pyramid_str);
+        if (pyramid_levels < 1 || pyramid_levels > PYRAMID_MAX_LEVELS) {
+            LOG_ERROR("pyramid levels must be between 1 and %d",
+                      PYRAMID_MAX_LEVELS);
+            return_defer(1);
+        }
+    }
+
+    const char *backend = argparse_get_value(parser, "backend");
+    if (backend == NULL && argparse_get_flag(parser, "cuda")) {
+        backend = "cuda";
+    }
+
+    unsigned int pool_flags = 0;
+    if (argparse_get_flag(parser, "prefault")) {
+        pool_flags |= BUFFER_POOL_PREFAULT;
+    }
+    if (argparse_get_flag(parser, "hugepages")) {
+        pool_flags |= BUFFER_POOL_HUGEPAGES;
+    }
+    buffer_pool_configure(pool_flags, BUFFER_POOL_MAX_CACHED_BYTES);
+    pool_stats = argparse_get_flag(parser, "pool-stats");
+
+    char profile_path[PATH_MAX];
+    char *profile_str = argparse_get_value(parser, "profile");
+    if (profile_str != NULL) {
+        snprintf(profile_path, sizeof(profile_path), "%s", profile_str);
+    } else if (tune_profile_path(profile_path, sizeof(profile_path)) != 0) {
+        profile_path[0] = '\0';
+    }
+
+    if (autotune) {
+        int max_threads = threads_str ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+        if (profile_path[0] == '\0') {
+            LOG_ERROR("no tuning profile path, use --profile");
+            return_defer(1);
+        }
+
+        if (tune_profile_load(&profile, profile_path) != 0 ||
+            tune_run(&profile, max_threads > 0 ? max_threads : 1) != 0 ||
+            tune_profile_save(&profile, profile_path) != 0) {
+            return_defer(1);
+        }
+
+        LOG_INFO("wrote tuning profile %s", profile_path);
+        return_defer(0);
+    }
+
+    // Enabled before serving, so that server jobs are traced too; the
+    // trace is written once server_run returns.
+    trace_file = argparse_get_value(parser, "trace");
+    if (trace_file != NULL) {
+        trace_enable();
+        trace_set_thread_name("main", 0);
+    }
+
+    if (serve != NULL) {
+        int queue_capacity = SERVER_QUEUE_CAPACITY;
+        char *queue_str = argparse_get_value(parser, "queue");
+        if (queue_str) {
+            queue_capacity = atoi(queue_str);
+            if (queue_capacity <= 0) {
+                LOG_ERROR("queue must be a positive number");
+                return_defer(1);
+            }
+        }
+
+        return_defer(server_run(serve, threads, queue_capacity, backend));
+    }
+
+    char *timings_format = argparse_get_value(parser, "timings");
+    if (timings_format != NULL && strcmp(timings_format, "text") != 0 &&
+        strcmp(timings_format, "json") != 0) {
+        LOG_ERROR("timings must be text or json");
+        return_defer(1);
+    }
+
+    struct timing_point start;
+    timing_now(&start);
+
+    struct kernel custom = {0};
+    if (kernel_str != NULL || kernel_file != NULL) {
+        if (kernel_str != NULL && kernel_file != NULL) {
+            LOG_ERROR("kernel and kernel-file are mutually exclusive");
+            return_defer(1);
+        }
+
+        int loaded = kernel_str != NULL
+                         ? kernel_parse(&custom_values, &custom.size,
+                                        kernel_str)
+                         : kernel_load(&custom_values, &custom.size,
+                                       kernel_file);
+        if (loaded != 0) {
+            return_defer(1);
+        }
+        custom.values = custom_values;
+
+        char *divisor_str = argparse_get_value(parser, "divisor");
+        float divisor = 1.0f;
+        if (divisor_str != NULL && argparse_get_flag(parser, "normalize")) {
+            LOG_ERROR("divisor and normalize are mutually exclusive");
+            return_defer(1);
+        } else if (divisor_str != NULL) {
+            divisor = strtof(divisor_str, NULL);
+        } else if (argparse_get_flag(parser, "normalize")) {
+            divisor = 0.0f;
+            for (int i = 0; i < custom.size * custom.size; i++) {
+                divisor += custom_values[i];
+            }
+        }
+
+        if (fabsf(divisor) < KERNEL_EPSILON || !isfinite(divisor)) {
+            LOG_ERROR("kernel divisor must not be zero");
+            return_defer(1);
+        }
+        for (int i = 0; i < custom.size * custom.size; i++) {
+            custom_values[i] /= divisor;
+        }
+    }
 
-    if (image_load(&img, input) != 0) {
+    if (pipeline_parse(&pipeline, filter,
+                       custom.values != NULL ? &custom : NULL) != 0) {
         return_defer(1);
     }
 
-    if (kernel_from(&k, filter) != 0) {
+    for (size_t i = 0; i < pipeline.count; i++) {
+        struct pipeline_stage *stage = &pipeline.items[i];
+        if (strcmp(stage->name, CUSTOM_KERNEL_NAME) == 0) {
+            LOG_INFO("custom kernel %dx%d:%s%s%s, %s", stage->k.size,
+                     stage->k.size,
+                     stage->k.flags & KERNEL_SEPARABLE ? " separable" : "",
+                     stage->k.flags & KERNEL_INTEGER ? " integer" : "",
+                     stage->k.flags & KERNEL_SYMMETRIC ? " symmetric" : "",
+                     pipeline_method_name(stage->method));
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < pipeline.count; i++) {
+        struct pipeline_stage *stage = &pipeline.items[i];
+        if (stage->method == PIPELINE_OPERATION && stage->op->mode != NULL) {
+            LOG_INFO("%s: %s mode", stage->name,
+                     stage->op->mode(stage->args));
+        }
+    }
+
+    if (argparse_get_flag(parser, "fuse-kernels")) {
+        struct pipeline fused = {0};
+        if (pipeline_optimize(&fused, &pipeline, repeats) != 0) {
+            pipeline_free(&fused);
+            return_defer(1);
+        }
+
+        pipeline_free(&pipeline);
+        pipeline = fused;
+        repeats = 1;
+
+        for (size_t i = 0; i < pipeline.count; i++) {
+            struct pipeline_stage *stage = &pipeline.items[i];
+            if (stage->method == PIPELINE_OPERATION) {
+                LOG_INFO("stage %zu: %s x%d, %s", i, stage->name,
+                         stage->repeats,
+                         pipeline_method_name(stage->method));
+                continue;
+            }
+            LOG_INFO("stage %zu: %s x%d, %dx%d %s", i, stage->name,
+                     stage->repeats, stage->k.size, stage->k.size,
+                     pipeline_method_name(stage->method));
+        }
+    }
+    timings_add(&timings, "kernel", &start);
+
+    long trace_start_ns = trace_start();
+    if (batch == NULL) {
+        if (image_load(&img, input) != 0) {
+            return_defer(1);
+        }
+        trace_event("decode", trace_start_ns);
+        timings_add(&timings, "load", &start);
+
+        // Explicit -p or --backend always win over the tuning profile.
+        if (threads_str == NULL && backend == NULL &&
+            profile_path[0] != '\0' &&
+            tune_profile_load(&profile, profile_path) == 0) {
+            char cpu[TUNE_CPU_MAX];
+            tune_cpu_model(cpu, sizeof(cpu));
+
+            const struct tune_entry *entry = tune_profile_lookup(
+                &profile, cpu, img.width, img.height,
+                pipeline_max_kernel_size(&pipeline),
+                pipeline_steps(&pipeline) * repeats);
+            if (entry != NULL) {
+                threads = entry->threads;
+                backend = entry->backend;
+            }
+        }
+        timings_add(&timings, "profile", &start);
+    }
+
+    if (filter_context_init(&ctx, threads, backend) != 0) {
         return_defer(1);
     }
+    timings_add(&timings, "context", &start);
 
-    if (image_init(&out, img.width, img.height, img.channels) != 0) {
+    if (argparse_get_flag(parser, "perf-counters")) {
+        if (perf_session_open(&perf, ctx.pool) != 0) {
+            return_defer(1);
+        }
+    }
+    struct perf_session *counters = perf.threads != NULL ? &perf : NULL;
+
+    if (batch != NULL) {
+        if (batch_is_dir) {
+            if (batch_jobs_from_dir(&jobs, batch, output) != 0) {
+                return_defer(1);
+            }
+        } else if (batch_jobs_from_list(&jobs, batch) != 0) {
+            return_defer(1);
+        }
+
+        return_defer(batch_run(&ctx, &jobs, &pipeline, repeats, counters));
+    }
+
+    if (image_reserve(&out, img.width, img.height, img.channels) != 0) {
         return_defer(1);
     }
+    timings_add(&timings, "init", &start);
+
+    if (counters != NULL) {
+        perf_session_start(counters);
+    }
 
-    if (use_cuda) {
-        image_apply_kernel_cuda(&img, &k, &out, repeats);
-    } else if (threads == 1) {
-        image_apply_kernel_single_thread(&img, &k, &out, repeats);
+    if (timings_format == NULL) {
+        if (pipeline_apply(&ctx, &pipeline, &img, &out, repeats) != 0) {
+            return_defer(1);
+        }
     } else {
-        image_apply_kernel_multi_thread(&img, &k, threads, &out, repeats);
+        // One repeat at a time, so that each one shows up as its own stage.
+        // The backends and fused pipelines copy their input before writing
+        // to out, so out can be fed back in as the input of the next repeat.
+        for (int i = 0; i < repeats; i++) {
+            struct image *src = i == 0 ? &img : &out;
+            if (pipeline_apply(&ctx, &pipeline, src, &out, 1) != 0) {
+                return_defer(1);
+            }
+
+            char name[TIMING_NAME_MAX];
+            snprintf(name, sizeof(name), "filter[%d]", i);
+            timings_add(&timings, name, &start);
+        }
     }
 
+    if (counters != NULL) {
+        perf_session_stop(counters);
+        perf_session_print(counters,
+                           pipeline_pixels(&pipeline, repeats, img.width,
+                                           img.height),
+                           stdout);
+    }
+
+    trace_start_ns = trace_start();
     if (image_write_pbm(&out, output) != 0) {
         return_defer(1);
     }
+    trace_event("encode", trace_start_ns);
+    timings_add(&timings, "write", &start);
+
+    if (pyramid_levels > 0) {
+        if (pyramid_write(&ctx, &out, pyramid_levels,
+                          argparse_get_flag(parser, "laplacian"),
+                          output) != 0) {
+            return_defer(1);
+        }
+        timings_add(&timings, "pyramid", &start);
+    }
+
+    if (timings_format != NULL && strcmp(timings_format, "json") == 0) {
+        timings_print_json(&timings, stdout);
+    } else if (timings_format != NULL) {
+        timings_print(&timings, stdout);
+    }
 
 defer:
     image_destroy(&img);
     image_destroy(&out);
+    perf_session_close(&perf);
+    filter_context_destroy(&ctx);
+    if (trace_file != NULL && trace_write(trace_file) != 0)
+        result = 1;
+    trace_free();
+    batch_jobs_free(&jobs);
+    timings_free(&timings);
+    tune_profile_free(&profile);
+    pipeline_free(&pipeline);
+    free(custom_values);
+    if (pool_stats)
+        buffer_pool_print_stats();
+    buffer_pool_trim();
     if (parser)
         argparse_free(parser);
 
@@ -0,0 +1,185 @@
+#include "median.h"
+#include "trace.h"
+#include "util.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MEDIAN_BINS 256
+#define MEDIAN_LANES 16
+#define MEDIAN_VECTORS (MEDIAN_BINS / MEDIAN_LANES)
+
+typedef uint16_t median_u16 __attribute__((vector_size(MEDIAN_LANES * 2)));
+
+// Histogram of 8-bit values in two levels: every coarse bin counts the
+// MEDIAN_LANES fine bins of one vector, so the median is found by scanning
+// at most one vector of coarse bins and one of fine ones.
+struct median_histogram {
+        median_u16 fine[MEDIAN_VECTORS];
+        median_u16 coarse;
+};
+
+// histograms holds the column histograms of every thread, one per column
+// of a tile and its margins.
+struct median_args {
+        struct image *img;
+        int radius;
+        int tiles_x;
+        int tiles_y;
+        struct median_histogram *histograms;
+        struct image *out;
+};
+
+static int median_min(int a, int b) { return a < b ? a : b; }
+
+static int median_max(int a, int b) { return a > b ? a : b; }
+
+static void median_add(struct median_histogram *restrict h,
+                       const struct median_histogram *restrict column) {
+    for (int i = 0; i < MEDIAN_VECTORS; i++) {
+        h->fine[i] += column->fine[i];
+    }
+    h->coarse += column->coarse;
+}
+
+static void median_sub(struct median_histogram *restrict h,
+                       const struct median_histogram *restrict column) {
+    for (int i = 0; i < MEDIAN_VECTORS; i++) {
+        h->fine[i] -= column->fine[i];
+    }
+    h->coarse -= column->coarse;
+}
+
+// Adds delta to the bins of the values of channel c along row y, for
+// every column histogram from image column first on.
+static void median_row(const struct median_args *a,
+                       struct median_histogram *columns, int first, int last,
+                       int y, int c, int delta) {
+    int channels = a->img->channels;
+    const unsigned char *src =
+        a->img->bytes + (size_t)y * a->img->width * channels + c;
+
+    for (int x = first; x < last; x++) {
+        unsigned char value = src[x * channels];
+        columns[x - first].fine[value / MEDIAN_LANES][value % MEDIAN_LANES] +=
+            delta;
+        columns[x - first].coarse[value / MEDIAN_LANES] += delta;
+    }
+}
+
+// Value of the given rank, counting from zero, in the histogram.
+static unsigned char median_find(const struct median_histogram *h, int rank) {
+    const uint16_t *coarse = (const uint16_t *)&h->coarse;
+    int bin = 0;
+    int count = 0;
+
+    while (count + coarse[bin] <= rank) {
+        count += coarse[bin];
+        bin++;
+    }
+
+    const uint16_t *fine = (const uint16_t *)&h->fine[bin];
+    int i = 0;
+    while (count + fine[i] <= rank) {
+        count += fine[i];
+        i++;
+    }
+
+    return (unsigned char)(bin * MEDIAN_LANES + i);
+}
+
+// Filters one channel of one tile. The column histograms cover the tile and
+// radius columns on either side, and are moved down one row at a time.
+__attribute__((target_clones("avx2", "default"))) static void
+median_tile(const struct median_args *a, struct median_histogram *columns,
+            int tile, int c) {
+    int width = a->img->width;
+    int height = a->img->height;
+    int channels = a->img->channels;
+    int r = a->radius;
+
+    int x0 = tile % a->tiles_x * MEDIAN_TILE_WIDTH;
+    int y0 = tile / a->tiles_x * MEDIAN_TILE_HEIGHT;
+    int x1 = median_min(width, x0 + MEDIAN_TILE_WIDTH);
+    int y1 = median_min(height, y0 + MEDIAN_TILE_HEIGHT);
+    int first = median_max(0, x0 - r);
+    int last = median_min(width, x1 + r);
+
+    memset(columns, 0, (last - first) * sizeof(*columns));
+    for (int y = median_max(0, y0 - r); y < median_min(height, y0 + r); y++) {
+        median_row(a, columns, first, last, y, c, 1);
+    }
+
+    for (int y = y0; y < y1; y++) {
+        if (y + r < height) {
+            median_row(a, columns, first, last, y + r, c, 1);
+        }
+
+        int rows = median_min(height, y + r + 1) - median_max(0, y - r);
+        unsigned char *dst =
+            a->out->bytes + (size_t)y * width * channels + c;
+
+        struct median_histogram h = {0};
+        for (int x = first; x <= median_min(width - 1, x0 + r); x++) {
+            median_add(&h, &columns[x - first]);
+        }
+
+        for (int x = x0; x < x1; x++) {
+            int cols = median_min(width, x + r + 1) - median_max(0, x - r);
+            dst[x * channels] = median_find(&h, (rows * cols - 1) / 2);
+
+            if (x + 1 < x1 && x + r + 1 < width) {
+                median_add(&h, &columns[x + r + 1 - first]);
+            }
+            if (x - r >= 0) {
+                median_sub(&h, &columns[x - r - first]);
+            }
+        }
+
+        if (y - r >= 0) {
+            median_row(a, columns, first, last, y - r, c, -1);
+        }
+    }
+}
+
+static void median_thread(void *args, int index, int count) {
+    struct median_args *a = (struct median_args *)args;
+    struct median_histogram *columns =
+        a->histograms + (size_t)index * (MEDIAN_TILE_WIDTH + 2 * a->radius);
+
+    for (int tile = index; tile < a->tiles_x * a->tiles_y; tile += count) {
+        long start = trace_start();
+        for (int c = 0; c < a->img->channels; c++) {
+            median_tile(a, columns, tile, c);
+        }
+        trace_event("median tile", start);
+    }
+}
+
+int median_filter(struct filter_context *ctx, struct image *img, int radius,
+                  struct image *out) {
+    if (radius < 0 || radius > MEDIAN_MAX_RADIUS) {
+        LOG_ERROR("Median radius out of range: %d", radius);
+        return 1;
+    }
+
+    int threads = thread_pool_size(ctx->pool);
+    size_t size = (size_t)threads * (MEDIAN_TILE_WIDTH + 2 * radius) *
+                  sizeof(struct median_histogram);
+    struct median_histogram *histograms = filter_context_scratch(ctx, size);
+    if (histograms == NULL) {
+        return 1;
+    }
+
+    struct median_args args = {
+        .img = img,
+        .radius = radius,
+        .tiles_x = (img->width + MEDIAN_TILE_WIDTH - 1) / MEDIAN_TILE_WIDTH,
+        .tiles_y = (img->height + MEDIAN_TILE_HEIGHT - 1) / MEDIAN_TILE_HEIGHT,
+        .histograms = histograms,
+        .out = out,
+    };
+
+    thread_pool_run(ctx->pool, median_thread, &args);
+
+    return 0;
+}
@@ -0,0 +1,269 @@
+#include "morphology.h"
+#include "trace.h"
+#include "util.h"
+#include <string.h>
+
+// Rows are filtered MORPHOLOGY_LANES at a time, gathered so that every
+// pixel of the group is one contiguous line of bytes.
+#define MORPHOLOGY_LANES 32
+// Bytes per column chunk of the column pass.
+#define MORPHOLOGY_CHUNK 256
+#define MORPHOLOGY_VECTOR 32
+
+typedef unsigned char morphology_u8
+    __attribute__((vector_size(MORPHOLOGY_VECTOR)));
+
+// A pass along count lines of n bytes each, stride bytes apart: line i of
+// the result is the extreme of lines i - radius to i + radius of the source.
+struct morphology_lines {
+        const unsigned char *src;
+        size_t src_stride;
+        unsigned char *dst;
+        size_t dst_stride;
+        int count;
+        size_t n;
+};
+
+// temp holds the image between the row and the column pass, buffers the
+// working memory of every thread, buffer_size bytes each.
+struct morphology_args {
+        struct image *img;
+        int passes;
+        int max[2];
+        int rx;
+        int ry;
+        unsigned char *temp;
+        unsigned char *buffers;
+        size_t buffer_size;
+        struct thread_pool *pool;
+        struct image *out;
+};
+
+// The extreme of a and b, value by value. The comparison yields a mask of
+// the lanes where a wins.
+__attribute__((target_clones("avx2", "default"))) static void
+morphology_combine(unsigned char *restrict dst,
+                   const unsigned char *restrict a,
+                   const unsigned char *restrict b, size_t n, int max) {
+    size_t i = 0;
+    for (; i + MORPHOLOGY_VECTOR <= n; i += MORPHOLOGY_VECTOR) {
+        morphology_u8 va, vb;
+        memcpy(&va, a + i, sizeof(va));
+        memcpy(&vb, b + i, sizeof(vb));
+        morphology_u8 mask = max ? (morphology_u8)(va > vb)
+                                 : (morphology_u8)(va < vb);
+        morphology_u8 v = (va & mask) | (vb & ~mask);
+        memcpy(dst + i, &v, sizeof(v));
+    }
+    for (; i < n; i++) {
+        if (max) {
+            dst[i] = a[i] > b[i] ? a[i] : b[i];
+        } else {
+            dst[i] = a[i] < b[i] ? a[i] : b[i];
+        }
+    }
+}
+
+// Lines padded with radius lines on either side, rounded up to whole
+// blocks of the window length.
+static int morphology_padded(int count, int radius) {
+    int k = 2 * radius + 1;
+    return (count + 2 * radius + k - 1) / k * k;
+}
+
+// van Herk / Gil-Werman along the lines. The padded lines are cut into
+// blocks of the window length k; g holds the running extreme from the start
+// of each block, h the one to its end. Any window of k padded lines starting
+// at p covers the end of one block and the start of the next, so its extreme
+// is that of h[p] and g[p + k - 1]. The padding lines are identity, the
+// value that never wins, which clips the window to the image.
+static void morphology_run(const struct morphology_lines *l, int radius,
+                           int max, unsigned char *g, unsigned char *h,
+                           unsigned char *identity) {
+    int k = 2 * radius + 1;
+    int padded = morphology_padded(l->count, radius);
+    size_t n = l->n;
+
+    memset(identity, max ? 0 : 255, n);
+
+    for (int p = 0; p < padded; p++) {
+        int i = p - radius;
+        const unsigned char *src =
+            i >= 0 && i < l->count ? l->src + i * l->src_stride : identity;
+        if (p % k == 0) {
+            memcpy(g + p * n, src, n);
+        } else {
+            morphology_combine(g + p * n, g + (p - 1) * n, src, n, max);
+        }
+    }
+
+    for (int p = padded - 1; p >= 0; p--) {
+        int i = p - radius;
+        const unsigned char *src =
+            i >= 0 && i < l->count ? l->src + i * l->src_stride : identity;
+        if (p % k == k - 1) {
+            memcpy(h + p * n, src, n);
+        } else {
+            morphology_combine(h + p * n, h + (p + 1) * n, src, n, max);
+        }
+    }
+
+    for (int i = 0; i < l->count; i++) {
+        morphology_combine(l->dst + i * l->dst_stride, h + i * n,
+                           g + (i + k - 1) * n, n, max);
+    }
+}
+
+// Filters the rows of src from y0 on into temp: the group is gathered into
+// line, one pixel of all its rows after another, filtered along the pixels
+// into result, and scattered back.
+static void morphology_rows(const struct morphology_args *a,
+                            const unsigned char *src, int y0, int rows,
+                            int max, unsigned char *buffer) {
+    int width = a->img->width;
+    int channels = a->img->channels;
+    size_t row_size = (size_t)width * channels;
+    size_t n = (size_t)rows * channels;
+    int padded = morphology_padded(width, a->rx);
+
+    unsigned char *line = buffer;
+    unsigned char *result = line + width * n;
+    unsigned char *g = result + width * n;
+    unsigned char *h = g + padded * n;
+    unsigned char *identity = h + padded * n;
+
+    for (int l = 0; l < rows; l++) {
+        const unsigned char *row = src + (y0 + l) * row_size;
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < channels; c++) {
+                line[x * n + l * channels + c] = row[x * channels + c];
+            }
+        }
+    }
+
+    struct morphology_lines lines = {line, n, result, n, width, n};
+    morphology_run(&lines, a->rx, max, g, h, identity);
+
+    for (int l = 0; l < rows; l++) {
+        unsigned char *row = a->temp + (y0 + l) * row_size;
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < channels; c++) {
+                row[x * channels + c] = result[x * n + l * channels + c];
+            }
+        }
+    }
+}
+
+// Every pass filters the rows into temp, split by groups of rows, and then
+// the columns of temp into out, split by chunks. The barriers keep a pass
+// from reading what the other threads have not written yet, so the second
+// pass of an opening or closing can read out again.
+static void morphology_thread(void *args, int index, int count) {
+    struct morphology_args *a = (struct morphology_args *)args;
+    int width = a->img->width;
+    int height = a->img->height;
+    size_t row_size = (size_t)width * a->img->channels;
+    unsigned char *buffer = a->buffers + index * a->buffer_size;
+
+    int groups = (height + MORPHOLOGY_LANES - 1) / MORPHOLOGY_LANES;
+    int first = groups / count * index;
+    int last = index == count - 1 ? groups : groups / count * (index + 1);
+    size_t chunks = (row_size + MORPHOLOGY_CHUNK - 1) / MORPHOLOGY_CHUNK;
+    int padded = morphology_padded(height, a->ry);
+
+    for (int pass = 0; pass < a->passes; pass++) {
+        const unsigned char *src = pass == 0 ? a->img->bytes : a->out->bytes;
+        int max = a->max[pass];
+
+        long start = trace_start();
+        for (int group = first; group < last; group++) {
+            int y0 = group * MORPHOLOGY_LANES;
+            int rows = height - y0 < MORPHOLOGY_LANES ? height - y0
+                                                      : MORPHOLOGY_LANES;
+            morphology_rows(a, src, y0, rows, max, buffer);
+        }
+        trace_event("morphology rows", start);
+
+        thread_pool_barrier(a->pool);
+
+        start = trace_start();
+        for (size_t chunk = index; chunk < chunks; chunk += count) {
+            size_t from = chunk * MORPHOLOGY_CHUNK;
+            size_t n = row_size - from < MORPHOLOGY_CHUNK ? row_size - from
+                                                          : MORPHOLOGY_CHUNK;
+            struct morphology_lines lines = {a->temp + from, row_size,
+                                             a->out->bytes + from, row_size,
+                                             height, n};
+            unsigned char *g = buffer;
+            unsigned char *h = g + padded * n;
+            morphology_run(&lines, a->ry, max, g, h, h + padded * n);
+        }
+        trace_event("morphology columns", start);
+
+        thread_pool_barrier(a->pool);
+    }
+}
+
+int morphology_filter(struct filter_context *ctx, struct image *img,
+                      enum morphology_kind kind, int rx, int ry,
+                      struct image *out) {
+    if (rx < 0 || rx > MORPHOLOGY_MAX_RADIUS || ry < 0 ||
+        ry > MORPHOLOGY_MAX_RADIUS) {
+        LOG_ERROR("Morphology radius out of range: %d, %d", rx, ry);
+        return 1;
+    }
+
+    struct morphology_args args = {
+        .img = img,
+        .rx = rx,
+        .ry = ry,
+        .pool = ctx->pool,
+        .out = out,
+    };
+    switch (kind) {
+    case MORPHOLOGY_ERODE:
+        args.passes = 1;
+        args.max[0] = 0;
+        break;
+    case MORPHOLOGY_DILATE:
+        args.passes = 1;
+        args.max[0] = 1;
+        break;
+    case MORPHOLOGY_OPEN:
+        args.passes = 2;
+        args.max[0] = 0;
+        args.max[1] = 1;
+        break;
+    case MORPHOLOGY_CLOSE:
+        args.passes = 2;
+        args.max[0] = 1;
+        args.max[1] = 0;
+        break;
+    }
+
+    // Every thread needs the larger of the memory of a group of rows, the
+    // gathered and filtered lines with their blocks, and that of a chunk of
+    // columns.
+    size_t image_size = (size_t)img->width * img->height * img->channels;
+    size_t n = (size_t)MORPHOLOGY_LANES * img->channels;
+    size_t rows_size =
+        (2 * (size_t)img->width + 2 * morphology_padded(img->width, rx) + 1) *
+        n;
+    size_t columns_size =
+        (2 * (size_t)morphology_padded(img->height, ry) + 1) *
+        MORPHOLOGY_CHUNK;
+    args.buffer_size = rows_size > columns_size ? rows_size : columns_size;
+
+    int threads = thread_pool_size(ctx->pool);
+    unsigned char *scratch =
+        filter_context_scratch(ctx, image_size + threads * args.buffer_size);
+    if (scratch == NULL) {
+        return 1;
+    }
+    args.temp = scratch;
+    args.buffers = scratch + image_size;
+
+    thread_pool_run(ctx->pool, morphology_thread, &args);
+
+    return 0;
+}
@@ -0,0 +1,273 @@
+#include "operation.h"
+#include "bilateral.h"
+#include "box.h"
+#include "gaussian.h"
+#include "gradient.h"
+#include "integral.h"
+#include "median.h"
+#include "morphology.h"
+#include "resample.h"
+#include "unsharp.h"
+#include "util.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int operation_box(struct filter_context *ctx, struct image *img,
+                         struct image *out, const float *args) {
+    return box_blur(ctx, img, (int)args[0], out);
+}
+
+static int operation_gaussian(struct filter_context *ctx, struct image *img,
+                              struct image *out, const float *args) {
+    return gaussian_blur(ctx, img, args[0], out);
+}
+
+static int operation_sobel(struct filter_context *ctx, struct image *img,
+                           struct image *out, const float *args) {
+    return gradient_filter(ctx, img, GRADIENT_SOBEL, (int)args[0], args[1],
+                           (int)args[2], out);
+}
+
+static int operation_scharr(struct filter_context *ctx, struct image *img,
+                            struct image *out, const float *args) {
+    return gradient_filter(ctx, img, GRADIENT_SCHARR, (int)args[0], args[1],
+                           (int)args[2], out);
+}
+
+static int operation_unsharp(struct filter_context *ctx, struct image *img,
+                             struct image *out, const float *args) {
+    return unsharp_mask(ctx, img, args[0], args[1], (int)args[2], out);
+}
+
+static int operation_median(struct filter_context *ctx, struct image *img,
+                            struct image *out, const float *args) {
+    return median_filter(ctx, img, (int)args[0], out);
+}
+
+static int operation_erode(struct filter_context *ctx, struct image *img,
+                           struct image *out, const float *args) {
+    return morphology_filter(ctx, img, MORPHOLOGY_ERODE, (int)args[0],
+                             (int)args[1], out);
+}
+
+static int operation_dilate(struct filter_context *ctx, struct image *img,
+                            struct image *out, const float *args) {
+    return morphology_filter(ctx, img, MORPHOLOGY_DILATE, (int)args[0],
+                             (int)args[1], out);
+}
+
+static int operation_open(struct filter_context *ctx, struct image *img,
+                          struct image *out, const float *args) {
+    return morphology_filter(ctx, img, MORPHOLOGY_OPEN, (int)args[0],
+                             (int)args[1], out);
+}
+
+static int operation_close(struct filter_context *ctx, struct image *img,
+                           struct image *out, const float *args) {
+    return morphology_filter(ctx, img, MORPHOLOGY_CLOSE, (int)args[0],
+                             (int)args[1], out);
+}
+
+static int operation_bilateral(struct filter_context *ctx,
+                               struct image *img, struct image *out,
+                               const float *args) {
+    return bilateral_filter(ctx, img, args[0], args[1],
+                            (enum bilateral_mode)args[2], out);
+}
+
+static const char *operation_bilateral_mode(const float *args) {
+    return bilateral_mode_name(
+        bilateral_choose(args[0], (enum bilateral_mode)args[2]));
+}
+
+static int operation_mean(struct filter_context *ctx, struct image *img,
+                          struct image *out, const float *args) {
+    return integral_mean(ctx, img, (int)args[0], out);
+}
+
+static int operation_stddev(struct filter_context *ctx, struct image *img,
+                            struct image *out, const float *args) {
+    return integral_stddev(ctx, img, (int)args[0], out);
+}
+
+static int operation_threshold(struct filter_context *ctx, struct image *img,
+                               struct image *out, const float *args) {
+    return integral_threshold(ctx, img, (int)args[0], (int)args[1], out);
+}
+
+static int operation_adaptive_box(struct filter_context *ctx,
+                                  struct image *img, struct image *out,
+                                  const float *args) {
+    return integral_adaptive_box(ctx, img, (int)args[0], (int)args[1],
+                                 (int)args[2], out);
+}
+
+static void operation_resize_size(const float *args, int width, int height,
+                                  int *out_width, int *out_height) {
+    resample_size(width, height, (int)args[0], (int)args[1], out_width,
+                  out_height);
+}
+
+static int operation_resize(struct filter_context *ctx, struct image *img,
+                            struct image *out, const float *args) {
+    int width, height;
+    operation_resize_size(args, img->width, img->height, &width, &height);
+    return resample_image(ctx, img, width, height,
+                          (enum resample_filter)args[2], out);
+}
+
+static void operation_scale_size(const float *args, int width, int height,
+                                 int *out_width, int *out_height) {
+    resample_size(width, height, (int)lroundf(width * args[0]),
+                  (int)lroundf(height * args[0]), out_width, out_height);
+}
+
+static int operation_scale(struct filter_context *ctx, struct image *img,
+                           struct image *out, const float *args) {
+    int width, height;
+    operation_scale_size(args, img->width, img->height, &width, &height);
+    return resample_image(ctx, img, width, height,
+                          (enum resample_filter)args[1], out);
+}
+
+static const struct operation operations[] = {
+    {"box", "mean of a square box at constant cost per pixel", 1,
+     {{"radius", 0, BOX_MAX_RADIUS, 1, 1}}, operation_box},
+    {"gaussian", "recursive Gaussian blur at constant cost per pixel", 1,
+     {{"sigma", GAUSSIAN_MIN_SIGMA, GAUSSIAN_MAX_SIGMA, 2, 0}},
+     operation_gaussian},
+    {"unsharp", "unsharp mask, sharpening by the difference to a Gaussian blur",
+     3,
+     {{"sigma", UNSHARP_MIN_SIGMA, UNSHARP_MAX_SIGMA, 2, 0},
+      {"amount", 0, UNSHARP_MAX_AMOUNT, 1, 0},
+      {"threshold", 0, 255, 0, 1}},
+     operation_unsharp},
+    {"sobel", "Sobel gradient magnitude, L1 or L2, or its direction", 3,
+     {{"norm", GRADIENT_L1, GRADIENT_L2, GRADIENT_L2, 1},
+      {"scale", GRADIENT_MIN_SCALE, GRADIENT_MAX_SCALE, 1, 0},
+      {"direction", 0, 1, 0, 1}},
+     operation_sobel},
+    {"scharr", "Scharr gradient magnitude, L1 or L2, or its direction", 3,
+     {{"norm", GRADIENT_L1, GRADIENT_L2, GRADIENT_L2, 1},
+      {"scale", GRADIENT_MIN_SCALE, GRADIENT_MAX_SCALE, 1, 0},
+      {"direction", 0, 1, 0, 1}},
+     operation_scharr},
+    {"median", "median of the window clipped to the image", 1,
+     {{"radius", 0, MEDIAN_MAX_RADIUS, 1, 1}}, operation_median},
+    {"erode", "minimum over a rectangle of rx by ry radii", 2,
+     {{"rx", 0, MORPHOLOGY_MAX_RADIUS, 1, 1},
+      {"ry", 0, MORPHOLOGY_MAX_RADIUS, 1, 1}},
+     operation_erode},
+    {"dilate", "maximum over a rectangle of rx by ry radii", 2,
+     {{"rx", 0, MORPHOLOGY_MAX_RADIUS, 1, 1},
+      {"ry", 0, MORPHOLOGY_MAX_RADIUS, 1, 1}},
+     operation_dilate},
+    {"open", "erosion followed by dilation with the same rectangle", 2,
+     {{"rx", 0, MORPHOLOGY_MAX_RADIUS, 1, 1},
+      {"ry", 0, MORPHOLOGY_MAX_RADIUS, 1, 1}},
+     operation_open},
+    {"close", "dilation followed by erosion with the same rectangle", 2,
+     {{"rx", 0, MORPHOLOGY_MAX_RADIUS, 1, 1},
+      {"ry", 0, MORPHOLOGY_MAX_RADIUS, 1, 1}},
+     operation_close},
+    {"bilateral", "edge preserving smoothing, exact (1), grid (2) or auto (0)",
+     3,
+     {{"sigma_s", BILATERAL_MIN_SIGMA_S, BILATERAL_MAX_SIGMA_S, 3, 0},
+      {"sigma_r", BILATERAL_MIN_SIGMA_R, BILATERAL_MAX_SIGMA_R, 20, 0},
+      {"mode", BILATERAL_AUTO, BILATERAL_GRID, BILATERAL_AUTO, 1}},
+     operation_bilateral, operation_bilateral_mode},
+    {"mean", "local mean over the window clipped to the image", 1,
+     {{"radius", 0, INTEGRAL_MAX_RADIUS, 1, 1}}, operation_mean},
+    {"stddev", "local standard deviation", 1,
+     {{"radius", 0, INTEGRAL_MAX_RADIUS, 1, 1}}, operation_stddev},
+    {"threshold", "white where a pixel plus offset exceeds its local mean", 2,
+     {{"radius", 0, INTEGRAL_MAX_RADIUS, 7, 1}, {"offset", -255, 255, 5, 1}},
+     operation_threshold},
+    {"abox", "box mean that shrinks from max to min radius with contrast", 3,
+     {{"min", 0, INTEGRAL_MAX_RADIUS, 0, 1},
+      {"max", 0, INTEGRAL_MAX_RADIUS, 4, 1},
+      {"contrast", 1, 255, INTEGRAL_ADAPTIVE_CONTRAST, 1}},
+     operation_adaptive_box},
+    {"resize", "resample to width by height, 0 keeping the aspect ratio, with "
+     "the box (0), bilinear (1) or Lanczos3 (2) filter",
+     3,
+     {{"width", 0, RESAMPLE_MAX_SIZE, 0, 1},
+      {"height", 0, RESAMPLE_MAX_SIZE, 0, 1},
+      {"filter", RESAMPLE_BOX, RESAMPLE_LANCZOS3, RESAMPLE_LANCZOS3, 1}},
+     operation_resize, NULL, operation_resize_size},
+    {"scale", "resample by a factor with the box (0), bilinear (1) or "
+     "Lanczos3 (2) filter",
+     2,
+     {{"factor", RESAMPLE_MIN_SCALE, RESAMPLE_MAX_SCALE, 0.5f, 0},
+      {"filter", RESAMPLE_BOX, RESAMPLE_LANCZOS3, RESAMPLE_LANCZOS3, 1}},
+     operation_scale, NULL, operation_scale_size},
+};
+
+size_t operation_count(void) {
+    return sizeof(operations) / sizeof(operations[0]);
+}
+
+const struct operation *operation_at(size_t index) {
+    if (index >= operation_count()) {
+        return NULL;
+    }
+
+    return &operations[index];
+}
+
+// Looks up the first length characters of name, which need not be
+// terminated there.
+const struct operation *operation_find(const char *name, size_t length) {
+    for (size_t i = 0; i < operation_count(); i++) {
+        if (strlen(operations[i].name) == length &&
+            strncmp(operations[i].name, name, length) == 0) {
+            return &operations[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Fills args from the length characters of text, the comma separated list
+// between the parentheses of a stage, and the defaults of the arguments it
+// leaves out. Empty text takes every default.
+int operation_parse_args(const struct operation *op, const char *text,
+                         size_t length, float *args) {
+    const char *end = text + length;
+    int count = 0;
+
+    for (int i = 0; i < op->arg_count; i++) {
+        args[i] = op->args[i].value;
+    }
+
+    while (text < end) {
+        if (count == op->arg_count) {
+            LOG_ERROR("Too many arguments for %s: %.*s", op->name,
+                      (int)length, end - length);
+            return 1;
+        }
+
+        const struct operation_arg *arg = &op->args[count];
+        char *next;
+        float value = strtof(text, &next);
+        if (next == text || (next < end && *next != OPERATION_ARGS_SEPARATOR) ||
+            next > end) {
+            LOG_ERROR("Invalid %s argument of %s: %.*s", arg->name, op->name,
+                      (int)length, end - length);
+            return 1;
+        }
+        if (!(value >= arg->min && value <= arg->max) ||
+            (arg->integer && value != floorf(value))) {
+            LOG_ERROR("%s of %s must be %s between %g and %g", arg->name,
+                      op->name, arg->integer ? "an integer" : "a number",
+                      arg->min, arg->max);
+            return 1;
+        }
+
+        args[count++] = value;
+        text = next < end ? next + 1 : next;
+    }
+
+    return 0;
+}
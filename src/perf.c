@@ -0,0 +1,186 @@
+#include "perf.h"
+#include "util.h"
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char *perf_counter_names[PERF_COUNTER_COUNT] = {
+    "cycles",
+    "instructions",
+    "llc_refs",
+    "llc_misses",
+};
+
+static const uint64_t perf_counter_configs[PERF_COUNTER_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_REFERENCES,
+    PERF_COUNT_HW_CACHE_MISSES,
+};
+
+static int perf_event_open(struct perf_event_attr *attr) {
+    return (int)syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+static void perf_open_task(void *args, int index, int count) {
+    (void)count;
+    struct perf_session *s = (struct perf_session *)args;
+    struct perf_thread *t = &s->threads[index];
+
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = perf_counter_configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        t->fds[i] = perf_event_open(&attr);
+    }
+}
+
+// Returns 1 when the kernel refuses every counter, e.g. in containers or
+// with a restrictive perf_event_paranoid. Missing individual counters are
+// reported as zero.
+int perf_session_open(struct perf_session *s, struct thread_pool *pool) {
+    s->count = thread_pool_size(pool);
+    s->available = 0;
+    s->threads = calloc(s->count, sizeof(struct perf_thread));
+    if (s->threads == NULL) {
+        LOG_ERROR("Could not allocate memory for perf counters");
+        return 1;
+    }
+
+    thread_pool_run(pool, perf_open_task, s);
+
+    for (int i = 0; i < s->count; i++) {
+        for (int j = 0; j < PERF_COUNTER_COUNT; j++) {
+            if (s->threads[i].fds[j] >= 0) {
+                s->available = 1;
+            }
+        }
+    }
+
+    if (!s->available) {
+        LOG_ERROR("Hardware performance counters are not available, check "
+                  "/proc/sys/kernel/perf_event_paranoid");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void perf_session_ioctl(struct perf_session *s, unsigned long request) {
+    for (int i = 0; i < s->count; i++) {
+        for (int j = 0; j < PERF_COUNTER_COUNT; j++) {
+            if (s->threads[i].fds[j] >= 0) {
+                ioctl(s->threads[i].fds[j], request, 0);
+            }
+        }
+    }
+}
+
+void perf_session_reset(struct perf_session *s) {
+    perf_session_ioctl(s, PERF_EVENT_IOC_RESET);
+    for (int i = 0; i < s->count; i++) {
+        memset(s->threads[i].values, 0, sizeof(s->threads[i].values));
+    }
+}
+
+void perf_session_start(struct perf_session *s) {
+    perf_session_ioctl(s, PERF_EVENT_IOC_ENABLE);
+}
+
+// Counters accumulate over start/stop pairs until the next reset. Values are
+// scaled up when the kernel had to multiplex the counters.
+void perf_session_stop(struct perf_session *s) {
+    perf_session_ioctl(s, PERF_EVENT_IOC_DISABLE);
+
+    for (int i = 0; i < s->count; i++) {
+        struct perf_thread *t = &s->threads[i];
+        for (int j = 0; j < PERF_COUNTER_COUNT; j++) {
+            uint64_t data[3];
+            if (t->fds[j] < 0 || read(t->fds[j], data, sizeof(data)) !=
+                                     (ssize_t)sizeof(data)) {
+                continue;
+            }
+
+            uint64_t value = data[0];
+            if (data[2] > 0 && data[2] < data[1]) {
+                value = (uint64_t)((double)value * data[1] / data[2]);
+            }
+            t->values[j] = value;
+        }
+    }
+}
+
+void perf_session_total(struct perf_session *s,
+                        uint64_t values[PERF_COUNTER_COUNT]) {
+    memset(values, 0, PERF_COUNTER_COUNT * sizeof(uint64_t));
+    for (int i = 0; i < s->count; i++) {
+        for (int j = 0; j < PERF_COUNTER_COUNT; j++) {
+            values[j] += s->threads[i].values[j];
+        }
+    }
+}
+
+static void perf_print_row(FILE *file, const char *label,
+                           uint64_t values[PERF_COUNTER_COUNT]) {
+    fprintf(file, "%-8s", label);
+    for (int j = 0; j < PERF_COUNTER_COUNT; j++) {
+        fprintf(file, " %14llu", (unsigned long long)values[j]);
+    }
+
+    double cycles = values[PERF_COUNTER_CYCLES];
+    fprintf(file, " %6.2f\n",
+            cycles > 0 ? values[PERF_COUNTER_INSTRUCTIONS] / cycles : 0.0);
+}
+
+// Memory traffic is estimated as one cache line per last level cache miss.
+void perf_session_print(struct perf_session *s, double pixels, FILE *file) {
+    uint64_t total[PERF_COUNTER_COUNT];
+    char label[16];
+
+    fprintf(file, "%-8s", "thread");
+    for (int j = 0; j < PERF_COUNTER_COUNT; j++) {
+        fprintf(file, " %14s", perf_counter_names[j]);
+    }
+    fprintf(file, " %6s\n", "ipc");
+
+    for (int i = 0; i < s->count; i++) {
+        snprintf(label, sizeof(label), "%d", i);
+        perf_print_row(file, label, s->threads[i].values);
+    }
+
+    perf_session_total(s, total);
+    perf_print_row(file, "total", total);
+
+    if (pixels > 0) {
+        double misses = total[PERF_COUNTER_LLC_MISSES];
+        fprintf(file,
+                "llc misses per pixel: %.4f, bytes per pixel: %.2f, "
+                "cycles per pixel: %.2f\n",
+                misses / pixels, misses * PERF_CACHE_LINE_SIZE / pixels,
+                total[PERF_COUNTER_CYCLES] / pixels);
+    }
+}
+
+void perf_session_close(struct perf_session *s) {
+    for (int i = 0; i < s->count && s->threads != NULL; i++) {
+        for (int j = 0; j < PERF_COUNTER_COUNT; j++) {
+            if (s->threads[i].fds[j] >= 0) {
+                close(s->threads[i].fds[j]);
+            }
+        }
+    }
+
+    free(s->threads);
+    s->threads = NULL;
+    s->count = 0;
+}
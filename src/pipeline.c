@@ -0,0 +1,631 @@
+#include "pipeline.h"
+#include "argparse.h"
+#include "backend.h"
+#include "convolve.h"
+#include "trace.h"
+#include "util.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// One pass over the image that applies steps [first, first + count) of the
+// unrolled pipeline, band by band, keeping intermediate rows in per-thread
+// band buffers instead of full images.
+struct pipeline_pass {
+        struct pipeline *p;
+        int first;
+        int count;
+        int halo;
+        int band_rows;
+        size_t buffer_size;
+        image_patch_fn patch;
+        struct image *src;
+        struct image *dst;
+        struct image *bands;
+};
+
+static int pipeline_push_owned(struct pipeline *p, const char *name,
+                               const float *values, int size);
+
+// Length of the stage that starts at item, up to the next separator that is
+// not within the arguments of an operation.
+static size_t pipeline_item_length(const char *item) {
+    int depth = 0;
+    size_t length = 0;
+
+    for (; item[length] != '\0'; length++) {
+        if (item[length] == OPERATION_ARGS_OPEN) {
+            depth++;
+        } else if (item[length] == OPERATION_ARGS_CLOSE && depth > 0) {
+            depth--;
+        } else if (depth == 0 &&
+                   strchr(PIPELINE_SEPARATOR, item[length]) != NULL) {
+            break;
+        }
+    }
+
+    return length;
+}
+
+// Appends the stages of spec to p. Stages named CUSTOM_KERNEL_NAME use the
+// custom kernel, which may be NULL when there is none, and stages naming an
+// operation take their arguments in parentheses. Parsing works on the spec
+// in place, so reparsing built-in filters into a pipeline that has been
+// cleared allocates nothing.
+int pipeline_parse(struct pipeline *p, const char *spec,
+                   const struct kernel *custom) {
+    const char *item = spec;
+
+    for (;;) {
+        struct pipeline_stage stage = {.repeats = 1};
+        size_t length = pipeline_item_length(item);
+        const char *open = memchr(item, OPERATION_ARGS_OPEN, length);
+        const char *close = NULL;
+        const char *colon;
+        size_t name_length;
+
+        if (open != NULL) {
+            close = memchr(open, OPERATION_ARGS_CLOSE, item + length - open);
+            if (close == NULL || (close + 1 < item + length &&
+                                  close[1] != PIPELINE_REPEAT_SEPARATOR)) {
+                LOG_ERROR("Invalid arguments in pipeline stage: %.*s",
+                          (int)length, item);
+                return 1;
+            }
+            colon = close + 1 < item + length ? close + 1 : NULL;
+            name_length = (size_t)(open - item);
+        } else {
+            colon = memchr(item, PIPELINE_REPEAT_SEPARATOR, length);
+            name_length = colon != NULL ? (size_t)(colon - item) : length;
+        }
+
+        if (name_length == 0 || name_length >= PIPELINE_NAME_MAX) {
+            LOG_ERROR("Invalid pipeline stage in: %s", spec);
+            return 1;
+        }
+        memcpy(stage.name, item, name_length);
+        stage.name[name_length] = '\0';
+
+        if (colon != NULL) {
+            char *end;
+            long repeats = strtol(colon + 1, &end, 10);
+            if (end != item + length || repeats <= 0 || repeats > INT_MAX) {
+                LOG_ERROR("Invalid repeat count in pipeline stage: %.*s",
+                          (int)length, item);
+                return 1;
+            }
+            stage.repeats = (int)repeats;
+        }
+
+        stage.op = operation_find(stage.name, name_length);
+        if (stage.op != NULL) {
+            const char *args = open != NULL ? open + 1 : item + length;
+            size_t args_length = open != NULL ? (size_t)(close - args) : 0;
+            if (operation_parse_args(stage.op, args, args_length,
+                                     stage.args) != 0) {
+                return 1;
+            }
+            stage.method = PIPELINE_OPERATION;
+            da_append(p, stage);
+        } else if (open != NULL) {
+            LOG_ERROR("Filter takes no arguments: %s", stage.name);
+            return 1;
+        } else if (strcmp(stage.name, CUSTOM_KERNEL_NAME) == 0) {
+            if (custom == NULL) {
+                LOG_ERROR("No custom kernel given for stage: %s", stage.name);
+                return 1;
+            }
+            if (pipeline_push_owned(p, stage.name, custom->values,
+                                    custom->size) != 0) {
+                return 1;
+            }
+            p->items[p->count - 1].repeats = stage.repeats;
+        } else if (kernel_from(&stage.k, stage.name) != 0) {
+            return 1;
+        } else {
+            da_append(p, stage);
+        }
+
+        if (item[length] == '\0') {
+            break;
+        }
+        item += length + 1;
+    }
+
+    return 0;
+}
+
+int pipeline_steps(struct pipeline *p) {
+    int steps = 0;
+    for (size_t i = 0; i < p->count; i++) {
+        steps += p->items[i].repeats;
+    }
+
+    return steps;
+}
+
+int pipeline_max_kernel_size(struct pipeline *p) {
+    int size = 0;
+    for (size_t i = 0; i < p->count; i++) {
+        if (p->items[i].k.size > size) {
+            size = p->items[i].k.size;
+        }
+    }
+
+    return size;
+}
+
+// Stage of the step-th single application in the unrolled pipeline, which
+// repeats the whole stage list.
+static struct pipeline_stage *pipeline_stage_at(struct pipeline *p,
+                                                int step) {
+    step %= pipeline_steps(p);
+
+    for (size_t i = 0; i < p->count; i++) {
+        if (step < p->items[i].repeats) {
+            return &p->items[i];
+        }
+        step -= p->items[i].repeats;
+    }
+
+    return NULL;
+}
+
+static struct kernel *pipeline_kernel_at(struct pipeline *p, int step) {
+    return &pipeline_stage_at(p, step)->k;
+}
+
+// Number of steps starting at first that fit in one pass, and their halo:
+// the rows a band needs above and below it to produce exact results. Only
+// stages run by patch functions are fused, the others, operations included,
+// make up a pass of their own.
+static int pipeline_pass_length(struct pipeline *p, int first, int total,
+                                int *halo) {
+    int count = 0;
+    *halo = 0;
+
+    while (first + count < total) {
+        struct pipeline_stage *stage = pipeline_stage_at(p, first + count);
+        int radius = stage->k.size / 2;
+        int fusable = stage->method == PIPELINE_DIRECT ||
+                      stage->method == PIPELINE_INTEGER;
+        if (count > 0 && (!fusable || *halo + radius > PIPELINE_MAX_HALO)) {
+            break;
+        }
+        if (!fusable) {
+            return 1;
+        }
+        *halo += radius;
+        count++;
+    }
+
+    return count;
+}
+
+static int pipeline_min(int a, int b) { return a < b ? a : b; }
+
+static int pipeline_max(int a, int b) { return a > b ? a : b; }
+
+// Each step reads the rows it needs from a view of the previous step's
+// output and shrinks the row range by its radius, so only the rows of the
+// band itself reach dst. A view ends at the image border exactly when the
+// image does, which keeps the zero padding of the unfused filters.
+static void pipeline_band(struct pipeline_pass *pass, unsigned char *buffers,
+                          int y0, int y1) {
+    int width = pass->src->width;
+    int height = pass->src->height;
+    int channels = pass->src->channels;
+    size_t row_size = (size_t)width * channels;
+    int remaining = pass->halo;
+
+    int a = pipeline_max(0, y0 - remaining);
+    int b = pipeline_min(height, y1 + remaining);
+    struct image in = {width, b - a, channels, pass->src->bytes + a * row_size,
+                       0};
+
+    for (int s = 0; s < pass->count; s++) {
+        struct pipeline_stage *stage =
+            pipeline_stage_at(pass->p, pass->first + s);
+        struct kernel *k = &stage->k;
+        image_patch_fn patch = stage->method == PIPELINE_INTEGER
+                                   ? image_apply_kernel_patch_int
+                                   : pass->patch;
+        remaining -= k->size / 2;
+
+        int na = pipeline_max(0, y0 - remaining);
+        int nb = pipeline_min(height, y1 + remaining);
+
+        unsigned char *bytes = s == pass->count - 1
+                                   ? pass->dst->bytes + a * row_size
+                                   : buffers + (s % 2) * pass->buffer_size;
+        struct image out = {width, b - a, channels, bytes, 0};
+
+        patch(&in, k, 0, na - a, width, nb - a, &out);
+
+        in = (struct image){width, nb - na, channels,
+                            bytes + (na - a) * row_size, 0};
+        a = na;
+        b = nb;
+    }
+}
+
+// Bands fill the cache budget but leave every thread at least one, and
+// stay tall enough that recomputing the halo rows costs little.
+static int pipeline_band_rows(int threads, int width, int height,
+                              int channels, int halo) {
+    size_t row_size = (size_t)width * channels;
+    int rows = (int)(PIPELINE_BAND_BYTES / row_size) - 2 * halo;
+    rows = pipeline_min(rows, (height + threads - 1) / threads);
+    rows = pipeline_max(rows, PIPELINE_HALO_RATIO * halo);
+    return pipeline_max(rows, PIPELINE_MIN_BAND_ROWS);
+}
+
+static void pipeline_pass_thread(void *args, int index, int count) {
+    struct pipeline_pass *pass = (struct pipeline_pass *)args;
+    unsigned char *buffers =
+        pass->bands->bytes + (size_t)index * 2 * pass->buffer_size;
+    int height = pass->src->height;
+
+    for (int y0 = index * pass->band_rows; y0 < height;
+         y0 += count * pass->band_rows) {
+        long start = trace_start();
+        pipeline_band(pass, buffers, y0,
+                      pipeline_min(height, y0 + pass->band_rows));
+        trace_event("fused", start);
+    }
+}
+
+static int pipeline_pass_run(struct filter_context *ctx,
+                             struct pipeline_pass *pass) {
+    struct pipeline_stage *stage = pipeline_stage_at(pass->p, pass->first);
+    if (stage->method == PIPELINE_OPERATION) {
+        return stage->op->apply(ctx, pass->src, pass->dst, stage->args);
+    } else if (stage->method == PIPELINE_SEPARABLE) {
+        return convolve_separable(ctx, pass->src, stage->row, stage->col,
+                                  stage->k.size, pass->dst);
+    } else if (stage->method == PIPELINE_FFT) {
+        return convolve_fft(ctx, pass->src, &stage->k, pass->dst);
+    }
+
+    int threads = thread_pool_size(ctx->pool);
+    int width = pass->src->width;
+    int height = pass->src->height;
+    int channels = pass->src->channels;
+    size_t row_size = (size_t)width * channels;
+
+    pass->band_rows =
+        pipeline_band_rows(threads, width, height, channels, pass->halo);
+    pass->buffer_size = (pass->band_rows + 2 * pass->halo) * row_size;
+
+    if (image_reserve(&ctx->bands, width,
+                      2 * threads * (pass->band_rows + 2 * pass->halo),
+                      channels) != 0) {
+        return 1;
+    }
+    pass->bands = &ctx->bands;
+
+    thread_pool_run(ctx->pool, pipeline_pass_thread, pass);
+
+    return 0;
+}
+
+// Size of the image after every single application of the unrolled
+// pipeline, with pixels the sum of the sizes of those images.
+static void pipeline_walk(struct pipeline *p, int repeats, int *width,
+                          int *height, double *pixels) {
+    int total = pipeline_steps(p) * repeats;
+
+    *pixels = 0;
+    for (int i = 0; i < total; i++) {
+        struct pipeline_stage *stage = pipeline_stage_at(p, i);
+        if (stage->method == PIPELINE_OPERATION && stage->op->size != NULL) {
+            stage->op->size(stage->args, *width, *height, width, height);
+        }
+        *pixels += (double)*width * *height;
+    }
+}
+
+void pipeline_size(struct pipeline *p, int repeats, int width, int height,
+                   int *out_width, int *out_height) {
+    double pixels;
+    pipeline_walk(p, repeats, &width, &height, &pixels);
+
+    *out_width = width;
+    *out_height = height;
+}
+
+double pipeline_pixels(struct pipeline *p, int repeats, int width,
+                       int height) {
+    double pixels;
+    pipeline_walk(p, repeats, &width, &height, &pixels);
+
+    return pixels;
+}
+
+const char *pipeline_method_name(enum pipeline_method method) {
+    switch (method) {
+    case PIPELINE_DIRECT:
+        return "direct";
+    case PIPELINE_INTEGER:
+        return "integer";
+    case PIPELINE_SEPARABLE:
+        return "separable";
+    case PIPELINE_FFT:
+        return "fft";
+    case PIPELINE_OPERATION:
+        return "operation";
+    }
+
+    return "unknown";
+}
+
+// Cheapest way to run a kernel with the given kernel_analyze flags, in
+// multiply-adds per output value: the direct patch costs size * size, the
+// integer one the same or about half of it for symmetric kernels, two 1D
+// passes a few times 2 * size, and the FFT a roughly constant amount.
+// Integer kernels prefer the exact integer patch over the direct one.
+static enum pipeline_method pipeline_method_for(const struct kernel *k,
+                                                unsigned int flags,
+                                                int *cost) {
+    enum pipeline_method method = PIPELINE_DIRECT;
+    int n = k->size;
+    *cost = n * n;
+
+    if (flags & KERNEL_INTEGER) {
+        method = PIPELINE_INTEGER;
+        if (flags & KERNEL_SYMMETRIC) {
+            *cost = n * (n + 1) / 2;
+        }
+    }
+    if ((flags & KERNEL_SEPARABLE) && n >= PIPELINE_SEPARABLE_MIN_SIZE &&
+        PIPELINE_SEPARABLE_COST * n < *cost) {
+        method = PIPELINE_SEPARABLE;
+        *cost = PIPELINE_SEPARABLE_COST * n;
+    }
+    if (n >= PIPELINE_FFT_MIN_SIZE && PIPELINE_FFT_COST < *cost) {
+        method = PIPELINE_FFT;
+        *cost = PIPELINE_FFT_COST;
+    }
+
+    return method;
+}
+
+// Cost of the cheapest method for k, using the caller's scratch buffers.
+static int pipeline_cost(const struct kernel *k, float *row, float *col,
+                         int *weights) {
+    int divisor, cost;
+    unsigned int flags = kernel_analyze(k, row, col, weights, &divisor);
+    pipeline_method_for(k, flags, &cost);
+    return cost;
+}
+
+// Appends a stage owning a copy of values, analyzed once here so that it
+// runs with the cheapest method.
+static int pipeline_push_owned(struct pipeline *p, const char *name,
+                               const float *values, int size) {
+    struct pipeline_stage stage = {.repeats = 1};
+    size_t count = (size_t)size * size;
+    int cost;
+
+    stage.values = malloc((count + 2 * size) * sizeof(float));
+    stage.weights = malloc(count * sizeof(int));
+    if (stage.values == NULL || stage.weights == NULL) {
+        LOG_ERROR("Could not allocate memory for pipeline stage");
+        free(stage.values);
+        free(stage.weights);
+        return 1;
+    }
+    memcpy(stage.values, values, count * sizeof(float));
+    snprintf(stage.name, sizeof(stage.name), "%s", name);
+    stage.row = stage.values + count;
+    stage.col = stage.row + size;
+
+    stage.k.size = size;
+    stage.k.values = stage.values;
+    stage.k.flags = kernel_analyze(&stage.k, stage.row, stage.col,
+                                   stage.weights, &stage.k.divisor);
+    stage.k.weights = stage.weights;
+    stage.method = pipeline_method_for(&stage.k, stage.k.flags, &cost);
+
+    da_append(p, stage);
+    return 0;
+}
+
+// Builds in dst the pipeline equivalent to repeats runs of src with runs of
+// linear stages replaced by their composed kernel, wherever the composed
+// kernel is cheaper to run than the stages it replaces. A stage is only
+// composed with the next one when it can never clamp, so the only
+// differences to applying the stages one by one are the rounding of
+// intermediate results to 8 bits, which the composed kernel skips, and the
+// image border, where the intermediate images are no longer zero padded.
+int pipeline_optimize(struct pipeline *dst, struct pipeline *src,
+                      int repeats) {
+    float row[KERNEL_MAX_SIZE], col[KERNEL_MAX_SIZE];
+    int weights[KERNEL_MAX_SIZE * KERNEL_MAX_SIZE];
+    int total = pipeline_steps(src) * repeats;
+
+    for (int i = 0; i < total;) {
+        struct pipeline_stage *stage = pipeline_stage_at(src, i);
+
+        // Operations are not linear and never compose.
+        if (stage->method == PIPELINE_OPERATION) {
+            struct pipeline_stage *last =
+                dst->count > 0 ? &dst->items[dst->count - 1] : NULL;
+            if (last != NULL && last->op == stage->op &&
+                memcmp(last->args, stage->args, sizeof(stage->args)) == 0) {
+                last->repeats++;
+            } else {
+                struct pipeline_stage copy = *stage;
+                copy.repeats = 1;
+                da_append(dst, copy);
+            }
+            i++;
+            continue;
+        }
+
+        struct kernel k = stage->k;
+        float *values = NULL;
+        int count = 1;
+        int cost = pipeline_cost(&k, row, col, weights);
+
+        while (i + count < total &&
+               kernel_preserves_range(pipeline_kernel_at(src, i + count - 1))) {
+            if (pipeline_stage_at(src, i + count)->method ==
+                PIPELINE_OPERATION) {
+                break;
+            }
+            struct kernel *next = pipeline_kernel_at(src, i + count);
+            if (k.size + next->size - 1 > PIPELINE_MAX_FUSED_SIZE) {
+                break;
+            }
+
+            int size;
+            float *composed = kernel_compose(&k, next, &size);
+            if (composed == NULL) {
+                free(values);
+                return 1;
+            }
+
+            struct kernel candidate = {size, composed};
+            int next_cost = pipeline_cost(next, row, col, weights);
+            int composed_cost = pipeline_cost(&candidate, row, col, weights);
+            if (composed_cost > cost + next_cost) {
+                free(composed);
+                break;
+            }
+
+            free(values);
+            values = composed;
+            k = candidate;
+            cost = composed_cost;
+            count++;
+        }
+
+        // Consecutive unfused steps of the same stage stay one stage.
+        struct pipeline_stage *last =
+            dst->count > 0 ? &dst->items[dst->count - 1] : NULL;
+        if (count == 1 && last != NULL && last->method == PIPELINE_DIRECT &&
+            last->values == NULL && last->k.values == k.values) {
+            last->repeats++;
+        } else if (count == 1 && stage->values == NULL &&
+                   k.size < PIPELINE_SEPARABLE_MIN_SIZE) {
+            struct pipeline_stage copy = *stage;
+            copy.repeats = 1;
+            da_append(dst, copy);
+        } else {
+            char name[PIPELINE_NAME_MAX];
+            if (count == 1) {
+                snprintf(name, sizeof(name), "%s", stage->name);
+            } else {
+                snprintf(name, sizeof(name), "fused[%d]", count);
+            }
+
+            if (pipeline_push_owned(dst, name, k.values, k.size) != 0) {
+                free(values);
+                return 1;
+            }
+        }
+
+        free(values);
+        i += count;
+    }
+
+    return 0;
+}
+
+int pipeline_apply(struct filter_context *ctx, struct pipeline *p,
+                   struct image *img, struct image *out, int repeats) {
+    // A single filter keeps the backend's own repeat loop, which is what
+    // the autotuner measured and what the CUDA backend runs on the device.
+    if (p->count == 1 && p->items[0].method == PIPELINE_DIRECT) {
+        return filter_context_apply(ctx, img, &p->items[0].k, out,
+                                    p->items[0].repeats * repeats);
+    }
+
+    int total = pipeline_steps(p) * repeats;
+    int passes = 0;
+    for (int first = 0, halo; first < total;
+         first += pipeline_pass_length(p, first, total, &halo)) {
+        passes++;
+    }
+
+    // Passes alternate between tmp and out so that the last one writes out.
+    // When filtering in place, the first pass must not write out, so the
+    // input moves to tmp and the alternation starts from there.
+    struct image *src = img;
+    if (img == out && passes % 2 == 1) {
+        if (image_reserve(&ctx->tmp, img->width, img->height, img->channels) !=
+            0) {
+            return 1;
+        }
+        memcpy(ctx->tmp.bytes, img->bytes,
+               (size_t)img->width * img->height * img->channels);
+        src = &ctx->tmp;
+    }
+
+    int first = 0;
+    for (int i = 0; i < passes; i++) {
+        struct pipeline_pass pass = {
+            .p = p,
+            .first = first,
+            .patch = ctx->backend->patch,
+            .src = src,
+            .dst = (passes - 1 - i) % 2 == 0 ? out : &ctx->tmp,
+        };
+        pass.count = pipeline_pass_length(p, first, total, &pass.halo);
+
+        // Every pass writes an image of the size its stage makes, which is
+        // that of its input but for resampling operations.
+        int width = src->width, height = src->height;
+        struct pipeline_stage *stage = pipeline_stage_at(p, first);
+        if (stage->method == PIPELINE_OPERATION && stage->op->size != NULL) {
+            stage->op->size(stage->args, src->width, src->height, &width,
+                            &height);
+        }
+        if (image_reserve(pass.dst, width, height, src->channels) != 0) {
+            return 1;
+        }
+
+        if (pipeline_pass_run(ctx, &pass) != 0) {
+            return 1;
+        }
+
+        first += pass.count;
+        src = pass.dst;
+    }
+
+    return 0;
+}
+
+int pipeline_reserve(struct filter_context *ctx, int width, int height,
+                     int channels) {
+    // Narrower images take taller bands of about the same size, which only
+    // the rounding down of the band height can make up to a row larger per
+    // buffer.
+    int threads = thread_pool_size(ctx->pool);
+    int rows = 0;
+    for (int halo = 0; halo <= PIPELINE_MAX_HALO; halo++) {
+        int band_rows =
+            pipeline_band_rows(threads, width, height, channels, halo);
+        rows = pipeline_max(rows, 2 * threads * (band_rows + 2 * halo + 1));
+    }
+
+    if (image_reserve(&ctx->tmp, width, height, channels) != 0 ||
+        image_reserve(&ctx->bands, width, rows, channels) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+void pipeline_free(struct pipeline *p) {
+    for (size_t i = 0; i < p->count; i++) {
+        free(p->items[i].values);
+        free(p->items[i].weights);
+    }
+    free(p->items);
+    p->items = NULL;
+    p->count = 0;
+    p->capacity = 0;
+}
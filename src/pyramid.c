@@ -0,0 +1,463 @@
+#include "pyramid.h"
+#include "bufpool.h"
+#include "trace.h"
+#include "util.h"
+#include <string.h>
+
+#define PYRAMID_LANES 16
+
+typedef uint8_t pyramid_u8 __attribute__((vector_size(PYRAMID_LANES)));
+typedef uint16_t pyramid_u16 __attribute__((vector_size(PYRAMID_LANES * 2)));
+
+// rows holds, per thread, thread_size bytes: five decimated rows and one
+// expanded column row of 16 bit sums, followed by one expanded row of
+// level 0. Collapsing reconstructs the levels from 1 on into levels, laid
+// out as in the Gaussian storage less its level 0.
+struct pyramid_args {
+        struct image *img;
+        const struct pyramid *p;
+        int laplacian;
+        struct thread_pool *pool;
+        unsigned char *rows;
+        size_t thread_size;
+        unsigned char *levels;
+        struct image *out;
+};
+
+static int pyramid_clamp(int v, int lo, int hi) {
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+// Blurs a row of width pixels along x into dst, at the kept columns only:
+// column x of dst is 1 4 6 4 1 over columns 2x - 2 to 2x + 2 of src.
+static void pyramid_reduce_row(const unsigned char *src, int width,
+                               int channels, uint16_t *dst) {
+    int low_width = (width + 1) / 2;
+    // Columns 1 to last take all their taps inside the row.
+    int last = (width - 3) / 2;
+
+    for (int x = 0; x < low_width; x++) {
+        if (x == 1 && last >= 1) {
+            for (; x <= last; x++) {
+                const unsigned char *s = src + (size_t)(2 * x - 2) * channels;
+                uint16_t *d = dst + (size_t)x * channels;
+                for (int c = 0; c < channels; c++) {
+                    d[c] = s[c] + 4 * (s[channels + c] + s[3 * channels + c]) +
+                           6 * s[2 * channels + c] + s[4 * channels + c];
+                }
+            }
+            if (x == low_width) {
+                break;
+            }
+        }
+
+        static const int weights[5] = {1, 4, 6, 4, 1};
+        for (int c = 0; c < channels; c++) {
+            int sum = 0;
+            for (int k = 0; k < 5; k++) {
+                int sx = pyramid_clamp(2 * x + k - 2, 0, width - 1);
+                sum += weights[k] * src[sx * channels + c];
+            }
+            dst[x * channels + c] = sum;
+        }
+    }
+}
+
+// Sums five decimated rows down, 1 4 6 4 1, and rounds the 8 bit shifted
+// sum to a byte. The sums stay below 2^16.
+__attribute__((target_clones("avx2", "default"))) static void
+pyramid_reduce_columns(const uint16_t *const rows[5], unsigned char *dst,
+                       size_t n) {
+    size_t i = 0;
+    for (; i + PYRAMID_LANES <= n; i += PYRAMID_LANES) {
+        pyramid_u16 r0, r1, r2, r3, r4;
+        memcpy(&r0, rows[0] + i, sizeof(r0));
+        memcpy(&r1, rows[1] + i, sizeof(r1));
+        memcpy(&r2, rows[2] + i, sizeof(r2));
+        memcpy(&r3, rows[3] + i, sizeof(r3));
+        memcpy(&r4, rows[4] + i, sizeof(r4));
+        pyramid_u16 sum = r0 + 4 * (r1 + r3) + 6 * r2 + r4 + 128;
+        pyramid_u8 bytes = __builtin_convertvector(sum >> 8, pyramid_u8);
+        memcpy(dst + i, &bytes, sizeof(bytes));
+    }
+    for (; i < n; i++) {
+        dst[i] = (rows[0][i] + 4 * (rows[1][i] + rows[3][i]) +
+                  6 * rows[2][i] + rows[4][i] + 128) >> 8;
+    }
+}
+
+// Computes rows start_y to end_y of level l from level l - 1. Row j of the
+// level above, clamped to it, sits in slot (j - 2 * start_y + 2) of the
+// ring, modulo 5, and every row of level l needs two new ones.
+static void pyramid_reduce(const struct pyramid *p, int l, int start_y,
+                           int end_y, uint16_t *ring) {
+    const struct pyramid_level *src = &p->level[l - 1];
+    const struct pyramid_level *dst = &p->level[l];
+    int channels = p->channels;
+    size_t src_row = (size_t)src->width * channels;
+    size_t row_size = (size_t)dst->width * channels;
+    const unsigned char *g = p->gaussian + src->offset;
+    unsigned char *out = p->gaussian + dst->offset;
+
+    int next = 2 * start_y - 2;
+    for (int y = start_y; y < end_y; y++) {
+        for (; next <= 2 * y + 2; next++) {
+            int sy = pyramid_clamp(next, 0, src->height - 1);
+            pyramid_reduce_row(g + sy * src_row, src->width, channels,
+                               ring + (next - 2 * start_y + 2) % 5 * row_size);
+        }
+
+        const uint16_t *rows[5];
+        for (int k = 0; k < 5; k++) {
+            rows[k] = ring + (2 * y + k - 2 * start_y) % 5 * row_size;
+        }
+        pyramid_reduce_columns(rows, out + y * row_size, row_size);
+    }
+}
+
+// Expands three rows of a level along y: a + 6b + c for the even rows of
+// the level below it and 4b + 4c for the odd ones.
+__attribute__((target_clones("avx2", "default"))) static void
+pyramid_expand_columns(const unsigned char *a, const unsigned char *b,
+                       const unsigned char *c, int odd, uint16_t *dst,
+                       size_t n) {
+    size_t i = 0;
+    for (; i + PYRAMID_LANES <= n; i += PYRAMID_LANES) {
+        pyramid_u8 va, vb, vc;
+        memcpy(&va, a + i, sizeof(va));
+        memcpy(&vb, b + i, sizeof(vb));
+        memcpy(&vc, c + i, sizeof(vc));
+        pyramid_u16 wa = __builtin_convertvector(va, pyramid_u16);
+        pyramid_u16 wb = __builtin_convertvector(vb, pyramid_u16);
+        pyramid_u16 wc = __builtin_convertvector(vc, pyramid_u16);
+        pyramid_u16 sum = odd ? 4 * (wb + wc) : wa + 6 * wb + wc;
+        memcpy(dst + i, &sum, sizeof(sum));
+    }
+    for (; i < n; i++) {
+        dst[i] = odd ? 4 * (b[i] + c[i]) : a[i] + 6 * b[i] + c[i];
+    }
+}
+
+// Expands row y of level l from level l + 1, at low, into e: the kernel
+// 1 4 6 4 1 / 8 over the level with zeros between its pixels, the same
+// taps as in reduce, with the edge pixels repeated.
+static void pyramid_expand(const struct pyramid *p, int l,
+                           const unsigned char *low, int y, uint16_t *line,
+                           unsigned char *e) {
+    const struct pyramid_level *dst = &p->level[l];
+    const struct pyramid_level *src = &p->level[l + 1];
+    int channels = p->channels;
+    size_t low_row = (size_t)src->width * channels;
+
+    int i = y / 2;
+    const unsigned char *a = low + pyramid_clamp(i - 1, 0, src->height - 1) *
+                                       low_row;
+    const unsigned char *b = low + i * low_row;
+    const unsigned char *c = low + pyramid_clamp(i + 1, 0, src->height - 1) *
+                                       low_row;
+    pyramid_expand_columns(a, b, c, y % 2, line, low_row);
+
+    int low_width = src->width;
+    for (int x = 0; x < dst->width; x++) {
+        int j = x / 2;
+        int left = j > 0 ? j - 1 : 0;
+        int right = j + 1 < low_width ? j + 1 : low_width - 1;
+
+        // Inside, both columns of a pair take all their taps at once.
+        if (x % 2 == 0 && j > 0 && j + 1 < low_width && x + 1 < dst->width) {
+            for (int k = 0; k < channels; k++) {
+                int vl = line[left * channels + k];
+                int vc = line[j * channels + k];
+                int vr = line[right * channels + k];
+                e[x * channels + k] = (vl + 6 * vc + vr + 32) >> 6;
+                e[(x + 1) * channels + k] = (4 * (vc + vr) + 32) >> 6;
+            }
+            x++;
+            continue;
+        }
+
+        for (int k = 0; k < channels; k++) {
+            int vc = line[j * channels + k];
+            int vr = line[right * channels + k];
+            int sum = x % 2 == 0 ? line[left * channels + k] + 6 * vc + vr
+                                 : 4 * (vc + vr);
+            e[x * channels + k] = (sum + 32) >> 6;
+        }
+    }
+}
+
+static void pyramid_build_thread(void *args, int index, int count) {
+    struct pyramid_args *a = (struct pyramid_args *)args;
+    const struct pyramid *p = a->p;
+    int channels = p->channels;
+    size_t low_row = (size_t)(p->levels > 1 ? p->level[1].width : 1) *
+                     channels;
+    uint16_t *ring = (uint16_t *)(a->rows + index * a->thread_size);
+    uint16_t *line = ring + 5 * low_row;
+    unsigned char *e = (unsigned char *)(line + low_row);
+
+    long start = trace_start();
+    int height = p->level[0].height;
+    int start_y = height / count * index;
+    int end_y = index == count - 1 ? height : height / count * (index + 1);
+    size_t row_size = (size_t)p->level[0].width * channels;
+    memcpy(p->gaussian + start_y * row_size, a->img->bytes + start_y * row_size,
+           (end_y - start_y) * row_size);
+
+    for (int l = 1; l < p->levels; l++) {
+        thread_pool_barrier(a->pool);
+
+        height = p->level[l].height;
+        start_y = height / count * index;
+        end_y = index == count - 1 ? height : height / count * (index + 1);
+        if (start_y < end_y) {
+            pyramid_reduce(p, l, start_y, end_y, ring);
+        }
+    }
+    trace_event("pyramid reduce", start);
+
+    if (!a->laplacian) {
+        return;
+    }
+
+    // The Laplacian levels only read Gaussian ones, so they all go at once.
+    thread_pool_barrier(a->pool);
+    start = trace_start();
+    for (int l = 0; l < p->levels; l++) {
+        const struct pyramid_level *level = &p->level[l];
+        const unsigned char *g = p->gaussian + level->offset;
+        int16_t *lap = p->laplacian + level->offset;
+        row_size = (size_t)level->width * channels;
+        height = level->height;
+        start_y = height / count * index;
+        end_y = index == count - 1 ? height : height / count * (index + 1);
+
+        for (int y = start_y; y < end_y; y++) {
+            const unsigned char *src = g + y * row_size;
+            int16_t *dst = lap + y * row_size;
+            if (l == p->levels - 1) {
+                for (size_t i = 0; i < row_size; i++) {
+                    dst[i] = src[i];
+                }
+                continue;
+            }
+
+            pyramid_expand(p, l, p->gaussian + p->level[l + 1].offset, y,
+                           line, e);
+            for (size_t i = 0; i < row_size; i++) {
+                dst[i] = src[i] - e[i];
+            }
+        }
+    }
+    trace_event("pyramid laplacian", start);
+}
+
+// Level l of the reconstruction: the output image for level 0, the scratch
+// levels from then on.
+static unsigned char *pyramid_target(const struct pyramid_args *a, int l) {
+    if (l == 0) {
+        return a->out->bytes;
+    }
+    return a->levels + (a->p->level[l].offset - a->p->level[1].offset);
+}
+
+static void pyramid_collapse_thread(void *args, int index, int count) {
+    struct pyramid_args *a = (struct pyramid_args *)args;
+    const struct pyramid *p = a->p;
+    int channels = p->channels;
+    size_t low_row = (size_t)(p->levels > 1 ? p->level[1].width : 1) *
+                     channels;
+    uint16_t *line = (uint16_t *)(a->rows + index * a->thread_size);
+    unsigned char *e = (unsigned char *)(line + low_row);
+
+    long start = trace_start();
+    for (int l = p->levels - 1; l >= 0; l--) {
+        if (l < p->levels - 1) {
+            thread_pool_barrier(a->pool);
+        }
+
+        const struct pyramid_level *level = &p->level[l];
+        const int16_t *lap = p->laplacian + level->offset;
+        unsigned char *g = pyramid_target(a, l);
+        size_t row_size = (size_t)level->width * channels;
+        int height = level->height;
+        int start_y = height / count * index;
+        int end_y = index == count - 1 ? height : height / count * (index + 1);
+
+        for (int y = start_y; y < end_y; y++) {
+            const int16_t *src = lap + y * row_size;
+            unsigned char *dst = g + y * row_size;
+            if (l == p->levels - 1) {
+                for (size_t i = 0; i < row_size; i++) {
+                    dst[i] = pyramid_clamp(src[i], 0, 255);
+                }
+                continue;
+            }
+
+            pyramid_expand(p, l, pyramid_target(a, l + 1), y, line, e);
+            for (size_t i = 0; i < row_size; i++) {
+                dst[i] = pyramid_clamp(src[i] + e[i], 0, 255);
+            }
+        }
+    }
+    trace_event("pyramid collapse", start);
+}
+
+// Per thread scratch: the ring and the column row of 16 bit sums over the
+// widest decimated level, and one row of level 0, cache line aligned.
+static size_t pyramid_thread_size(const struct pyramid *p) {
+    size_t low_row = (size_t)(p->levels > 1 ? p->level[1].width : 1) *
+                     p->channels;
+    size_t size = 6 * low_row * sizeof(uint16_t) +
+                  (size_t)p->level[0].width * p->channels;
+    return (size + 63) / 64 * 64;
+}
+
+int pyramid_build(struct filter_context *ctx, struct image *img, int levels,
+                  int laplacian, struct pyramid *p) {
+    if (levels < 1 || levels > PYRAMID_MAX_LEVELS) {
+        LOG_ERROR("Pyramid levels out of range: %d", levels);
+        return 1;
+    }
+
+    size_t size = 0;
+    int width = img->width;
+    int height = img->height;
+    p->levels = 0;
+    p->channels = img->channels;
+    for (int l = 0; l < levels; l++) {
+        p->level[l].width = width;
+        p->level[l].height = height;
+        p->level[l].offset = size;
+        p->levels++;
+        size += (size_t)width * height * img->channels;
+        if (width == 1 && height == 1) {
+            break;
+        }
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+
+    if (p->capacity < size) {
+        buffer_pool_free(p->gaussian);
+        p->capacity = 0;
+        p->gaussian = buffer_pool_alloc(size);
+        if (p->gaussian == NULL) {
+            LOG_ERROR("Could not allocate memory for pyramid");
+            return 1;
+        }
+        p->capacity = size;
+    }
+    if (laplacian && p->laplacian_capacity < size) {
+        buffer_pool_free(p->laplacian);
+        p->laplacian_capacity = 0;
+        p->laplacian = buffer_pool_alloc(size * sizeof(int16_t));
+        if (p->laplacian == NULL) {
+            LOG_ERROR("Could not allocate memory for pyramid");
+            return 1;
+        }
+        p->laplacian_capacity = size;
+    }
+
+    size_t thread_size = pyramid_thread_size(p);
+    unsigned char *rows = filter_context_scratch(
+        ctx, (size_t)thread_pool_size(ctx->pool) * thread_size);
+    if (rows == NULL) {
+        return 1;
+    }
+
+    struct pyramid_args args = {
+        .img = img,
+        .p = p,
+        .laplacian = laplacian,
+        .pool = ctx->pool,
+        .rows = rows,
+        .thread_size = thread_size,
+    };
+    thread_pool_run(ctx->pool, pyramid_build_thread, &args);
+
+    return 0;
+}
+
+unsigned char *pyramid_gaussian(const struct pyramid *p, int level) {
+    return p->gaussian + p->level[level].offset;
+}
+
+int16_t *pyramid_laplacian(const struct pyramid *p, int level) {
+    return p->laplacian + p->level[level].offset;
+}
+
+int pyramid_collapse(struct filter_context *ctx, const struct pyramid *p,
+                     struct image *out) {
+    if (p->laplacian == NULL || p->levels == 0) {
+        LOG_ERROR("Pyramid has no Laplacian levels to collapse");
+        return 1;
+    }
+
+    const struct pyramid_level *top = &p->level[p->levels - 1];
+    if (image_reserve(out, p->level[0].width, p->level[0].height,
+                      p->channels) != 0) {
+        return 1;
+    }
+
+    size_t thread_size = pyramid_thread_size(p);
+    size_t threads_size = (size_t)thread_pool_size(ctx->pool) * thread_size;
+    size_t levels_size = top->offset +
+                         (size_t)top->width * top->height * p->channels -
+                         (p->levels > 1 ? p->level[1].offset : top->offset);
+    unsigned char *rows =
+        filter_context_scratch(ctx, threads_size + levels_size);
+    if (rows == NULL) {
+        return 1;
+    }
+
+    struct pyramid_args args = {
+        .p = p,
+        .pool = ctx->pool,
+        .rows = rows,
+        .thread_size = thread_size,
+        .levels = rows + threads_size,
+        .out = out,
+    };
+    thread_pool_run(ctx->pool, pyramid_collapse_thread, &args);
+
+    return 0;
+}
+
+int pyramid_level_image(const struct pyramid *p, int level, int laplacian,
+                        struct image *out) {
+    if (level < 0 || level >= p->levels ||
+        (laplacian && p->laplacian == NULL)) {
+        LOG_ERROR("Pyramid has no level %d", level);
+        return 1;
+    }
+
+    const struct pyramid_level *l = &p->level[level];
+    if (image_reserve(out, l->width, l->height, p->channels) != 0) {
+        return 1;
+    }
+
+    size_t size = (size_t)l->width * l->height * p->channels;
+    if (!laplacian) {
+        memcpy(out->bytes, pyramid_gaussian(p, level), size);
+        return 0;
+    }
+
+    const int16_t *src = pyramid_laplacian(p, level);
+    int offset = level == p->levels - 1 ? 0 : PYRAMID_LAPLACIAN_OFFSET;
+    for (size_t i = 0; i < size; i++) {
+        out->bytes[i] = pyramid_clamp(src[i] + offset, 0, 255);
+    }
+
+    return 0;
+}
+
+void pyramid_destroy(struct pyramid *p) {
+    buffer_pool_free(p->gaussian);
+    buffer_pool_free(p->laplacian);
+    p->gaussian = NULL;
+    p->laplacian = NULL;
+    p->capacity = 0;
+    p->laplacian_capacity = 0;
+    p->levels = 0;
+}
@@ -0,0 +1,99 @@
+#include "queue.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+struct queue {
+        void **items;
+        size_t capacity;
+        size_t head;
+        size_t count;
+        int closed;
+        pthread_mutex_t mutex;
+        pthread_cond_t not_empty;
+        pthread_cond_t not_full;
+};
+
+struct queue *queue_new(size_t capacity) {
+    struct queue *q = calloc(1, sizeof(struct queue));
+    if (q == NULL) {
+        LOG_ERROR("Could not allocate memory for queue");
+        return NULL;
+    }
+
+    q->items = calloc(capacity, sizeof(void *));
+    if (q->items == NULL) {
+        LOG_ERROR("Could not allocate memory for queue items");
+        free(q);
+        return NULL;
+    }
+
+    q->capacity = capacity;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+
+    return q;
+}
+
+// Blocks while the queue is full. Returns 1 if the queue has been closed.
+int queue_push(struct queue *q, void *item) {
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == q->capacity && !q->closed) {
+        pthread_cond_wait(&q->not_full, &q->mutex);
+    }
+
+    if (q->closed) {
+        pthread_mutex_unlock(&q->mutex);
+        return 1;
+    }
+
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+
+    return 0;
+}
+
+// Blocks while the queue is empty. Returns 1 once the queue is closed and
+// drained.
+int queue_pop(struct queue *q, void **item) {
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+    }
+
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->mutex);
+        return 1;
+    }
+
+    *item = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+
+    return 0;
+}
+
+void queue_close(struct queue *q) {
+    pthread_mutex_lock(&q->mutex);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void queue_free(struct queue *q) {
+    if (q == NULL) {
+        return;
+    }
+
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->mutex);
+    free(q->items);
+    free(q);
+}
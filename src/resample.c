@@ -0,0 +1,374 @@
+#include "resample.h"
+#include "convolve.h"
+#include "trace.h"
+#include "util.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RESAMPLE_LANES 8
+
+// Bytes widen to and narrow from 32 bit lanes by way of 16 bit ones, which
+// compile to vector instructions where the direct conversions are split
+// into one per lane.
+typedef uint8_t resample_u8 __attribute__((vector_size(RESAMPLE_LANES)));
+typedef int16_t resample_i16 __attribute__((vector_size(RESAMPLE_LANES * 2)));
+typedef int32_t resample_i32 __attribute__((vector_size(RESAMPLE_LANES * 4)));
+typedef float resample_f32 __attribute__((vector_size(RESAMPLE_LANES * 4)));
+typedef uint8_t resample_u8x4 __attribute__((vector_size(4)));
+typedef int16_t resample_i16x4 __attribute__((vector_size(8)));
+typedef int32_t resample_i32x4 __attribute__((vector_size(16)));
+typedef float resample_f32x4 __attribute__((vector_size(16)));
+
+// Weights of one axis: output pixel i sums count[i] input pixels from
+// start[i] on, with the weights at i * taps.
+struct resample_axis {
+        int size;
+        int taps;
+        int *start;
+        int *count;
+        float *weights;
+};
+
+struct resample_args {
+        struct image *img;
+        const struct resample_axis *x;
+        const struct resample_axis *y;
+        unsigned char *rows;
+        float *lines;
+        struct thread_pool *pool;
+        struct image *out;
+};
+
+static int resample_clamp(long v) {
+    return v < 1 ? 1 : v > RESAMPLE_MAX_SIZE ? RESAMPLE_MAX_SIZE : (int)v;
+}
+
+void resample_size(int width, int height, int target_width, int target_height,
+                   int *out_width, int *out_height) {
+    if (target_width == 0 && target_height == 0) {
+        target_width = width;
+        target_height = height;
+    } else if (target_width == 0) {
+        target_width = (int)lround((double)width * target_height / height);
+    } else if (target_height == 0) {
+        target_height = (int)lround((double)height * target_width / width);
+    }
+
+    *out_width = resample_clamp(target_width);
+    *out_height = resample_clamp(target_height);
+}
+
+// Half width of the filters at scale 1.
+static float resample_support(enum resample_filter filter) {
+    switch (filter) {
+    case RESAMPLE_BOX:
+        return 0.5f;
+    case RESAMPLE_BILINEAR:
+        return 1.0f;
+    case RESAMPLE_LANCZOS3:
+        return 3.0f;
+    }
+
+    return 0.0f;
+}
+
+static float resample_sinc(float x) {
+    if (x == 0.0f) {
+        return 1.0f;
+    }
+    x *= (float)M_PI;
+    return sinf(x) / x;
+}
+
+static float resample_kernel(enum resample_filter filter, float x) {
+    switch (filter) {
+    case RESAMPLE_BOX:
+        return x > -0.5f && x <= 0.5f ? 1.0f : 0.0f;
+    case RESAMPLE_BILINEAR:
+        x = fabsf(x);
+        return x < 1.0f ? 1.0f - x : 0.0f;
+    case RESAMPLE_LANCZOS3:
+        return x > -3.0f && x < 3.0f ? resample_sinc(x) * resample_sinc(x / 3)
+                                     : 0.0f;
+    }
+
+    return 0.0f;
+}
+
+// Number of weights of every output pixel when resampling in pixels to
+// out.
+static int resample_taps(int in, int out, enum resample_filter filter) {
+    float scale = (float)in / out;
+    float stretch = scale > 1.0f ? scale : 1.0f;
+    return 2 * (int)ceilf(resample_support(filter) * stretch) + 3;
+}
+
+// Output pixel i covers input pixels i * scale to (i + 1) * scale, the
+// filter is centered there and stretched by the scale when it exceeds one.
+// The window takes a pixel more on both sides than the support, so that
+// the filter alone decides on pixels right at its edge, and is then trimmed
+// to the pixels of nonzero weight. The box is closed on its right, which
+// leaves one of its pixels in every window; pixels whose window holds no
+// weight all the same take the pixel under their center.
+static void resample_axis_init(struct resample_axis *a, int in,
+                               enum resample_filter filter) {
+    float scale = (float)in / a->size;
+    float stretch = scale > 1.0f ? scale : 1.0f;
+    float support = resample_support(filter) * stretch;
+
+    for (int i = 0; i < a->size; i++) {
+        float center = (i + 0.5f) * scale;
+        int lo = (int)floorf(center - support - 0.5f);
+        int hi = (int)ceilf(center + support + 0.5f);
+        lo = lo < 0 ? 0 : lo;
+        hi = hi > in ? in : hi;
+        if (hi - lo > a->taps) {
+            hi = lo + a->taps;
+        }
+
+        float *w = a->weights + (size_t)i * a->taps;
+        float total = 0.0f;
+        int first = -1, last = -1;
+        for (int k = 0; k < hi - lo; k++) {
+            w[k] = resample_kernel(filter, (lo + k - center + 0.5f) / stretch);
+            total += w[k];
+            if (w[k] != 0.0f) {
+                first = first < 0 ? k : first;
+                last = k;
+            }
+        }
+
+        if (total == 0.0f) {
+            lo = (int)center < in ? (int)center : in - 1;
+            first = last = 0;
+            w[0] = 1.0f;
+            total = 1.0f;
+        }
+        for (int k = first; k <= last; k++) {
+            w[k - first] = w[k] / total;
+        }
+
+        a->start[i] = lo + first;
+        a->count[i] = last - first + 1;
+    }
+}
+
+static unsigned char resample_value(float value) {
+    value += CONVOLVE_ROUNDING_BIAS;
+    if (value < 0.0f) {
+        value = 0.0f;
+    } else if (value > 255.0f) {
+        value = 255.0f;
+    }
+
+    return (unsigned char)value;
+}
+
+// Gathers rows rows of src, the last one repeated up to RESAMPLE_LANES,
+// side by side into lines: value i of row r goes to lane r of vector i.
+static void resample_gather(const unsigned char *src, size_t row_size,
+                            int rows, float *lines) {
+    for (int r = 0; r < RESAMPLE_LANES; r++) {
+        const unsigned char *s = src + (r < rows ? r : rows - 1) * row_size;
+        for (size_t i = 0; i < row_size; i++) {
+            lines[i * RESAMPLE_LANES + r] = s[i];
+        }
+    }
+}
+
+// Resamples the gathered lines along x, every value of RESAMPLE_LANES rows
+// at once, and scatters the first rows of them to dst, out_row bytes apart.
+__attribute__((target_clones("avx2", "default"))) static void
+resample_rows(const struct resample_axis *a, const float *lines,
+              int channels, int rows, unsigned char *dst, size_t out_row) {
+    for (int x = 0; x < a->size; x++) {
+        const float *w = a->weights + (size_t)x * a->taps;
+        int count = a->count[x];
+
+        for (int c = 0; c < channels; c++) {
+            const float *s =
+                lines + ((size_t)a->start[x] * channels + c) * RESAMPLE_LANES;
+            resample_f32 sum = {0.0f};
+            for (int k = 0; k < count; k++) {
+                resample_f32 v;
+                memcpy(&v, s + (size_t)k * channels * RESAMPLE_LANES,
+                       sizeof(v));
+                sum += w[k] * v;
+            }
+
+            resample_i32 q = __builtin_convertvector(
+                sum + CONVOLVE_ROUNDING_BIAS, resample_i32);
+            q &= ~(q < 0);
+            resample_i32 top = q > 255;
+            q = (q & ~top) | (255 & top);
+            unsigned char *d = dst + (size_t)x * channels + c;
+            for (int r = 0; r < rows; r++) {
+                d[r * out_row] = q[r];
+            }
+        }
+    }
+}
+
+// Sums count rows of n bytes, row_size apart, with the weights w into dst,
+// keeping the sums of 8 values in registers across the rows.
+__attribute__((target_clones("avx2", "default"))) static void
+resample_column(const unsigned char *src, size_t row_size, const float *w,
+                int count, unsigned char *dst, size_t n) {
+    size_t i = 0;
+    for (; i + RESAMPLE_LANES <= n; i += RESAMPLE_LANES) {
+        resample_f32 sum = {0.0f};
+        for (int k = 0; k < count; k++) {
+            resample_u8 bytes;
+            memcpy(&bytes, src + k * row_size + i, sizeof(bytes));
+            resample_i32 v = __builtin_convertvector(
+                __builtin_convertvector(bytes, resample_i16), resample_i32);
+            sum += w[k] * __builtin_convertvector(v, resample_f32);
+        }
+
+        resample_i32 q =
+            __builtin_convertvector(sum + CONVOLVE_ROUNDING_BIAS, resample_i32);
+        q &= ~(q < 0);
+        resample_i32 top = q > 255;
+        q = (q & ~top) | (255 & top);
+        resample_u8 bytes = __builtin_convertvector(
+            __builtin_convertvector(q, resample_i16), resample_u8);
+        memcpy(dst + i, &bytes, sizeof(bytes));
+    }
+    for (; i < n; i++) {
+        float sum = 0.0f;
+        for (int k = 0; k < count; k++) {
+            sum += w[k] * src[k * row_size + i];
+        }
+        dst[i] = resample_value(sum);
+    }
+}
+
+// Rows first, every thread its share of the input rows into rows, which
+// has the output width, then columns, every thread its share of the output
+// rows. Axes that keep their size are left out, and when both do the rows
+// are copied.
+static void resample_thread(void *args, int index, int count) {
+    struct resample_args *a = (struct resample_args *)args;
+    struct image *img = a->img;
+    int channels = img->channels;
+    size_t in_row = (size_t)img->width * channels;
+    size_t out_row = (size_t)a->out->width * channels;
+    int rows = a->x != NULL;
+    int columns = a->y != NULL;
+
+    long start = trace_start();
+    int height = img->height;
+    int start_y = height / count * index;
+    int end_y = index == count - 1 ? height : height / count * (index + 1);
+    if (rows) {
+        unsigned char *dst = columns ? a->rows : a->out->bytes;
+        float *lines = a->lines + (size_t)index * in_row * RESAMPLE_LANES;
+        for (int y = start_y; y < end_y; y += RESAMPLE_LANES) {
+            int n = end_y - y < RESAMPLE_LANES ? end_y - y : RESAMPLE_LANES;
+            resample_gather(img->bytes + y * in_row, in_row, n, lines);
+            resample_rows(a->x, lines, channels, n, dst + y * out_row,
+                          out_row);
+        }
+        trace_event("resample rows", start);
+    } else if (!columns) {
+        memcpy(a->out->bytes + start_y * out_row,
+               img->bytes + start_y * in_row, (end_y - start_y) * in_row);
+        trace_event("resample copy", start);
+    }
+
+    if (!columns) {
+        return;
+    }
+    if (rows) {
+        thread_pool_barrier(a->pool);
+    }
+
+    start = trace_start();
+    const unsigned char *src = rows ? a->rows : img->bytes;
+    height = a->out->height;
+    start_y = height / count * index;
+    end_y = index == count - 1 ? height : height / count * (index + 1);
+    for (int y = start_y; y < end_y; y++) {
+        resample_column(src + a->y->start[y] * out_row, out_row,
+                        a->y->weights + (size_t)y * a->y->taps,
+                        a->y->count[y], a->out->bytes + y * out_row,
+                        out_row);
+    }
+    trace_event("resample columns", start);
+}
+
+// Size of the weight tables of an axis, a multiple of the float size.
+static size_t resample_axis_bytes(int size, int taps) {
+    return (size_t)size * (2 * sizeof(int) + taps * sizeof(float));
+}
+
+static void resample_axis_place(struct resample_axis *a, unsigned char *mem) {
+    a->weights = (float *)mem;
+    a->start = (int *)(a->weights + (size_t)a->size * a->taps);
+    a->count = a->start + a->size;
+}
+
+int resample_image(struct filter_context *ctx, struct image *img, int width,
+                   int height, enum resample_filter filter,
+                   struct image *out) {
+    if (width < 1 || width > RESAMPLE_MAX_SIZE || height < 1 ||
+        height > RESAMPLE_MAX_SIZE || filter < RESAMPLE_BOX ||
+        filter > RESAMPLE_LANCZOS3) {
+        LOG_ERROR("Resample arguments out of range: %d, %d, %d", width,
+                  height, filter);
+        return 1;
+    }
+
+    if (image_reserve(out, width, height, img->channels) != 0) {
+        return 1;
+    }
+
+    struct resample_axis x = {width, resample_taps(img->width, width, filter)};
+    struct resample_axis y = {height,
+                              resample_taps(img->height, height, filter)};
+    int rows = width != img->width;
+    int columns = height != img->height;
+
+    // Scratch holds the gathered lines of every thread, the weights of both
+    // axes and the rows resampled along x, in that order.
+    size_t lines_bytes = rows ? (size_t)thread_pool_size(ctx->pool) *
+                                    img->width * img->channels *
+                                    RESAMPLE_LANES * sizeof(float)
+                              : 0;
+    size_t x_bytes = rows ? resample_axis_bytes(x.size, x.taps) : 0;
+    size_t y_bytes = columns ? resample_axis_bytes(y.size, y.taps) : 0;
+    size_t rows_bytes =
+        rows && columns ? (size_t)width * img->height * img->channels : 0;
+    size_t size = lines_bytes + x_bytes + y_bytes + rows_bytes;
+    unsigned char *scratch = NULL;
+    if (size > 0) {
+        scratch = filter_context_scratch(ctx, size);
+        if (scratch == NULL) {
+            return 1;
+        }
+    }
+
+    if (rows) {
+        resample_axis_place(&x, scratch + lines_bytes);
+        resample_axis_init(&x, img->width, filter);
+    }
+    if (columns) {
+        resample_axis_place(&y, scratch + lines_bytes + x_bytes);
+        resample_axis_init(&y, img->height, filter);
+    }
+
+    struct resample_args args = {
+        .img = img,
+        .x = rows ? &x : NULL,
+        .y = columns ? &y : NULL,
+        .rows = rows_bytes > 0 ? scratch + lines_bytes + x_bytes + y_bytes
+                               : NULL,
+        .lines = rows ? (float *)scratch : NULL,
+        .pool = ctx->pool,
+        .out = out,
+    };
+    thread_pool_run(ctx->pool, resample_thread, &args);
+
+    return 0;
+}
@@ -0,0 +1,518 @@
+#include "server.h"
+#include "backend.h"
+#include "filter.h"
+#include "pipeline.h"
+#include "queue.h"
+#include "trace.h"
+#include "util.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#define PROTOCOL_IMPLEMENTATION
+#include "protocol.h"
+
+struct server_job {
+        char filter[PROTOCOL_LINE_MAX];
+        int repeats;
+        char output[PROTOCOL_LINE_MAX];
+        char input[PROTOCOL_LINE_MAX];
+        unsigned char *data;
+        size_t size;
+
+        long received_us;
+        long started_us;
+        long finished_us;
+        int result;
+        char error[128];
+
+        int done;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+};
+
+struct server_stats {
+        pthread_mutex_t mutex;
+        size_t completed;
+        size_t failed;
+        long total_us;
+        long max_us;
+};
+
+// mutex guards the worker start counts and the list of connections, whose
+// threads are joined and whose sockets are closed by the accepting thread
+// once they are done, or on shutdown.
+struct server {
+        const char *backend;
+        struct queue *jobs;
+        struct server_stats stats;
+        pthread_mutex_t mutex;
+        pthread_cond_t started;
+        int ready;
+        int failed;
+        struct server_connection *connections;
+};
+
+struct server_worker {
+        struct server *server;
+        int index;
+        pthread_t thread;
+};
+
+struct server_connection {
+        struct server *server;
+        int fd;
+        pthread_t thread;
+        int done;
+        struct server_connection *next;
+};
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void server_handle_signal(int signal) {
+    (void)signal;
+    server_stopping = 1;
+}
+
+// SIGINT and SIGTERM stay blocked everywhere but inside the pselect() of the
+// accepting thread, so that they never land on a worker.
+static void server_block_signals(int how) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(how, &set, NULL);
+}
+
+// Waits until fd has a connection to accept, with SIGINT and SIGTERM
+// unblocked only for the wait itself. A signal that arrived since the last
+// check of server_stopping is still pending, so pselect() returns at once
+// instead of the signal being handled just before a blocking accept().
+static int server_wait(int fd) {
+    sigset_t mask;
+    pthread_sigmask(SIG_BLOCK, NULL, &mask);
+    sigdelset(&mask, SIGINT);
+    sigdelset(&mask, SIGTERM);
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    return pselect(fd + 1, &fds, NULL, NULL, NULL, &mask);
+}
+
+static long server_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int server_job_execute(struct filter_context *ctx,
+                              struct server_job *job) {
+    int result = 0;
+    struct image img = {0}, out = {0};
+    struct pipeline pipeline = {0};
+
+    if (pipeline_parse(&pipeline, job->filter, NULL) != 0) {
+        snprintf(job->error, sizeof(job->error), "unknown filter: %s",
+                 job->filter);
+        return_defer(1);
+    }
+
+    int loaded = job->data != NULL
+                     ? image_load_from_memory(&img, job->data, job->size)
+                     : image_load(&img, job->input);
+    if (loaded != 0) {
+        snprintf(job->error, sizeof(job->error), "could not load image");
+        return_defer(1);
+    }
+
+    if (pipeline_apply(ctx, &pipeline, &img, &out, job->repeats) != 0) {
+        snprintf(job->error, sizeof(job->error), "could not apply filter");
+        return_defer(1);
+    }
+
+    if (image_write_pbm(&out, job->output) != 0) {
+        snprintf(job->error, sizeof(job->error), "could not write image");
+        return_defer(1);
+    }
+
+defer:
+    image_destroy(&img);
+    image_destroy(&out);
+    pipeline_free(&pipeline);
+
+    return result;
+}
+
+// Each worker owns a single-threaded filter context; parallelism comes from
+// running several jobs at once rather than splitting one job.
+static void *server_worker_main(void *args) {
+    struct server_worker *w = (struct server_worker *)args;
+    struct server *s = w->server;
+    struct filter_context ctx;
+    void *item;
+
+    int failed = filter_context_init(&ctx, 1, s->backend) != 0;
+    if (failed) {
+        LOG_ERROR("Could not initialize server worker %d", w->index);
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    if (failed) {
+        s->failed++;
+    } else {
+        s->ready++;
+    }
+    pthread_cond_signal(&s->started);
+    pthread_mutex_unlock(&s->mutex);
+
+    if (failed) {
+        return NULL;
+    }
+
+    trace_set_thread_name("server worker %d", w->index);
+
+    while (queue_pop(s->jobs, &item) == 0) {
+        struct server_job *job = (struct server_job *)item;
+
+        job->started_us = server_now_us();
+        long start = trace_start();
+        job->result = server_job_execute(&ctx, job);
+        trace_event("job", start);
+        job->finished_us = server_now_us();
+
+        long total_us = job->finished_us - job->received_us;
+        pthread_mutex_lock(&s->stats.mutex);
+        s->stats.completed++;
+        if (job->result != 0) {
+            s->stats.failed++;
+        }
+        s->stats.total_us += total_us;
+        if (total_us > s->stats.max_us) {
+            s->stats.max_us = total_us;
+        }
+        pthread_mutex_unlock(&s->stats.mutex);
+
+        LOG_INFO("job %s -> %s: %s queue=%ldus process=%ldus",
+                 job->data != NULL ? "<inline>" : job->input, job->output,
+                 job->result == 0 ? "ok" : job->error,
+                 job->started_us - job->received_us,
+                 job->finished_us - job->started_us);
+
+        pthread_mutex_lock(&job->mutex);
+        job->done = 1;
+        pthread_cond_signal(&job->cond);
+        pthread_mutex_unlock(&job->mutex);
+    }
+
+    filter_context_destroy(&ctx);
+
+    return NULL;
+}
+
+static int server_job_parse(struct protocol_reader *r, char *line,
+                            struct server_job *job) {
+    char source[8];
+    char argument[PROTOCOL_LINE_MAX];
+
+    if (sscanf(line, "JOB %4095s %d %4095s %7s %4095s", job->filter,
+               &job->repeats, job->output, source, argument) != 5) {
+        snprintf(job->error, sizeof(job->error), "malformed job");
+        return 1;
+    }
+
+    if (job->repeats <= 0) {
+        snprintf(job->error, sizeof(job->error),
+                 "repeats must be a positive number");
+        return 1;
+    }
+
+    if (strcmp(source, "FILE") == 0) {
+        strcpy(job->input, argument);
+        return 0;
+    }
+
+    if (strcmp(source, "DATA") != 0) {
+        snprintf(job->error, sizeof(job->error), "unknown source: %s", source);
+        return 1;
+    }
+
+    char *end;
+    unsigned long size = strtoul(argument, &end, 10);
+    if (*end != '\0' || size == 0 || size > PROTOCOL_DATA_MAX) {
+        snprintf(job->error, sizeof(job->error), "invalid data size: %.32s",
+                 argument);
+        return 1;
+    }
+
+    job->data = malloc(size);
+    if (job->data == NULL) {
+        snprintf(job->error, sizeof(job->error), "out of memory");
+        return 1;
+    }
+    job->size = size;
+
+    if (protocol_read_exact(r, job->data, size) != 0) {
+        snprintf(job->error, sizeof(job->error), "truncated data");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void *server_connection_main(void *args) {
+    struct server_connection *c = (struct server_connection *)args;
+    struct protocol_reader reader;
+    char line[PROTOCOL_LINE_MAX];
+    char reply[256];
+
+    protocol_reader_init(&reader, c->fd);
+
+    while (protocol_read_line(&reader, line, sizeof(line)) == 0) {
+        struct server_job job = {0};
+        pthread_mutex_init(&job.mutex, NULL);
+        pthread_cond_init(&job.cond, NULL);
+        job.received_us = server_now_us();
+
+        int parsed = server_job_parse(&reader, line, &job);
+        if (parsed == 0 && queue_push(c->server->jobs, &job) != 0) {
+            snprintf(job.error, sizeof(job.error), "server is shutting down");
+            parsed = 1;
+        }
+
+        if (parsed == 0) {
+            pthread_mutex_lock(&job.mutex);
+            while (!job.done) {
+                pthread_cond_wait(&job.cond, &job.mutex);
+            }
+            pthread_mutex_unlock(&job.mutex);
+        }
+
+        if (parsed == 0 && job.result == 0) {
+            snprintf(reply, sizeof(reply), "OK %ld %ld %ld\n",
+                     job.started_us - job.received_us,
+                     job.finished_us - job.started_us,
+                     job.finished_us - job.received_us);
+        } else {
+            snprintf(reply, sizeof(reply), "ERR %s\n", job.error);
+        }
+
+        free(job.data);
+        pthread_cond_destroy(&job.cond);
+        pthread_mutex_destroy(&job.mutex);
+
+        // A malformed stream cannot be resynchronized, so drop the client.
+        if (protocol_write_all(c->fd, reply, strlen(reply)) != 0 ||
+            parsed != 0) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&c->server->mutex);
+    c->done = 1;
+    pthread_mutex_unlock(&c->server->mutex);
+
+    return NULL;
+}
+
+// Joins the connection threads that are done, or all of them after
+// shutting down their sockets, which ends their reads and writes, and
+// closes and frees them. A connection waiting for its job gets the reply
+// once a worker has run it, and only then sees the shutdown.
+static void server_reap(struct server *s, int all) {
+    struct server_connection *reaped = NULL;
+
+    pthread_mutex_lock(&s->mutex);
+    struct server_connection **link = &s->connections;
+    while (*link != NULL) {
+        struct server_connection *c = *link;
+        if (all) {
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        if (all || c->done) {
+            *link = c->next;
+            c->next = reaped;
+            reaped = c;
+        } else {
+            link = &c->next;
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    while (reaped != NULL) {
+        struct server_connection *c = reaped;
+        reaped = c->next;
+        pthread_join(c->thread, NULL);
+        close(c->fd);
+        free(c);
+    }
+}
+
+static int server_listen(const char *socket_path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Socket path is too long: %s", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOG_ERROR("Could not create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        LOG_ERROR("Could not listen on %s: %s", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int server_run(const char *socket_path, int workers, size_t queue_capacity,
+               const char *backend) {
+    int result = 0;
+    struct server s = {0};
+    struct server_worker *threads = NULL;
+    int started = 0;
+    int fd = -1;
+
+    pthread_mutex_init(&s.stats.mutex, NULL);
+    pthread_mutex_init(&s.mutex, NULL);
+    pthread_cond_init(&s.started, NULL);
+
+    s.backend = backend;
+    if (backend_select(backend) == NULL) {
+        return_defer(1);
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = server_handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    server_block_signals(SIG_BLOCK);
+
+    s.jobs = queue_new(queue_capacity);
+    if (s.jobs == NULL) {
+        return_defer(1);
+    }
+
+    threads = calloc(workers, sizeof(struct server_worker));
+    if (threads == NULL) {
+        LOG_ERROR("Could not allocate memory for server workers");
+        return_defer(1);
+    }
+
+    for (; started < workers; started++) {
+        threads[started].server = &s;
+        threads[started].index = started;
+        if (pthread_create(&threads[started].thread, NULL, server_worker_main,
+                           &threads[started]) != 0) {
+            LOG_ERROR("Could not create server worker %d", started);
+            return_defer(1);
+        }
+    }
+
+    // Serving with fewer workers than asked for, or none, would leave
+    // clients waiting on jobs that never run.
+    pthread_mutex_lock(&s.mutex);
+    while (s.ready + s.failed < started) {
+        pthread_cond_wait(&s.started, &s.mutex);
+    }
+    int failed = s.failed;
+    pthread_mutex_unlock(&s.mutex);
+    if (failed > 0) {
+        LOG_ERROR("%d of %d server workers failed to initialize", failed,
+                  workers);
+        return_defer(1);
+    }
+
+    fd = server_listen(socket_path);
+    if (fd < 0) {
+        return_defer(1);
+    }
+
+    LOG_INFO("listening on %s with %d %s workers", socket_path, workers,
+             backend_select(backend)->name);
+
+    while (!server_stopping) {
+        if (server_wait(fd) < 0) {
+            if (errno != EINTR) {
+                LOG_ERROR("Could not wait for connections: %s",
+                          strerror(errno));
+            }
+            continue;
+        }
+
+        server_reap(&s, 0);
+
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR) {
+                LOG_ERROR("Could not accept connection: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        struct server_connection *c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            close(client);
+            continue;
+        }
+
+        c->server = &s;
+        c->fd = client;
+        pthread_mutex_lock(&s.mutex);
+        if (pthread_create(&c->thread, NULL, server_connection_main, c) != 0) {
+            pthread_mutex_unlock(&s.mutex);
+            LOG_ERROR("Could not create connection thread");
+            close(client);
+            free(c);
+            continue;
+        }
+        c->next = s.connections;
+        s.connections = c;
+        pthread_mutex_unlock(&s.mutex);
+    }
+
+defer:
+    if (fd >= 0) {
+        close(fd);
+        unlink(socket_path);
+    }
+    server_reap(&s, 1);
+    if (s.jobs) {
+        queue_close(s.jobs);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    free(threads);
+    queue_free(s.jobs);
+    server_block_signals(SIG_UNBLOCK);
+
+    if (s.stats.completed > 0) {
+        LOG_INFO("served %zu jobs, %zu failed, mean latency %ldus, max %ldus",
+                 s.stats.completed, s.stats.failed,
+                 s.stats.total_us / (long)s.stats.completed, s.stats.max_us);
+    }
+
+    pthread_cond_destroy(&s.started);
+    pthread_mutex_destroy(&s.mutex);
+    pthread_mutex_destroy(&s.stats.mutex);
+
+    return result;
+}
@@ -0,0 +1,153 @@
+#include "threadpool.h"
+#include "trace.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+struct thread_pool_worker {
+        struct thread_pool *pool;
+        int index;
+};
+
+struct thread_pool {
+        int count;
+        pthread_t *threads;
+        struct thread_pool_worker *workers;
+        pthread_mutex_t mutex;
+        pthread_cond_t start;
+        pthread_cond_t done;
+        pthread_barrier_t barrier;
+        thread_pool_task task;
+        void *args;
+        unsigned long generation;
+        int pending;
+        int stop;
+};
+
+static void *thread_pool_worker_main(void *args) {
+    struct thread_pool_worker *w = (struct thread_pool_worker *)args;
+    struct thread_pool *pool = w->pool;
+    unsigned long seen = 0;
+
+    trace_set_thread_name("worker %d", w->index);
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->generation == seen && !pool->stop) {
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        }
+        if (pool->stop) {
+            break;
+        }
+
+        seen = pool->generation;
+        thread_pool_task task = pool->task;
+        void *task_args = pool->args;
+        pthread_mutex_unlock(&pool->mutex);
+
+        task(task_args, w->index, pool->count);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+// The calling thread takes part in every run as worker 0, so a pool of size
+// n only spawns n - 1 threads and a pool of size 1 spawns none.
+struct thread_pool *thread_pool_new(int threads) {
+    if (threads <= 0) {
+        LOG_ERROR("thread pool size must be positive");
+        return NULL;
+    }
+
+    struct thread_pool *pool = calloc(1, sizeof(struct thread_pool));
+    if (pool == NULL) {
+        LOG_ERROR("Could not allocate memory for thread pool");
+        return NULL;
+    }
+
+    pool->count = threads;
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    pool->workers = calloc(threads, sizeof(struct thread_pool_worker));
+    if (pool->threads == NULL || pool->workers == NULL) {
+        LOG_ERROR("Could not allocate memory for thread pool workers");
+        free(pool->threads);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pthread_barrier_init(&pool->barrier, NULL, threads);
+
+    for (int i = 1; i < threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker_main,
+                           &pool->workers[i]) != 0) {
+            LOG_ERROR("Could not create thread pool worker %d", i);
+            pool->count = i;
+            thread_pool_free(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+int thread_pool_size(struct thread_pool *pool) { return pool->count; }
+
+void thread_pool_run(struct thread_pool *pool, thread_pool_task task,
+                     void *args) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->args = args;
+    pool->pending = pool->count - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    task(args, 0, pool->count);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void thread_pool_barrier(struct thread_pool *pool) {
+    if (pool->count > 1) {
+        pthread_barrier_wait(&pool->barrier);
+    }
+}
+
+void thread_pool_free(struct thread_pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 1; i < pool->count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_barrier_destroy(&pool->barrier);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,86 @@
+#include "timing.h"
+#include "argparse.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static long timing_clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// CPU time is process wide, so for multi-threaded stages it is the sum over
+// all threads and may exceed the wall time.
+void timing_now(struct timing_point *point) {
+    point->wall_ns = timing_clock_ns(CLOCK_MONOTONIC);
+    point->cpu_ns = timing_clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+long timing_peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+
+    return usage.ru_maxrss;
+}
+
+// Records the stage from start until now, and moves start to now so that
+// consecutive stages can share one timing point.
+void timings_add(struct timings *t, const char *name,
+                 struct timing_point *start) {
+    struct timing_point now;
+    timing_now(&now);
+
+    struct timing_stage stage = {
+        .wall_ns = now.wall_ns - start->wall_ns,
+        .cpu_ns = now.cpu_ns - start->cpu_ns,
+    };
+    snprintf(stage.name, sizeof(stage.name), "%s", name);
+    da_append(t, stage);
+
+    *start = now;
+}
+
+void timings_print(struct timings *t, FILE *file) {
+    long wall_ns = 0, cpu_ns = 0;
+
+    fprintf(file, "%-16s %12s %12s\n", "stage", "wall_ms", "cpu_ms");
+    for (size_t i = 0; i < t->count; i++) {
+        struct timing_stage *stage = &t->items[i];
+        fprintf(file, "%-16s %12.3f %12.3f\n", stage->name,
+                stage->wall_ns / 1e6, stage->cpu_ns / 1e6);
+        wall_ns += stage->wall_ns;
+        cpu_ns += stage->cpu_ns;
+    }
+    fprintf(file, "%-16s %12.3f %12.3f\n", "total", wall_ns / 1e6,
+            cpu_ns / 1e6);
+    fprintf(file, "peak rss: %ld KiB\n", timing_peak_rss_kb());
+}
+
+void timings_print_json(struct timings *t, FILE *file) {
+    long wall_ns = 0, cpu_ns = 0;
+
+    fprintf(file, "{\"stages\":[");
+    for (size_t i = 0; i < t->count; i++) {
+        struct timing_stage *stage = &t->items[i];
+        fprintf(file, "%s{\"name\":\"%s\",\"wall_ms\":%.3f,\"cpu_ms\":%.3f}",
+                i > 0 ? "," : "", stage->name, stage->wall_ns / 1e6,
+                stage->cpu_ns / 1e6);
+        wall_ns += stage->wall_ns;
+        cpu_ns += stage->cpu_ns;
+    }
+    fprintf(file,
+            "],\"total\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f},"
+            "\"peak_rss_kb\":%ld}\n",
+            wall_ns / 1e6, cpu_ns / 1e6, timing_peak_rss_kb());
+}
+
+void timings_free(struct timings *t) {
+    free(t->items);
+    t->items = NULL;
+    t->count = 0;
+    t->capacity = 0;
+}
@@ -0,0 +1,154 @@
+#include "trace.h"
+#include "util.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct trace_record {
+        const char *name;
+        long start_ns;
+        long duration_ns;
+};
+
+struct trace_ring {
+        char name[TRACE_THREAD_NAME_MAX];
+        int tid;
+        size_t head;
+        struct trace_record records[TRACE_RING_SIZE];
+};
+
+static atomic_int trace_is_enabled = 0;
+static long trace_origin_ns = 0;
+static struct trace_ring *trace_rings[TRACE_MAX_THREADS];
+static atomic_int trace_ring_count = 0;
+static _Thread_local struct trace_ring *trace_ring = NULL;
+
+static long trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void trace_enable(void) {
+    trace_origin_ns = trace_now_ns();
+    atomic_store(&trace_is_enabled, 1);
+}
+
+int trace_enabled(void) {
+    return atomic_load_explicit(&trace_is_enabled, memory_order_relaxed);
+}
+
+// Allocated once per thread on its first event, never on later ones.
+static struct trace_ring *trace_ring_get(void) {
+    if (trace_ring != NULL) {
+        return trace_ring;
+    }
+
+    int tid = atomic_fetch_add(&trace_ring_count, 1);
+    if (tid >= TRACE_MAX_THREADS) {
+        return NULL;
+    }
+
+    struct trace_ring *ring = calloc(1, sizeof(struct trace_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->tid = tid;
+    snprintf(ring->name, sizeof(ring->name), "thread %d", tid);
+    trace_rings[tid] = ring;
+    trace_ring = ring;
+
+    return ring;
+}
+
+void trace_set_thread_name(const char *format, int index) {
+    if (!trace_enabled()) {
+        return;
+    }
+
+    struct trace_ring *ring = trace_ring_get();
+    if (ring != NULL) {
+        snprintf(ring->name, sizeof(ring->name), format, index);
+    }
+}
+
+long trace_start(void) { return trace_enabled() ? trace_now_ns() : 0; }
+
+void trace_event(const char *name, long start_ns) {
+    if (!trace_enabled()) {
+        return;
+    }
+
+    struct trace_ring *ring = trace_ring_get();
+    if (ring == NULL) {
+        return;
+    }
+
+    struct trace_record *record =
+        &ring->records[ring->head % TRACE_RING_SIZE];
+    record->name = name;
+    record->start_ns = start_ns;
+    record->duration_ns = trace_now_ns() - start_ns;
+    ring->head++;
+}
+
+// Must only be called once the recording threads are done, since the rings
+// are read without synchronization.
+int trace_write(const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        LOG_ERROR("Could not open file: %s", filename);
+        return 1;
+    }
+
+    int count = atomic_load(&trace_ring_count);
+    if (count > TRACE_MAX_THREADS) {
+        count = TRACE_MAX_THREADS;
+    }
+
+    const char *separator = "";
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (int i = 0; i < count; i++) {
+        struct trace_ring *ring = trace_rings[i];
+        if (ring == NULL) {
+            continue;
+        }
+
+        fprintf(file,
+                "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                separator, ring->tid, ring->name);
+        separator = ",";
+
+        size_t first =
+            ring->head > TRACE_RING_SIZE ? ring->head - TRACE_RING_SIZE : 0;
+        for (size_t j = first; j < ring->head; j++) {
+            struct trace_record *record = &ring->records[j % TRACE_RING_SIZE];
+            fprintf(file,
+                    ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}",
+                    record->name, ring->tid,
+                    (record->start_ns - trace_origin_ns) / 1e3,
+                    record->duration_ns / 1e3);
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    fclose(file);
+
+    return 0;
+}
+
+void trace_free(void) {
+    int count = atomic_load(&trace_ring_count);
+    if (count > TRACE_MAX_THREADS) {
+        count = TRACE_MAX_THREADS;
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(trace_rings[i]);
+        trace_rings[i] = NULL;
+    }
+}
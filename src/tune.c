@@ -0,0 +1,333 @@
+#include "tune.h"
+#include "argparse.h"
+#include "backend.h"
+#include "filter.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Workloads measured by tune_run. Every shape gets the configuration with
+// the lowest median over TUNE_ITERATIONS runs.
+static const int tune_sizes[] = {256, 1024, 2048};
+static const int tune_repeats[] = {1, 4};
+static const char *tune_filters[] = {BLUR_KERNEL_NAME};
+
+static int tune_log_class(double value, double base) {
+    int result = 0;
+    while (value >= base) {
+        value /= base;
+        result++;
+    }
+    return result;
+}
+
+static int tune_size_class(int width, int height) {
+    return tune_log_class((double)width * height, 4.0);
+}
+
+static int tune_repeats_class(int repeats) {
+    return tune_log_class(repeats, 2.0);
+}
+
+void tune_cpu_model(char *cpu, size_t size) {
+    snprintf(cpu, size, "unknown");
+
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "model name", 10) != 0) {
+            continue;
+        }
+
+        char *value = strchr(line, ':');
+        if (value == NULL) {
+            continue;
+        }
+        value++;
+        while (*value == ' ') {
+            value++;
+        }
+        value[strcspn(value, "\t\n")] = '\0';
+        snprintf(cpu, size, "%s", value);
+        break;
+    }
+
+    fclose(file);
+}
+
+// $IMAGEFILTER_TUNE_PROFILE, or ~/.imagefilter_tune.
+int tune_profile_path(char *path, size_t size) {
+    const char *env = getenv(TUNE_PROFILE_ENV);
+    if (env != NULL && env[0] != '\0') {
+        snprintf(path, size, "%s", env);
+        return 0;
+    }
+
+    const char *home = getenv("HOME");
+    if (home == NULL) {
+        return 1;
+    }
+
+    snprintf(path, size, "%s/%s", home, TUNE_PROFILE_NAME);
+    return 0;
+}
+
+// One tab separated entry per line:
+// cpu, size class, kernel size, repeats class, backend, threads, median ms.
+// A missing file is an empty profile.
+int tune_profile_load(struct tune_profile *p, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        struct tune_entry entry = {0};
+        char *fields[7];
+        int count = 0;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+
+        for (char *field = strtok(line, "\t"); field != NULL && count < 7;
+             field = strtok(NULL, "\t")) {
+            fields[count++] = field;
+        }
+        if (count != 7) {
+            continue;
+        }
+
+        snprintf(entry.cpu, sizeof(entry.cpu), "%s", fields[0]);
+        entry.size_class = atoi(fields[1]);
+        entry.kernel_size = atoi(fields[2]);
+        entry.repeats_class = atoi(fields[3]);
+        snprintf(entry.backend, sizeof(entry.backend), "%s", fields[4]);
+        entry.threads = atoi(fields[5]);
+        entry.median_ms = atof(fields[6]);
+
+        if (entry.threads > 0) {
+            da_append(p, entry);
+        }
+    }
+
+    fclose(file);
+
+    return 0;
+}
+
+int tune_profile_save(struct tune_profile *p, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        LOG_ERROR("Could not open file: %s", path);
+        return 1;
+    }
+
+    fprintf(file, "# cpu\tsize_class\tkernel_size\trepeats_class\tbackend\t"
+                  "threads\tmedian_ms\n");
+    for (size_t i = 0; i < p->count; i++) {
+        struct tune_entry *e = &p->items[i];
+        fprintf(file, "%s\t%d\t%d\t%d\t%s\t%d\t%.3f\n", e->cpu, e->size_class,
+                e->kernel_size, e->repeats_class, e->backend, e->threads,
+                e->median_ms);
+    }
+
+    fclose(file);
+
+    return 0;
+}
+
+// Exact matches win, otherwise the entry of the same CPU and kernel size
+// with the closest size and repeats classes is used.
+const struct tune_entry *tune_profile_lookup(struct tune_profile *p,
+                                             const char *cpu, int width,
+                                             int height, int kernel_size,
+                                             int repeats) {
+    int size_class = tune_size_class(width, height);
+    int repeats_class = tune_repeats_class(repeats);
+    const struct tune_entry *best = NULL;
+    int best_distance = 0;
+
+    for (size_t i = 0; i < p->count; i++) {
+        const struct tune_entry *e = &p->items[i];
+        if (strcmp(e->cpu, cpu) != 0 || e->kernel_size != kernel_size ||
+            backend_select(e->backend) == NULL) {
+            continue;
+        }
+
+        int distance = 2 * abs(e->size_class - size_class) +
+                       abs(e->repeats_class - repeats_class);
+        if (best == NULL || distance < best_distance) {
+            best = e;
+            best_distance = distance;
+        }
+    }
+
+    return best;
+}
+
+static void tune_profile_set(struct tune_profile *p,
+                             const struct tune_entry *entry) {
+    for (size_t i = 0; i < p->count; i++) {
+        struct tune_entry *e = &p->items[i];
+        if (strcmp(e->cpu, entry->cpu) == 0 &&
+            e->size_class == entry->size_class &&
+            e->kernel_size == entry->kernel_size &&
+            e->repeats_class == entry->repeats_class) {
+            *e = *entry;
+            return;
+        }
+    }
+
+    da_append(p, *entry);
+}
+
+static long tune_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int tune_compare(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// Median time of one configuration, or -1 if it failed.
+static long tune_measure(const char *backend, int threads, struct image *img,
+                         struct kernel *k, int repeats) {
+    struct filter_context ctx;
+    struct image out = {0};
+    long samples[TUNE_ITERATIONS];
+    long result = -1;
+
+    if (filter_context_init(&ctx, threads, backend) != 0) {
+        goto defer;
+    }
+
+    // One untimed run to fault in the buffers.
+    if (filter_context_apply(&ctx, img, k, &out, repeats) != 0) {
+        goto defer;
+    }
+
+    for (int i = 0; i < TUNE_ITERATIONS; i++) {
+        long start = tune_now_ns();
+        if (filter_context_apply(&ctx, img, k, &out, repeats) != 0) {
+            goto defer;
+        }
+        samples[i] = tune_now_ns() - start;
+    }
+
+    qsort(samples, TUNE_ITERATIONS, sizeof(long), tune_compare);
+    result = samples[TUNE_ITERATIONS / 2];
+
+defer:
+    image_destroy(&out);
+    filter_context_destroy(&ctx);
+
+    return result;
+}
+
+// Powers of two, with max_threads itself as the last candidate.
+static int tune_next_threads(int threads, int max_threads) {
+    int next = threads * 2;
+    if (next > max_threads && threads < max_threads) {
+        return max_threads;
+    }
+    return next;
+}
+
+// Candidates are every available backend with thread counts 1, 2, 4, ... up
+// to max_threads. scalar and cuda do not use the pool and only run with one
+// thread.
+int tune_run(struct tune_profile *p, int max_threads) {
+    char cpu[TUNE_CPU_MAX];
+    tune_cpu_model(cpu, sizeof(cpu));
+    LOG_INFO("tuning for %s, up to %d threads", cpu, max_threads);
+
+    for (size_t s = 0; s < sizeof(tune_sizes) / sizeof(tune_sizes[0]); s++) {
+        struct image img = {0};
+        int size = tune_sizes[s];
+        if (image_init(&img, size, size, NUM_CHANNELS) != 0) {
+            return 1;
+        }
+        image_fill_random(&img, 42);
+
+        for (size_t f = 0; f < sizeof(tune_filters) / sizeof(tune_filters[0]);
+             f++) {
+            struct kernel k;
+            if (kernel_from(&k, tune_filters[f]) != 0) {
+                image_destroy(&img);
+                return 1;
+            }
+
+            for (size_t r = 0; r < sizeof(tune_repeats) / sizeof(int); r++) {
+                int repeats = tune_repeats[r];
+                struct tune_entry best = {0};
+
+                for (size_t b = 0; b < backend_count(); b++) {
+                    const struct backend *backend = backend_at(b);
+                    if (!backend->available()) {
+                        continue;
+                    }
+
+                    int pooled = strcmp(backend->name, "scalar") != 0 &&
+                                 strcmp(backend->name, "cuda") != 0;
+                    for (int threads = 1; threads <= max_threads;
+                         threads = tune_next_threads(threads, max_threads)) {
+                        if (!pooled && threads > 1) {
+                            break;
+                        }
+
+                        long median = tune_measure(backend->name, threads,
+                                                   &img, &k, repeats);
+                        if (median < 0) {
+                            continue;
+                        }
+
+                        double median_ms = median / 1e6;
+                        if (best.threads == 0 || median_ms < best.median_ms) {
+                            snprintf(best.backend, sizeof(best.backend), "%s",
+                                     backend->name);
+                            best.threads = threads;
+                            best.median_ms = median_ms;
+                        }
+                    }
+                }
+
+                if (best.threads == 0) {
+                    continue;
+                }
+
+                snprintf(best.cpu, sizeof(best.cpu), "%s", cpu);
+                best.size_class = tune_size_class(size, size);
+                best.kernel_size = k.size;
+                best.repeats_class = tune_repeats_class(repeats);
+                tune_profile_set(p, &best);
+
+                LOG_INFO("%dx%d %s x%d: %s with %d threads, %.3f ms", size,
+                         size, tune_filters[f], repeats, best.backend,
+                         best.threads, best.median_ms);
+            }
+        }
+
+        image_destroy(&img);
+    }
+
+    return 0;
+}
+
+void tune_profile_free(struct tune_profile *p) {
+    free(p->items);
+    p->items = NULL;
+    p->count = 0;
+    p->capacity = 0;
+}
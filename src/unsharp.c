@@ -0,0 +1,230 @@
+#include "unsharp.h"
+#include "convolve.h"
+#include "trace.h"
+#include "util.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define UNSHARP_LANES 8
+// Largest blur radius, three sigma of the largest sigma.
+#define UNSHARP_MAX_RADIUS 60
+
+typedef uint8_t unsharp_u8 __attribute__((vector_size(UNSHARP_LANES)));
+typedef int32_t unsharp_i32 __attribute__((vector_size(UNSHARP_LANES * 4)));
+typedef float unsharp_f32 __attribute__((vector_size(UNSHARP_LANES * 4)));
+
+// rows holds, per thread, the ring of horizontally blurred rows followed by
+// the current source row and its blur, row_size floats each.
+struct unsharp_args {
+        struct image *img;
+        int radius;
+        const float *weights;
+        float amount;
+        float threshold;
+        float *rows;
+        struct image *out;
+};
+
+// dst += w * src over n floats.
+__attribute__((target_clones("avx2", "default"))) static void
+unsharp_axpy(float *restrict dst, const float *restrict src, float w,
+             size_t n) {
+    size_t i = 0;
+    for (; i + UNSHARP_LANES <= n; i += UNSHARP_LANES) {
+        unsharp_f32 d, s;
+        memcpy(&d, dst + i, sizeof(d));
+        memcpy(&s, src + i, sizeof(s));
+        d += w * s;
+        memcpy(dst + i, &d, sizeof(d));
+    }
+    for (; i < n; i++) {
+        dst[i] += w * src[i];
+    }
+}
+
+// Converts n bytes of src to floats in dst.
+__attribute__((target_clones("avx2", "default"))) static void
+unsharp_load(float *restrict dst, const unsigned char *restrict src,
+             size_t n) {
+    size_t i = 0;
+    for (; i + UNSHARP_LANES <= n; i += UNSHARP_LANES) {
+        unsharp_u8 bytes;
+        memcpy(&bytes, src + i, sizeof(bytes));
+        unsharp_f32 v = __builtin_convertvector(bytes, unsharp_f32);
+        memcpy(dst + i, &v, sizeof(v));
+    }
+    for (; i < n; i++) {
+        dst[i] = src[i];
+    }
+}
+
+// Blurs image row y along x into dst, by way of its float values in line.
+// Taps that fall outside the row take its first or last pixel instead.
+static void unsharp_row(const struct unsharp_args *a, int y, float *line,
+                        float *dst) {
+    int width = a->img->width;
+    int channels = a->img->channels;
+    size_t row_size = (size_t)width * channels;
+    int r = a->radius;
+    unsharp_load(line, a->img->bytes + y * row_size, row_size);
+
+    // Inside, every tap is a shifted run of the whole row.
+    memset(dst, 0, row_size * sizeof(float));
+    if (width > 2 * r) {
+        size_t from = (size_t)r * channels;
+        size_t n = row_size - 2 * from;
+        for (int k = 0; k <= 2 * r; k++) {
+            unsharp_axpy(dst + from, line + (size_t)k * channels,
+                         a->weights[k], n);
+        }
+    }
+
+    for (int x = 0; x < width; x++) {
+        if (x == r && width > 2 * r) {
+            x = width - r;
+        }
+        for (int c = 0; c < channels; c++) {
+            float sum = 0.0f;
+            for (int k = -r; k <= r; k++) {
+                int sx = x + k < 0 ? 0 : x + k >= width ? width - 1 : x + k;
+                sum += a->weights[k + r] * line[sx * channels + c];
+            }
+            dst[x * channels + c] = sum;
+        }
+    }
+}
+
+static unsigned char unsharp_value(const struct unsharp_args *a, float value,
+                                   float blur) {
+    float diff = value - blur;
+    if (fabsf(diff) >= a->threshold) {
+        value += a->amount * diff;
+    }
+
+    value += CONVOLVE_ROUNDING_BIAS;
+    if (value < 0.0f) {
+        value = 0.0f;
+    } else if (value > 255.0f) {
+        value = 255.0f;
+    }
+
+    return (unsigned char)value;
+}
+
+// Mixes the blurred row into the source row and writes it out. Lanes below
+// the threshold take a zero factor instead of a branch.
+__attribute__((target_clones("avx2", "default"))) static void
+unsharp_mix(const struct unsharp_args *a, const float *restrict line,
+            const float *restrict blur, unsigned char *dst, size_t n) {
+    size_t i = 0;
+    for (; i + UNSHARP_LANES <= n; i += UNSHARP_LANES) {
+        unsharp_f32 v, b;
+        memcpy(&v, line + i, sizeof(v));
+        memcpy(&b, blur + i, sizeof(b));
+        unsharp_f32 diff = v - b;
+        unsharp_i32 sharpen =
+            (diff >= a->threshold) | (diff <= -a->threshold);
+        v += a->amount * diff *
+             __builtin_convertvector(-sharpen, unsharp_f32);
+
+        unsharp_i32 q =
+            __builtin_convertvector(v + CONVOLVE_ROUNDING_BIAS, unsharp_i32);
+        q &= ~(q < 0);
+        unsharp_i32 top = q > 255;
+        q = (q & ~top) | (255 & top);
+        unsharp_u8 bytes = __builtin_convertvector(q, unsharp_u8);
+        memcpy(dst + i, &bytes, sizeof(bytes));
+    }
+    for (; i < n; i++) {
+        dst[i] = unsharp_value(a, line[i], blur[i]);
+    }
+}
+
+// Every thread fills its ring with the rows around its first row, then for
+// every row blurs in the row radius below it, in place of the one that left
+// the window, and sums the ring down.
+static void unsharp_thread(void *args, int index, int count) {
+    struct unsharp_args *a = (struct unsharp_args *)args;
+    int height = a->img->height;
+    size_t row_size = (size_t)a->img->width * a->img->channels;
+    int r = a->radius;
+    int size = 2 * r + 1;
+    float *ring = a->rows + (size_t)index * (size + 2) * row_size;
+    float *line = ring + size * row_size;
+    float *blur = line + row_size;
+
+    int start_y = height / count * index;
+    int end_y = index == count - 1 ? height : height / count * (index + 1);
+    if (start_y == end_y) {
+        return;
+    }
+
+    // Row j of the image, clamped to it, sits in slot (j - start_y + r) of
+    // the ring, modulo its size.
+    long start = trace_start();
+    for (int j = start_y - r; j < start_y + r; j++) {
+        int sy = j < 0 ? 0 : j >= height ? height - 1 : j;
+        unsharp_row(a, sy, line, ring + (j - start_y + r) % size * row_size);
+    }
+
+    for (int y = start_y; y < end_y; y++) {
+        int j = y + r;
+        int sy = j >= height ? height - 1 : j;
+        unsharp_row(a, sy, line, ring + (j - start_y + r) % size * row_size);
+
+        memset(blur, 0, row_size * sizeof(float));
+        for (int k = 0; k < size; k++) {
+            unsharp_axpy(blur, ring + (y - start_y + k) % size * row_size,
+                         a->weights[k], row_size);
+        }
+
+        unsharp_load(line, a->img->bytes + y * row_size, row_size);
+        unsharp_mix(a, line, blur, a->out->bytes + y * row_size, row_size);
+    }
+    trace_event("unsharp", start);
+}
+
+int unsharp_mask(struct filter_context *ctx, struct image *img, float sigma,
+                 float amount, int threshold, struct image *out) {
+    if (!(sigma >= UNSHARP_MIN_SIGMA && sigma <= UNSHARP_MAX_SIGMA) ||
+        !(amount >= 0.0f && amount <= UNSHARP_MAX_AMOUNT) || threshold < 0 ||
+        threshold > 255) {
+        LOG_ERROR("Unsharp mask arguments out of range: %g, %g, %d", sigma,
+                  amount, threshold);
+        return 1;
+    }
+
+    int radius = (int)ceilf(3.0f * sigma);
+    float weights[2 * UNSHARP_MAX_RADIUS + 1];
+    float sum = 0.0f;
+    for (int k = -radius; k <= radius; k++) {
+        weights[k + radius] = expf(-(float)(k * k) / (2.0f * sigma * sigma));
+        sum += weights[k + radius];
+    }
+    for (int k = 0; k <= 2 * radius; k++) {
+        weights[k] /= sum;
+    }
+
+    int threads = thread_pool_size(ctx->pool);
+    size_t row_size = (size_t)img->width * img->channels;
+    float *rows = filter_context_scratch(
+        ctx, (size_t)threads * (2 * radius + 3) * row_size * sizeof(float));
+    if (rows == NULL) {
+        return 1;
+    }
+
+    struct unsharp_args args = {
+        .img = img,
+        .radius = radius,
+        .weights = weights,
+        .amount = amount,
+        .threshold = (float)threshold,
+        .rows = rows,
+        .out = out,
+    };
+
+    thread_pool_run(ctx->pool, unsharp_thread, &args);
+
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#define ARGPARSE_IMPLEMENTATION
+#include "argparse.h"
+#include "backend.h"
+#include "filter.h"
+#include "image.h"
+#include "kernel.h"
+#include "perf.h"
+#include "util.h"
+
+#define BENCH_DEFAULT_SIZES "256x256,1024x1024,4096x4096"
+#define BENCH_DEFAULT_FILTERS                                                  \
+    BLUR_KERNEL_NAME "," SHARPEN_KERNEL_NAME "," EDGE_KERNEL_NAME              \
+                     "," EMBOSS_KERNEL_NAME
+#define BENCH_DEFAULT_REPEATS "1"
+#define BENCH_DEFAULT_ITERATIONS 20
+#define BENCH_DEFAULT_WARMUP 3
+#define BENCH_DEFAULT_SEED 42
+
+struct bench_list {
+        char **items;
+        size_t count;
+        size_t capacity;
+};
+
+static long bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int bench_split(struct bench_list *list, char *value) {
+    for (char *item = strtok(value, ","); item != NULL;
+         item = strtok(NULL, ",")) {
+        da_append(list, item);
+    }
+
+    return list->count > 0 ? 0 : 1;
+}
+
+static int bench_compare(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static long bench_percentile(long *sorted, int count, double p) {
+    int index = (int)(p * count + 0.5) - 1;
+    if (index < 0) {
+        index = 0;
+    }
+    if (index >= count) {
+        index = count - 1;
+    }
+    return sorted[index];
+}
+
+// Counters, when given, only cover the timed iterations.
+static int bench_run(struct filter_context *ctx, struct image *img,
+                     struct kernel *k, int repeats, int warmup,
+                     int iterations, long *samples,
+                     struct perf_session *perf) {
+    struct image out = {0};
+    int result = 0;
+
+    if (perf != NULL) {
+        perf_session_reset(perf);
+    }
+
+    for (int i = 0; i < warmup + iterations; i++) {
+        if (perf != NULL && i >= warmup) {
+            perf_session_start(perf);
+        }
+
+        long start = bench_now_ns();
+        if (filter_context_apply(ctx, img, k, &out, repeats) != 0) {
+            return_defer(1);
+        }
+        long elapsed = bench_now_ns() - start;
+
+        if (perf != NULL && i >= warmup) {
+            perf_session_stop(perf);
+        }
+
+        if (i >= warmup) {
+            samples[i - warmup] = elapsed;
+        }
+    }
+
+defer:
+    image_destroy(&out);
+
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    int result = 0;
+    struct bench_list sizes = {0}, filters = {0}, repeats = {0},
+                      backends = {0};
+    long *samples = NULL;
+
+    struct argparse_parser *parser = argparse_new(
+        "bench", "benchmark the filter backends on synthetic images", "0.0.1");
+    argparse_add_argument(parser, 'v', "version", "print version",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, 'h', "help", "print help",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, 's', "sizes",
+                          "comma separated WxH image sizes (default "
+                          BENCH_DEFAULT_SIZES ")",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'f', "filters",
+                          "comma separated filter names (default all)",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'r', "repeats",
+                          "comma separated repeat counts (default 1)",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'b', "backends",
+                          "comma separated backend names (default all "
+                          "available)",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'p', "threads", "number of threads",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'n', "iterations",
+                          "timed iterations per combination (default 20)",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'w', "warmup",
+                          "untimed iterations per combination (default 3)",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "seed",
+                          "seed of the synthetic images (default 42)",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "perf-counters",
+                          "add ipc, llc misses and bytes per pixel from "
+                          "hardware performance counters",
+                          ARGUMENT_TYPE_FLAG);
+
+    argparse_parse(parser, argc, argv);
+
+    if (argparse_get_flag(parser, "help")) {
+        argparse_print_help(parser);
+        return_defer(0);
+    }
+
+    if (argparse_get_flag(parser, "version")) {
+        argparse_print_version(parser);
+        return_defer(0);
+    }
+
+    char default_sizes[] = BENCH_DEFAULT_SIZES;
+    char default_filters[] = BENCH_DEFAULT_FILTERS;
+    char default_repeats[] = BENCH_DEFAULT_REPEATS;
+    char *sizes_str = argparse_get_value(parser, "sizes");
+    char *filters_str = argparse_get_value(parser, "filters");
+    char *repeats_str = argparse_get_value(parser, "repeats");
+    char *backends_str = argparse_get_value(parser, "backends");
+
+    if (bench_split(&sizes, sizes_str ? sizes_str : default_sizes) != 0 ||
+        bench_split(&filters, filters_str ? filters_str : default_filters) !=
+            0 ||
+        bench_split(&repeats, repeats_str ? repeats_str : default_repeats) !=
+            0) {
+        LOG_ERROR("sizes, filters and repeats must not be empty");
+        return_defer(1);
+    }
+
+    if (backends_str != NULL) {
+        bench_split(&backends, backends_str);
+    } else {
+        for (size_t i = 0; i < backend_count(); i++) {
+            if (backend_at(i)->available()) {
+                da_append(&backends, (char *)backend_at(i)->name);
+            }
+        }
+    }
+
+    int threads = 1;
+    char *threads_str = argparse_get_value(parser, "threads");
+    if (threads_str) {
+        threads = atoi(threads_str);
+        if (threads <= 0) {
+            LOG_ERROR("threads must be a positive number");
+            return_defer(1);
+        }
+    }
+
+    int iterations = BENCH_DEFAULT_ITERATIONS;
+    char *iterations_str = argparse_get_value(parser, "iterations");
+    if (iterations_str) {
+        iterations = atoi(iterations_str);
+        if (iterations <= 0) {
+            LOG_ERROR("iterations must be a positive number");
+            return_defer(1);
+        }
+    }
+
+    int warmup = BENCH_DEFAULT_WARMUP;
+    char *warmup_str = argparse_get_value(parser, "warmup");
+    if (warmup_str) {
+        warmup = atoi(warmup_str);
+        if (warmup < 0) {
+            LOG_ERROR("warmup must not be negative");
+            return_defer(1);
+        }
+    }
+
+    uint64_t seed = BENCH_DEFAULT_SEED;
+    char *seed_str = argparse_get_value(parser, "seed");
+    if (seed_str) {
+        seed = strtoull(seed_str, NULL, 10);
+    }
+
+    unsigned int use_perf = argparse_get_flag(parser, "perf-counters");
+
+    samples = calloc(iterations, sizeof(long));
+    if (samples == NULL) {
+        LOG_ERROR("failed to allocate memory");
+        return_defer(1);
+    }
+
+    printf("%-10s %-11s %-8s %7s %11s %11s %9s %8s", "backend", "size",
+           "filter", "repeats", "median_ms", "p95_ms", "mpix_s", "gb_s");
+    if (use_perf) {
+        printf(" %6s %11s %9s", "ipc", "llc_miss_px", "bytes_px");
+    }
+    printf("\n");
+
+    for (size_t b = 0; b < backends.count; b++) {
+        struct filter_context ctx;
+        struct perf_session perf = {0};
+        if (filter_context_init(&ctx, threads, backends.items[b]) != 0 ||
+            (use_perf && perf_session_open(&perf, ctx.pool) != 0)) {
+            perf_session_close(&perf);
+            filter_context_destroy(&ctx);
+            result = 1;
+            continue;
+        }
+
+        for (size_t s = 0; s < sizes.count; s++) {
+            int width, height;
+            if (sscanf(sizes.items[s], "%dx%d", &width, &height) != 2 ||
+                width <= 0 || height <= 0) {
+                LOG_ERROR("invalid size: %s", sizes.items[s]);
+                result = 1;
+                continue;
+            }
+
+            struct image img = {0};
+            if (image_init(&img, width, height, NUM_CHANNELS) != 0) {
+                result = 1;
+                continue;
+            }
+            image_fill_random(&img, seed);
+
+            for (size_t f = 0; f < filters.count; f++) {
+                struct kernel k;
+                if (kernel_from(&k, filters.items[f]) != 0) {
+                    result = 1;
+                    continue;
+                }
+
+                for (size_t r = 0; r < repeats.count; r++) {
+                    int count = atoi(repeats.items[r]);
+                    if (count <= 0) {
+                        LOG_ERROR("invalid repeats: %s", repeats.items[r]);
+                        result = 1;
+                        continue;
+                    }
+
+                    if (bench_run(&ctx, &img, &k, count, warmup, iterations,
+                                  samples, use_perf ? &perf : NULL) != 0) {
+                        result = 1;
+                        continue;
+                    }
+
+                    qsort(samples, iterations, sizeof(long), bench_compare);
+                    long median = bench_percentile(samples, iterations, 0.50);
+                    long p95 = bench_percentile(samples, iterations, 0.95);
+
+                    // Every repeat reads and writes the whole image once.
+                    double pixels = (double)width * height * count;
+                    double bytes = 2.0 * pixels * NUM_CHANNELS;
+
+                    printf("%-10s %-11s %-8s %7d %11.3f %11.3f %9.1f %8.2f",
+                           ctx.backend->name, sizes.items[s], filters.items[f],
+                           count, median / 1e6, p95 / 1e6,
+                           pixels / (median / 1e9) / 1e6,
+                           bytes / (median / 1e9) / 1e9);
+
+                    if (use_perf) {
+                        uint64_t values[PERF_COUNTER_COUNT];
+                        perf_session_total(&perf, values);
+
+                        double cycles = values[PERF_COUNTER_CYCLES];
+                        double misses = values[PERF_COUNTER_LLC_MISSES];
+                        double counted = pixels * iterations;
+                        printf(" %6.2f %11.4f %9.2f",
+                               cycles > 0
+                                   ? values[PERF_COUNTER_INSTRUCTIONS] / cycles
+                                   : 0.0,
+                               misses / counted,
+                               misses * PERF_CACHE_LINE_SIZE / counted);
+                    }
+                    printf("\n");
+                    fflush(stdout);
+                }
+            }
+
+            image_destroy(&img);
+        }
+
+        perf_session_close(&perf);
+        filter_context_destroy(&ctx);
+    }
+
+defer:
+    free(samples);
+    free(sizes.items);
+    free(filters.items);
+    free(repeats.items);
+    free(backends.items);
+    if (parser)
+        argparse_free(parser);
+    return result;
+}
@@ -0,0 +1,140 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define ARGPARSE_IMPLEMENTATION
+#include "argparse.h"
+#define PROTOCOL_IMPLEMENTATION
+#include "protocol.h"
+#include "util.h"
+
+static unsigned char *read_file(const char *filename, size_t *size) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    unsigned char *data = length > 0 ? malloc(length) : NULL;
+    if (data != NULL && fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+
+    *size = length;
+    return data;
+}
+
+int main(int argc, char *argv[]) {
+    int result = 0;
+    int fd = -1;
+    unsigned char *data = NULL;
+    size_t size = 0;
+
+    struct argparse_parser *parser = argparse_new(
+        "client", "send one job to an image filter server", "0.0.1");
+    argparse_add_argument(parser, 'v', "version", "print version",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, 'h', "help", "print help",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, 's', "socket", "server socket path",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'i', "input", "input file name",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'o', "output", "output file name",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'f', "filter",
+                          "filter name: blur,edge,sharpen,emboss",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'r', "repeats", "number of repeats",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'd', "inline",
+                          "send the input bytes instead of its file name",
+                          ARGUMENT_TYPE_FLAG);
+
+    argparse_parse(parser, argc, argv);
+
+    if (argparse_get_flag(parser, "help")) {
+        argparse_print_help(parser);
+        return_defer(0);
+    }
+
+    if (argparse_get_flag(parser, "version")) {
+        argparse_print_version(parser);
+        return_defer(0);
+    }
+
+    char *socket_path = argparse_get_value(parser, "socket");
+    char *input = argparse_get_value(parser, "input");
+    char *output = argparse_get_value(parser, "output");
+    char *filter = argparse_get_value(parser, "filter");
+
+    if (socket_path == NULL || input == NULL || output == NULL ||
+        filter == NULL) {
+        LOG_ERROR("socket, input, output and filter are required");
+        return_defer(1);
+    }
+
+    int repeats = 1;
+    char *repeats_str = argparse_get_value(parser, "repeats");
+    if (repeats_str) {
+        repeats = atoi(repeats_str);
+        if (repeats <= 0) {
+            LOG_ERROR("repeats must be a positive number");
+            return_defer(1);
+        }
+    }
+
+    if (argparse_get_flag(parser, "inline")) {
+        data = read_file(input, &size);
+        if (data == NULL) {
+            LOG_ERROR("failed to read input file: %s", input);
+            return_defer(1);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    fd = protocol_connect(socket_path);
+    if (fd < 0) {
+        LOG_ERROR("failed to connect to %s", socket_path);
+        return_defer(1);
+    }
+
+    if (protocol_send_job(fd, filter, repeats, output, input, data, size) !=
+        0) {
+        LOG_ERROR("failed to send job");
+        return_defer(1);
+    }
+
+    struct protocol_reader reader;
+    char reply[PROTOCOL_LINE_MAX];
+    protocol_reader_init(&reader, fd);
+    if (protocol_read_line(&reader, reply, sizeof(reply)) != 0) {
+        LOG_ERROR("no reply from server");
+        return_defer(1);
+    }
+
+    long queue_us, process_us, total_us;
+    if (sscanf(reply, "OK %ld %ld %ld", &queue_us, &process_us, &total_us) ==
+        3) {
+        LOG_INFO("done: queue=%ldus process=%ldus total=%ldus", queue_us,
+                 process_us, total_us);
+    } else {
+        LOG_ERROR("server: %s", reply);
+        result = 1;
+    }
+
+defer:
+    if (fd >= 0)
+        close(fd);
+    free(data);
+    if (parser)
+        argparse_free(parser);
+    return result;
+}
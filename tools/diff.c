@@ -1,14 +1,275 @@
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #define ARGPARSE_IMPLEMENTATION
 #include "argparse.h"
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#include "image.h"
+#include "threadpool.h"
 #include "util.h"
 
 #define TOLERANCE 10
+#define DIFF_TILE_SIZE 32
+#define DIFF_SSIM_BLOCK 8
+#define DIFF_SIMD_WIDTH 16
+#define DIFF_SSIM_C1 ((0.01 * 255) * (0.01 * 255))
+#define DIFF_SSIM_C2 ((0.03 * 255) * (0.03 * 255))
+
+typedef unsigned char diff_u8 __attribute__((vector_size(DIFF_SIMD_WIDTH)));
+typedef int diff_i32 __attribute__((vector_size(DIFF_SIMD_WIDTH * 4)));
+
+// Source of image rows: either a binary PNM file read band by band, or a
+// fully decoded image for every other format.
+struct diff_source {
+        FILE *file;
+        struct image img;
+        int width;
+        int height;
+        int channels;
+        int row;
+};
+
+struct diff_tile {
+        uint64_t count;
+        uint64_t sse;
+        int max;
+        double ssim;
+        int blocks;
+};
+
+struct diff_band {
+        const unsigned char *a;
+        const unsigned char *b;
+        int width;
+        int rows;
+        int channels;
+        int tile;
+        int tolerance;
+        struct diff_tile *tiles;
+};
+
+// Parses a P5/P6 header with a maxval of 255 and leaves the file at the
+// first pixel. Returns 1 for anything else.
+static int diff_pnm_header(FILE *file, int *width, int *height,
+                           int *channels) {
+    int values[3];
+    char magic[3] = {0};
+
+    if (fread(magic, 1, 2, file) != 2 || magic[0] != 'P' ||
+        (magic[1] != '5' && magic[1] != '6')) {
+        return 1;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        int c = fgetc(file);
+        while (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#') {
+            if (c == '#') {
+                while (c != '\n' && c != EOF) {
+                    c = fgetc(file);
+                }
+            }
+            c = fgetc(file);
+        }
+        ungetc(c, file);
+
+        if (fscanf(file, "%d", &values[i]) != 1) {
+            return 1;
+        }
+    }
+
+    // Exactly one whitespace byte separates the header from the pixels.
+    fgetc(file);
+
+    if (values[0] <= 0 || values[1] <= 0 || values[2] != 255) {
+        return 1;
+    }
+
+    *width = values[0];
+    *height = values[1];
+    *channels = magic[1] == '5' ? 1 : 3;
+
+    return 0;
+}
+
+static int diff_source_open(struct diff_source *s, const char *filename) {
+    s->file = fopen(filename, "rb");
+    if (s->file == NULL) {
+        LOG_ERROR("failed to open image: %s", filename);
+        return 1;
+    }
+
+    if (diff_pnm_header(s->file, &s->width, &s->height, &s->channels) == 0) {
+        return 0;
+    }
+
+    fclose(s->file);
+    s->file = NULL;
+
+    // Decoded with the channels of the file, so that grey images stay grey
+    // and alpha differences are counted.
+    if (image_load_channels(&s->img, filename, 0) != 0) {
+        return 1;
+    }
+
+    s->width = s->img.width;
+    s->height = s->img.height;
+    s->channels = s->img.channels;
+
+    return 0;
+}
+
+// Returns rows consecutive rows, either read into buffer or pointing into
+// the decoded image.
+static const unsigned char *diff_source_rows(struct diff_source *s,
+                                             unsigned char *buffer, int rows) {
+    size_t row_size = (size_t)s->width * s->channels;
+    const unsigned char *result;
+
+    if (s->file != NULL) {
+        if (fread(buffer, row_size, rows, s->file) != (size_t)rows) {
+            return NULL;
+        }
+        result = buffer;
+    } else {
+        result = s->img.bytes + s->row * row_size;
+    }
+
+    s->row += rows;
+
+    return result;
+}
+
+static void diff_source_close(struct diff_source *s) {
+    if (s->file != NULL) {
+        fclose(s->file);
+    }
+    image_destroy(&s->img);
+}
+
+// Counts values differing by more than tolerance, and the maximum and the
+// sum of squares of the differences, 16 values at a time.
+__attribute__((target_clones("avx2", "default"))) static void
+diff_row(const unsigned char *a, const unsigned char *b, int n, int tolerance,
+         struct diff_tile *tile) {
+    diff_i32 count = {0}, sse = {0};
+    diff_u8 max = {0};
+    diff_u8 limit;
+    int i = 0;
+
+    memset(&limit, tolerance > 255 ? 255 : tolerance, sizeof(limit));
+
+    for (; i + DIFF_SIMD_WIDTH <= n; i += DIFF_SIMD_WIDTH) {
+        diff_u8 x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+
+        diff_u8 greater = (diff_u8)(x > y);
+        diff_u8 d = ((x - y) & greater) | ((y - x) & ~greater);
+        diff_i32 wide = __builtin_convertvector(d, diff_i32);
+
+        count -= __builtin_convertvector((d > limit), diff_i32);
+        sse += wide * wide;
+        diff_u8 larger = (diff_u8)(d > max);
+        max = (d & larger) | (max & ~larger);
+    }
+
+    for (int j = 0; j < DIFF_SIMD_WIDTH; j++) {
+        tile->count += count[j];
+        tile->sse += sse[j];
+        if (max[j] > tile->max) {
+            tile->max = max[j];
+        }
+    }
+
+    for (; i < n; i++) {
+        int d = abs(a[i] - b[i]);
+        tile->count += d > tolerance;
+        tile->sse += d * d;
+        if (d > tile->max) {
+            tile->max = d;
+        }
+    }
+}
+
+// Mean SSIM over the channels of one block of up to 8x8 pixels.
+static double diff_ssim_block(const unsigned char *a, const unsigned char *b,
+                              int stride, int width, int height,
+                              int channels) {
+    double total = 0.0;
+
+    for (int c = 0; c < channels; c++) {
+        int64_t sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+
+        for (int y = 0; y < height; y++) {
+            const unsigned char *ra = a + (size_t)y * stride + c;
+            const unsigned char *rb = b + (size_t)y * stride + c;
+            for (int x = 0; x < width; x++) {
+                int va = ra[x * channels];
+                int vb = rb[x * channels];
+                sx += va;
+                sy += vb;
+                sxx += va * va;
+                syy += vb * vb;
+                sxy += va * vb;
+            }
+        }
+
+        double n = (double)width * height;
+        double mx = sx / n, my = sy / n;
+        double vx = sxx / n - mx * mx;
+        double vy = syy / n - my * my;
+        double cov = sxy / n - mx * my;
+
+        total += ((2 * mx * my + DIFF_SSIM_C1) * (2 * cov + DIFF_SSIM_C2)) /
+                 ((mx * mx + my * my + DIFF_SSIM_C1) *
+                  (vx + vy + DIFF_SSIM_C2));
+    }
+
+    return total / channels;
+}
+
+static void diff_band_task(void *args, int index, int count) {
+    struct diff_band *band = (struct diff_band *)args;
+    int tiles_x = (band->width + band->tile - 1) / band->tile;
+    int stride = band->width * band->channels;
+
+    for (int t = index; t < tiles_x; t += count) {
+        struct diff_tile *tile = &band->tiles[t];
+        int x0 = t * band->tile;
+        int x1 = x0 + band->tile < band->width ? x0 + band->tile : band->width;
+
+        memset(tile, 0, sizeof(*tile));
+
+        for (int y = 0; y < band->rows; y++) {
+            size_t offset = (size_t)y * stride + x0 * band->channels;
+            diff_row(band->a + offset, band->b + offset,
+                     (x1 - x0) * band->channels, band->tolerance, tile);
+        }
+
+        for (int by = 0; by < band->rows; by += DIFF_SSIM_BLOCK) {
+            for (int bx = x0; bx < x1; bx += DIFF_SSIM_BLOCK) {
+                int w = x1 - bx < DIFF_SSIM_BLOCK ? x1 - bx : DIFF_SSIM_BLOCK;
+                int h = band->rows - by < DIFF_SSIM_BLOCK ? band->rows - by
+                                                          : DIFF_SSIM_BLOCK;
+                size_t offset = (size_t)by * stride + bx * band->channels;
+
+                tile->ssim += diff_ssim_block(band->a + offset,
+                                              band->b + offset, stride, w, h,
+                                              band->channels);
+                tile->blocks++;
+            }
+        }
+    }
+}
 
 int main(int argc, char *argv[]) {
     int result = 0;
+    struct diff_source input_source = {0}, target_source = {0};
+    struct thread_pool *pool = NULL;
+    unsigned char *input_buffer = NULL, *target_buffer = NULL;
+    struct diff_tile *tiles = NULL;
+    FILE *heatmap = NULL;
 
     struct argparse_parser *parser = argparse_new(
         "image filter", "image filter basic implementation", "0.0.1");
@@ -20,6 +281,20 @@ int main(int argc, char *argv[]) {
                           ARGUMENT_TYPE_VALUE);
     argparse_add_argument(parser, 't', "target", "target file name",
                           ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'p', "threads", "number of threads",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "tolerance",
+                          "largest difference of a value still counted as "
+                          "equal (default 10)",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "tile",
+                          "tile size of the heatmap, a multiple of 8 "
+                          "(default 32)",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, '\0', "heatmap",
+                          "write the maximum error of every tile as a PPM "
+                          "image",
+                          ARGUMENT_TYPE_VALUE);
 
     argparse_parse(parser, argc, argv);
 
@@ -37,43 +312,137 @@ int main(int argc, char *argv[]) {
 
     char *input = argparse_get_value(parser, "input");
     char *target = argparse_get_value(parser, "target");
+    char *heatmap_file = argparse_get_value(parser, "heatmap");
 
     if (input == NULL || target == NULL) {
         LOG_ERROR("input and target file names are required");
         return_defer(1);
     }
 
-    int input_width, input_height, input_channels;
-    stbi_uc *input_data = stbi_load(input, &input_width, &input_height,
-                                     &input_channels, 0);
-    if (input_data == NULL) {
-        LOG_ERROR("failed to load input image: %s", input);
-        return_defer(1);
+    int threads = 1;
+    char *threads_str = argparse_get_value(parser, "threads");
+    if (threads_str) {
+        threads = atoi(threads_str);
+        if (threads <= 0) {
+            LOG_ERROR("threads must be a positive number");
+            return_defer(1);
+        }
     }
 
-    int target_width, target_height, target_channels;
-    stbi_uc *target_data = stbi_load(target, &target_width, &target_height,
-                                     &target_channels, 0);
-    if (target_data == NULL) {
-        LOG_ERROR("failed to load target image: %s", target);
+    int tolerance = TOLERANCE;
+    char *tolerance_str = argparse_get_value(parser, "tolerance");
+    if (tolerance_str) {
+        tolerance = atoi(tolerance_str);
+        if (tolerance < 0) {
+            LOG_ERROR("tolerance must not be negative");
+            return_defer(1);
+        }
+    }
+
+    int tile = DIFF_TILE_SIZE;
+    char *tile_str = argparse_get_value(parser, "tile");
+    if (tile_str) {
+        tile = atoi(tile_str);
+        if (tile <= 0 || tile % DIFF_SSIM_BLOCK != 0) {
+            LOG_ERROR("tile must be a positive multiple of %d",
+                      DIFF_SSIM_BLOCK);
+            return_defer(1);
+        }
+    }
+
+    if (diff_source_open(&input_source, input) != 0 ||
+        diff_source_open(&target_source, target) != 0) {
         return_defer(1);
     }
 
-    if (input_width != target_width || input_height != target_height ||
-        input_channels != target_channels) {
+    if (input_source.width != target_source.width ||
+        input_source.height != target_source.height ||
+        input_source.channels != target_source.channels) {
         LOG_ERROR("input and target images must have the same dimensions");
         return_defer(1);
     }
 
-    int diff_count = 0;
-    for (int i = 0; i < input_width * input_height * input_channels; i++) {
-        if (abs(input_data[i] - target_data[i]) > TOLERANCE) {
-            diff_count++;
+    int width = input_source.width;
+    int height = input_source.height;
+    int channels = input_source.channels;
+    int tiles_x = (width + tile - 1) / tile;
+    int tiles_y = (height + tile - 1) / tile;
+    size_t band_size = (size_t)width * channels * tile;
+
+    pool = thread_pool_new(threads);
+    input_buffer = malloc(band_size);
+    target_buffer = malloc(band_size);
+    tiles = calloc(tiles_x, sizeof(struct diff_tile));
+    if (pool == NULL || input_buffer == NULL || target_buffer == NULL ||
+        tiles == NULL) {
+        LOG_ERROR("failed to allocate memory");
+        return_defer(1);
+    }
+
+    if (heatmap_file != NULL) {
+        heatmap = fopen(heatmap_file, "wb");
+        if (heatmap == NULL) {
+            LOG_ERROR("failed to open heatmap file: %s", heatmap_file);
+            return_defer(1);
         }
+        fprintf(heatmap, "P6\n%d %d\n255\n", tiles_x, tiles_y);
+    }
+
+    uint64_t diff_count = 0, sse = 0;
+    int max = 0;
+    double ssim = 0.0;
+    long blocks = 0;
+
+    for (int y = 0; y < height; y += tile) {
+        int rows = height - y < tile ? height - y : tile;
+        struct diff_band band = {
+            .a = diff_source_rows(&input_source, input_buffer, rows),
+            .b = diff_source_rows(&target_source, target_buffer, rows),
+            .width = width,
+            .rows = rows,
+            .channels = channels,
+            .tile = tile,
+            .tolerance = tolerance,
+            .tiles = tiles,
+        };
+
+        if (band.a == NULL || band.b == NULL) {
+            LOG_ERROR("unexpected end of image data");
+            return_defer(1);
+        }
+
+        thread_pool_run(pool, diff_band_task, &band);
+
+        for (int t = 0; t < tiles_x; t++) {
+            diff_count += tiles[t].count;
+            sse += tiles[t].sse;
+            max = tiles[t].max > max ? tiles[t].max : max;
+            ssim += tiles[t].ssim;
+            blocks += tiles[t].blocks;
+
+            if (heatmap != NULL) {
+                unsigned char pixel[3] = {(unsigned char)tiles[t].max, 0, 0};
+                if (tiles[t].count > 0) {
+                    pixel[1] = pixel[2] = (unsigned char)tiles[t].max;
+                }
+                fwrite(pixel, 1, sizeof(pixel), heatmap);
+            }
+        }
+    }
+
+    double mse = (double)sse / ((double)width * height * channels);
+    LOG_INFO("max abs error: %d", max);
+    if (mse > 0.0) {
+        LOG_INFO("mse: %.6f, psnr: %.3f dB", mse,
+                 10.0 * log10(255.0 * 255.0 / mse));
+    } else {
+        LOG_INFO("mse: 0, psnr: inf");
     }
+    LOG_INFO("ssim: %.6f", blocks > 0 ? ssim / blocks : 1.0);
 
     if (diff_count > 0) {
-        LOG_ERROR("images are different: %d pixels differ", diff_count);
+        LOG_ERROR("images are different: %llu pixels differ",
+                  (unsigned long long)diff_count);
         result = 1;
     } else {
         LOG_INFO("images are the same");
@@ -81,8 +450,15 @@ int main(int argc, char *argv[]) {
     }
 
 defer:
-    if(parser) argparse_free(parser);
-    if(input_data) stbi_image_free(input_data);
-    if(target_data) stbi_image_free(target_data);
+    if (heatmap)
+        fclose(heatmap);
+    free(tiles);
+    free(input_buffer);
+    free(target_buffer);
+    thread_pool_free(pool);
+    diff_source_close(&input_source);
+    diff_source_close(&target_source);
+    if (parser)
+        argparse_free(parser);
     return result;
 }
@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#define ARGPARSE_IMPLEMENTATION
+#include "argparse.h"
+#define PROTOCOL_IMPLEMENTATION
+#include "protocol.h"
+#include "util.h"
+
+struct loadgen_worker {
+        pthread_t thread;
+        int index;
+        const char *socket_path;
+        const char *filter;
+        int repeats;
+        const char *input;
+        char output[PROTOCOL_LINE_MAX];
+        const unsigned char *data;
+        size_t size;
+        int requests;
+        long *latencies_us;
+        int completed;
+        int failed;
+};
+
+static long loadgen_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static unsigned char *read_file(const char *filename, size_t *size) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    unsigned char *data = length > 0 ? malloc(length) : NULL;
+    if (data != NULL && fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+
+    *size = length;
+    return data;
+}
+
+// Every worker keeps one connection open and sends its jobs back to back, so
+// the concurrency equals the number of outstanding jobs at the server.
+static void *loadgen_worker_main(void *args) {
+    struct loadgen_worker *w = (struct loadgen_worker *)args;
+    struct protocol_reader reader;
+    char reply[PROTOCOL_LINE_MAX];
+
+    int fd = protocol_connect(w->socket_path);
+    if (fd < 0) {
+        LOG_ERROR("worker %d failed to connect to %s", w->index,
+                  w->socket_path);
+        w->failed = w->requests;
+        return NULL;
+    }
+    protocol_reader_init(&reader, fd);
+
+    for (int i = 0; i < w->requests; i++) {
+        long start_us = loadgen_now_us();
+
+        if (protocol_send_job(fd, w->filter, w->repeats, w->output, w->input,
+                              w->data, w->size) != 0 ||
+            protocol_read_line(&reader, reply, sizeof(reply)) != 0) {
+            w->failed += w->requests - i;
+            break;
+        }
+
+        if (strncmp(reply, "OK ", 3) != 0) {
+            w->failed++;
+            continue;
+        }
+
+        w->latencies_us[w->completed++] = loadgen_now_us() - start_us;
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static int loadgen_compare(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static long loadgen_percentile(long *sorted, int count, double p) {
+    int index = (int)(p * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+int main(int argc, char *argv[]) {
+    int result = 0;
+    unsigned char *data = NULL;
+    size_t size = 0;
+    struct loadgen_worker *workers = NULL;
+    long *latencies = NULL;
+    int concurrency = 4;
+    int requests = 100;
+
+    struct argparse_parser *parser = argparse_new(
+        "loadgen", "load generator for the image filter server", "0.0.1");
+    argparse_add_argument(parser, 'v', "version", "print version",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, 'h', "help", "print help",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, 's', "socket", "server socket path",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'i', "input", "input file name",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'o', "output",
+                          "output file name prefix, one file per connection",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'f', "filter",
+                          "filter name: blur,edge,sharpen,emboss",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'r', "repeats", "number of repeats",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'n', "requests", "total number of jobs",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'c', "concurrency",
+                          "number of concurrent connections",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'd', "inline",
+                          "send the input bytes instead of its file name",
+                          ARGUMENT_TYPE_FLAG);
+
+    argparse_parse(parser, argc, argv);
+
+    if (argparse_get_flag(parser, "help")) {
+        argparse_print_help(parser);
+        return_defer(0);
+    }
+
+    if (argparse_get_flag(parser, "version")) {
+        argparse_print_version(parser);
+        return_defer(0);
+    }
+
+    char *socket_path = argparse_get_value(parser, "socket");
+    char *input = argparse_get_value(parser, "input");
+    char *output = argparse_get_value(parser, "output");
+    char *filter = argparse_get_value(parser, "filter");
+
+    if (socket_path == NULL || input == NULL || output == NULL ||
+        filter == NULL) {
+        LOG_ERROR("socket, input, output and filter are required");
+        return_defer(1);
+    }
+
+    int repeats = 1;
+    char *repeats_str = argparse_get_value(parser, "repeats");
+    if (repeats_str) {
+        repeats = atoi(repeats_str);
+        if (repeats <= 0) {
+            LOG_ERROR("repeats must be a positive number");
+            return_defer(1);
+        }
+    }
+
+    char *requests_str = argparse_get_value(parser, "requests");
+    if (requests_str) {
+        requests = atoi(requests_str);
+        if (requests <= 0) {
+            LOG_ERROR("requests must be a positive number");
+            return_defer(1);
+        }
+    }
+
+    char *concurrency_str = argparse_get_value(parser, "concurrency");
+    if (concurrency_str) {
+        concurrency = atoi(concurrency_str);
+        if (concurrency <= 0) {
+            LOG_ERROR("concurrency must be a positive number");
+            return_defer(1);
+        }
+    }
+    if (concurrency > requests) {
+        concurrency = requests;
+    }
+
+    if (argparse_get_flag(parser, "inline")) {
+        data = read_file(input, &size);
+        if (data == NULL) {
+            LOG_ERROR("failed to read input file: %s", input);
+            return_defer(1);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    workers = calloc(concurrency, sizeof(struct loadgen_worker));
+    latencies = calloc(requests, sizeof(long));
+    if (workers == NULL || latencies == NULL) {
+        LOG_ERROR("failed to allocate memory");
+        return_defer(1);
+    }
+
+    long start_us = loadgen_now_us();
+    int offset = 0;
+    for (int i = 0; i < concurrency; i++) {
+        struct loadgen_worker *w = &workers[i];
+        w->index = i;
+        w->socket_path = socket_path;
+        w->filter = filter;
+        w->repeats = repeats;
+        w->input = input;
+        snprintf(w->output, sizeof(w->output), "%s-%d.pbm", output, i);
+        w->data = data;
+        w->size = size;
+        w->requests = requests / concurrency + (i < requests % concurrency);
+        w->latencies_us = latencies + offset;
+        offset += w->requests;
+
+        pthread_create(&w->thread, NULL, loadgen_worker_main, w);
+    }
+
+    int completed = 0;
+    int failed = 0;
+    for (int i = 0; i < concurrency; i++) {
+        pthread_join(workers[i].thread, NULL);
+        memmove(latencies + completed, workers[i].latencies_us,
+                workers[i].completed * sizeof(long));
+        completed += workers[i].completed;
+        failed += workers[i].failed;
+    }
+    long elapsed_us = loadgen_now_us() - start_us;
+
+    LOG_INFO("%d jobs, %d failed, %d connections, %.3fs", requests, failed,
+             concurrency, elapsed_us / 1e6);
+    if (completed > 0) {
+        qsort(latencies, completed, sizeof(long), loadgen_compare);
+        LOG_INFO("throughput %.1f jobs/s",
+                 completed / (elapsed_us / 1e6));
+        LOG_INFO("latency p50=%ldus p90=%ldus p99=%ldus max=%ldus",
+                 loadgen_percentile(latencies, completed, 0.50),
+                 loadgen_percentile(latencies, completed, 0.90),
+                 loadgen_percentile(latencies, completed, 0.99),
+                 latencies[completed - 1]);
+    }
+
+    if (failed > 0) {
+        result = 1;
+    }
+
+defer:
+    free(workers);
+    free(latencies);
+    free(data);
+    if (parser)
+        argparse_free(parser);
+    return result;
+}
@@ -0,0 +1,1232 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define ARGPARSE_IMPLEMENTATION
+#include "argparse.h"
+#include "backend.h"
+#include "bilateral.h"
+#include "bufpool.h"
+#include "convolve.h"
+#include "filter.h"
+#include "gaussian.h"
+#include "gradient.h"
+#include "image.h"
+#include "kernel.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "resample.h"
+#include "unsharp.h"
+#include "util.h"
+
+#define VALIDATE_DEFAULT_CASES 200
+#define VALIDATE_DEFAULT_SEED 42
+#define VALIDATE_DEFAULT_THREADS 4
+#define VALIDATE_TOLERANCE 1
+#define VALIDATE_MAX_SIZE 67
+#define VALIDATE_MAX_KERNEL_SIZE 7
+#define VALIDATE_MAX_REPEATS 4
+#define VALIDATE_MAX_STAGES 4
+#define VALIDATE_MAX_STAGE_REPEATS 3
+// The integer, separable and FFT paths round differently from the float
+// reference, so a single application may differ by one.
+#define VALIDATE_METHOD_TOLERANCE 1
+// Largest radius of the operations, which exceeds some images on purpose.
+#define VALIDATE_MAX_RADIUS 12
+#define VALIDATE_SPEC_MAX 64
+
+// One randomly generated problem: an image, a pipeline of random kernels
+// and a repeat count of the whole pipeline. Single stage cases go through
+// the backends' own repeat loops, longer ones through fused passes.
+struct validate_case {
+        struct image img;
+        struct pipeline pipeline;
+        struct pipeline_stage stages[VALIDATE_MAX_STAGES];
+        float values[VALIDATE_MAX_STAGES]
+                    [VALIDATE_MAX_KERNEL_SIZE * VALIDATE_MAX_KERNEL_SIZE];
+        int repeats;
+};
+
+static unsigned long long validate_random(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static int validate_range(unsigned long long *state, int min, int max) {
+    return min + (int)(validate_random(state) % (max - min + 1));
+}
+
+// Degenerate shapes (one pixel wide or tall) are drawn as often as the
+// general case, because they are where patch boundaries go wrong.
+static int validate_dimension(unsigned long long *state) {
+    switch (validate_random(state) % 4) {
+    case 0:
+        return 1;
+    case 1:
+        return validate_range(state, 2, 8);
+    default:
+        return validate_range(state, 1, VALIDATE_MAX_SIZE);
+    }
+}
+
+// Kernel values are kept to an absolute sum of at most 2 so that a rounding
+// difference between backends cannot grow past the tolerance over repeats.
+static int validate_case_init(struct validate_case *vc,
+                              unsigned long long *state) {
+    static const int channels[] = {1, 3, 4};
+    int width = validate_dimension(state);
+    int height = validate_dimension(state);
+    int c = channels[validate_random(state) % 3];
+
+    if (image_init(&vc->img, width, height, c) != 0) {
+        return 1;
+    }
+    image_fill_random(&vc->img, validate_random(state));
+
+    // Half of the cases are a single stage, the rest chains of stages.
+    int stages = validate_random(state) % 2
+                     ? 1
+                     : validate_range(state, 2, VALIDATE_MAX_STAGES);
+
+    for (int s = 0; s < stages; s++) {
+        struct pipeline_stage *stage = &vc->stages[s];
+        float *values = vc->values[s];
+        int size =
+            1 + 2 * validate_range(state, 0, VALIDATE_MAX_KERNEL_SIZE / 2);
+        int count = size * size;
+        float sum = 0.0f;
+
+        for (int i = 0; i < count; i++) {
+            values[i] = (float)validate_range(state, -1000, 1000) / 1000.0f;
+            sum += values[i] < 0.0f ? -values[i] : values[i];
+        }
+        for (int i = 0; sum > 0.0f && i < count; i++) {
+            values[i] *= 2.0f / sum;
+        }
+
+        snprintf(stage->name, sizeof(stage->name), "random%d", s);
+        stage->k.size = size;
+        stage->k.values = values;
+        stage->repeats = stages == 1
+                             ? 1
+                             : validate_range(state, 1,
+                                              VALIDATE_MAX_STAGE_REPEATS);
+    }
+
+    vc->pipeline.items = vc->stages;
+    vc->pipeline.count = stages;
+    vc->pipeline.capacity = VALIDATE_MAX_STAGES;
+    vc->repeats = validate_range(state, 1, VALIDATE_MAX_REPEATS);
+
+    return 0;
+}
+
+// Scalar reference: image_apply_kernel over the whole image, once for every
+// step of the pipeline.
+static int validate_reference(struct validate_case *vc, struct image *out) {
+    int result = 0;
+    struct image tmp = {0};
+    size_t size = (size_t)vc->img.width * vc->img.height * vc->img.channels;
+
+    if (image_init(&tmp, vc->img.width, vc->img.height, vc->img.channels) !=
+            0 ||
+        image_reserve(out, vc->img.width, vc->img.height, vc->img.channels) !=
+            0) {
+        return_defer(1);
+    }
+    memcpy(tmp.bytes, vc->img.bytes, size);
+
+    for (int i = 0; i < vc->repeats; i++) {
+        for (size_t s = 0; s < vc->pipeline.count; s++) {
+            struct pipeline_stage *stage = &vc->pipeline.items[s];
+            for (int j = 0; j < stage->repeats; j++) {
+                image_apply_kernel(&tmp, &stage->k, out);
+                memcpy(tmp.bytes, out->bytes, size);
+            }
+        }
+    }
+
+defer:
+    image_destroy(&tmp);
+    return result;
+}
+
+static int validate_max_error(struct image *a, struct image *b) {
+    size_t size = (size_t)a->width * a->height * a->channels;
+    int max = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        int d = abs(a->bytes[i] - b->bytes[i]);
+        if (d > max) {
+            max = d;
+        }
+    }
+
+    return max;
+}
+
+// Runs one case on one backend with the given number of threads. Returns 1
+// on a mismatch or on any failure of the backend.
+static int validate_backend(struct validate_case *vc, struct image *expected,
+                            const struct backend *backend, int threads,
+                            int tolerance, int index) {
+    int result = 0;
+    struct filter_context ctx = {0};
+    struct image img = {0};
+    struct image out = {0};
+    size_t size = (size_t)vc->img.width * vc->img.height * vc->img.channels;
+
+    // Backends filter in place, so every run gets a fresh copy.
+    if (image_init(&img, vc->img.width, vc->img.height, vc->img.channels) !=
+        0) {
+        return_defer(1);
+    }
+    memcpy(img.bytes, vc->img.bytes, size);
+
+    if (filter_context_init(&ctx, threads, backend->name) != 0 ||
+        pipeline_apply(&ctx, &vc->pipeline, &img, &out, vc->repeats) != 0) {
+        LOG_ERROR("case %d: %s backend failed", index, backend->name);
+        return_defer(1);
+    }
+
+    int error = validate_max_error(expected, &out);
+    if (error > tolerance) {
+        LOG_ERROR("case %d: %s backend with %d threads differs by %d "
+                  "(%dx%dx%d, %zu stages, %d steps)",
+                  index, backend->name, threads, error, vc->img.width,
+                  vc->img.height, vc->img.channels, vc->pipeline.count,
+                  pipeline_steps(&vc->pipeline) * vc->repeats);
+        return_defer(1);
+    }
+
+defer:
+    filter_context_destroy(&ctx);
+    image_destroy(&img);
+    image_destroy(&out);
+    return result;
+}
+
+static int validate_method(const char *name, struct image *expected,
+                           struct image *out, struct kernel *k, int index) {
+    int error = validate_max_error(expected, out);
+    if (error > VALIDATE_METHOD_TOLERANCE) {
+        LOG_ERROR("case %d: %s path differs by %d (%dx%dx%d, kernel %d)",
+                  index, name, error, out->width, out->height,
+                  out->channels, k->size);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Applies a random integer kernel, separable a third of the time, once
+// with each of the execution paths picked by kernel analysis and compares
+// them to image_apply_kernel.
+static int validate_methods(struct image *img, unsigned long long *state,
+                            struct filter_context *ctx, int index,
+                            int *runs) {
+    int result = 0;
+    struct image expected = {0}, out = {0};
+    float values[VALIDATE_MAX_KERNEL_SIZE * VALIDATE_MAX_KERNEL_SIZE];
+    int weights[VALIDATE_MAX_KERNEL_SIZE * VALIDATE_MAX_KERNEL_SIZE];
+    float row[VALIDATE_MAX_KERNEL_SIZE], col[VALIDATE_MAX_KERNEL_SIZE];
+    int factors[2][VALIDATE_MAX_KERNEL_SIZE];
+
+    int size = 1 + 2 * validate_range(state, 0, VALIDATE_MAX_KERNEL_SIZE / 2);
+    int separable = validate_random(state) % 3 == 0;
+    for (int i = 0; i < size; i++) {
+        factors[0][i] = validate_range(state, -2, 4);
+        factors[1][i] = validate_range(state, -2, 4);
+    }
+
+    int sum = 0;
+    for (int i = 0; i < size * size; i++) {
+        weights[i] = separable ? factors[0][i / size] * factors[1][i % size]
+                               : validate_range(state, -4, 9);
+        sum += abs(weights[i]);
+    }
+    for (int i = 0; i < size * size; i++) {
+        values[i] = (float)weights[i] / (sum > 0 ? sum : 1);
+    }
+
+    struct kernel k = {size, values};
+    k.flags = kernel_analyze(&k, row, col, weights, &k.divisor);
+    k.weights = weights;
+
+    if (image_init(&expected, img->width, img->height, img->channels) != 0 ||
+        image_init(&out, img->width, img->height, img->channels) != 0) {
+        return_defer(1);
+    }
+    image_apply_kernel(img, &k, &expected);
+
+    if (k.flags & KERNEL_INTEGER) {
+        image_apply_kernel_patch_int(img, &k, 0, 0, img->width, img->height,
+                                     &out);
+        result += validate_method("integer", &expected, &out, &k, index);
+        (*runs)++;
+    }
+
+    if (k.flags & KERNEL_SEPARABLE) {
+        if (convolve_separable(ctx, img, row, col, size, &out) != 0) {
+            return_defer(1);
+        }
+        result += validate_method("separable", &expected, &out, &k, index);
+        (*runs)++;
+    }
+
+    if (convolve_fft(ctx, img, &k, &out) != 0) {
+        return_defer(1);
+    }
+    result += validate_method("fft", &expected, &out, &k, index);
+    (*runs)++;
+
+defer:
+    image_destroy(&expected);
+    image_destroy(&out);
+    return result;
+}
+
+// Naive box mean: the zero padded window summed pixel by pixel.
+static void validate_box(struct image *img, int radius, struct image *out) {
+    int n = 2 * radius + 1;
+
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++) {
+            for (int c = 0; c < img->channels; c++) {
+                int sum = 0;
+                for (int dy = -radius; dy <= radius; dy++) {
+                    for (int dx = -radius; dx <= radius; dx++) {
+                        int sx = x + dx, sy = y + dy;
+                        if (sx >= 0 && sx < img->width && sy >= 0 &&
+                            sy < img->height) {
+                            sum += img->bytes[(sy * img->width + sx) *
+                                                  img->channels +
+                                              c];
+                        }
+                    }
+                }
+                out->bytes[(y * img->width + x) * img->channels + c] =
+                    (unsigned char)(sum / (n * n));
+            }
+        }
+    }
+}
+
+// Zero padded convolution with the sampled Gaussian, out to six sigma and
+// normalized, in double precision.
+static int validate_gaussian(struct image *img, double sigma,
+                             struct image *out) {
+    int width = img->width, height = img->height, channels = img->channels;
+    int radius = (int)ceil(6.0 * sigma);
+    double *weights = malloc((2 * radius + 1) * sizeof(double));
+    double *rows = malloc((size_t)width * height * channels * sizeof(double));
+    double sum = 0.0;
+
+    if (weights == NULL || rows == NULL) {
+        free(weights);
+        free(rows);
+        return 1;
+    }
+    for (int i = -radius; i <= radius; i++) {
+        weights[i + radius] = exp(-i * i / (2.0 * sigma * sigma));
+        sum += weights[i + radius];
+    }
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < channels; c++) {
+                double value = 0.0;
+                for (int i = -radius; i <= radius; i++) {
+                    if (x + i >= 0 && x + i < width) {
+                        value += weights[i + radius] *
+                                 img->bytes[(y * width + x + i) * channels + c];
+                    }
+                }
+                rows[(y * width + x) * channels + c] = value / sum;
+            }
+        }
+    }
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < channels; c++) {
+                double value = 0.0;
+                for (int i = -radius; i <= radius; i++) {
+                    if (y + i >= 0 && y + i < height) {
+                        value += weights[i + radius] *
+                                 rows[((y + i) * width + x) * channels + c];
+                    }
+                }
+                value = value / sum + CONVOLVE_ROUNDING_BIAS;
+                out->bytes[(y * width + x) * channels + c] =
+                    value < 0.0     ? 0
+                    : value > 255.0 ? 255
+                                    : (unsigned char)value;
+            }
+        }
+    }
+
+    free(weights);
+    free(rows);
+    return 0;
+}
+
+// Window statistics of channel c around (x, y), clipped to the image,
+// summed pixel by pixel.
+static int validate_window(struct image *img, int x, int y, int c, int radius,
+                           long long *sum, long long *squares) {
+    int n = 0;
+    *sum = 0;
+    *squares = 0;
+
+    for (int sy = y - radius; sy <= y + radius; sy++) {
+        for (int sx = x - radius; sx <= x + radius; sx++) {
+            if (sx >= 0 && sx < img->width && sy >= 0 && sy < img->height) {
+                int value =
+                    img->bytes[(sy * img->width + sx) * img->channels + c];
+                *sum += value;
+                *squares += value * value;
+                n++;
+            }
+        }
+    }
+
+    return n;
+}
+
+static int validate_stddev(long long n, long long sum, long long squares) {
+    return (int)(sqrt((double)(n * squares - sum * sum)) / (double)n);
+}
+
+// Naive gradient with the edge pixels repeated, in double precision.
+static void validate_gradient(struct image *img, int side, int center,
+                              int norm, double scale, int direction,
+                              struct image *out) {
+    int weights[3] = {side, center, side};
+
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++) {
+            for (int c = 0; c < img->channels; c++) {
+                int gx = 0, gy = 0;
+                for (int d = -1; d <= 1; d++) {
+                    for (int e = -1; e <= 1; e += 2) {
+                        int sx = x + e < 0 ? 0
+                                 : x + e >= img->width ? img->width - 1
+                                                       : x + e;
+                        int sy = y + e < 0 ? 0
+                                 : y + e >= img->height ? img->height - 1
+                                                        : y + e;
+                        int dx = x + d < 0 ? 0
+                                 : x + d >= img->width ? img->width - 1
+                                                       : x + d;
+                        int dy = y + d < 0 ? 0
+                                 : y + d >= img->height ? img->height - 1
+                                                        : y + d;
+                        int w = weights[d + 1];
+                        gx += e * w *
+                              img->bytes[(dy * img->width + sx) *
+                                             img->channels +
+                                         c];
+                        gy += e * w *
+                              img->bytes[(sy * img->width + dx) *
+                                             img->channels +
+                                         c];
+                    }
+                }
+
+                double value;
+                if (direction) {
+                    value = gx == 0 && gy == 0 ? 0.0
+                                               : atan2(gy, gx) * 128.0 / M_PI;
+                    value = value < 0.0 ? value + 256.0 : value;
+                } else if (norm == 1) {
+                    value = (abs(gx) + abs(gy)) * scale;
+                } else {
+                    value = sqrt((double)gx * gx + (double)gy * gy) * scale;
+                }
+                value = value > 255.0 ? 255.0 : value;
+                out->bytes[(y * img->width + x) * img->channels + c] =
+                    (unsigned char)value;
+            }
+        }
+    }
+}
+
+// Naive exact bilateral filter over the window out to 2 sigma_s, clipped to
+// the image, in double precision.
+static void validate_bilateral(struct image *img, double sigma_s,
+                               double sigma_r, struct image *out) {
+    int radius = (int)ceil(2.0 * sigma_s);
+
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++) {
+            for (int c = 0; c < img->channels; c++) {
+                int center =
+                    img->bytes[(y * img->width + x) * img->channels + c];
+                double sum = 0.0, weight = 0.0;
+                for (int sy = y - radius; sy <= y + radius; sy++) {
+                    for (int sx = x - radius; sx <= x + radius; sx++) {
+                        if (sx < 0 || sx >= img->width || sy < 0 ||
+                            sy >= img->height) {
+                            continue;
+                        }
+                        int value = img->bytes[(sy * img->width + sx) *
+                                                   img->channels +
+                                               c];
+                        double d2 = (sx - x) * (sx - x) + (sy - y) * (sy - y);
+                        double e = value - center;
+                        double w = exp(-d2 / (2.0 * sigma_s * sigma_s)) *
+                                   exp(-e * e / (2.0 * sigma_r * sigma_r));
+                        sum += w * value;
+                        weight += w;
+                    }
+                }
+                out->bytes[(y * img->width + x) * img->channels + c] =
+                    (unsigned char)(sum / weight);
+            }
+        }
+    }
+}
+
+// Naive unsharp mask with the sampled Gaussian out to three sigma and the
+// edge pixels repeated, in double precision.
+static void validate_unsharp(struct image *img, double sigma, double amount,
+                             int threshold, struct image *out) {
+    int radius = (int)ceil(3.0 * sigma);
+    double weights[2 * radius + 1];
+    double total = 0.0;
+    for (int k = -radius; k <= radius; k++) {
+        weights[k + radius] = exp(-k * k / (2.0 * sigma * sigma));
+        total += weights[k + radius];
+    }
+
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++) {
+            for (int c = 0; c < img->channels; c++) {
+                double blur = 0.0;
+                for (int dy = -radius; dy <= radius; dy++) {
+                    int sy = y + dy < 0 ? 0
+                             : y + dy >= img->height ? img->height - 1
+                                                     : y + dy;
+                    for (int dx = -radius; dx <= radius; dx++) {
+                        int sx = x + dx < 0 ? 0
+                                 : x + dx >= img->width ? img->width - 1
+                                                        : x + dx;
+                        blur += weights[dy + radius] * weights[dx + radius] *
+                                img->bytes[(sy * img->width + sx) *
+                                               img->channels +
+                                           c];
+                    }
+                }
+                blur /= total * total;
+
+                double value =
+                    img->bytes[(y * img->width + x) * img->channels + c];
+                if (fabs(value - blur) >= threshold) {
+                    value += amount * (value - blur);
+                }
+                value = value < 0.0 ? 0.0 : value > 255.0 ? 255.0 : value;
+                out->bytes[(y * img->width + x) * img->channels + c] =
+                    (unsigned char)value;
+            }
+        }
+    }
+}
+
+static int validate_compare_bytes(const void *a, const void *b) {
+    return *(const unsigned char *)a - *(const unsigned char *)b;
+}
+
+// Naive median: the lower middle value of the sorted window, clipped to the
+// image.
+static int validate_median(struct image *img, int radius, struct image *out) {
+    int n = 2 * radius + 1;
+    unsigned char *window = malloc((size_t)n * n);
+    if (window == NULL) {
+        return 1;
+    }
+
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++) {
+            for (int c = 0; c < img->channels; c++) {
+                int count = 0;
+                for (int sy = y - radius; sy <= y + radius; sy++) {
+                    for (int sx = x - radius; sx <= x + radius; sx++) {
+                        if (sx >= 0 && sx < img->width && sy >= 0 &&
+                            sy < img->height) {
+                            window[count++] =
+                                img->bytes[(sy * img->width + sx) *
+                                               img->channels +
+                                           c];
+                        }
+                    }
+                }
+                qsort(window, count, 1, validate_compare_bytes);
+                out->bytes[(y * img->width + x) * img->channels + c] =
+                    window[(count - 1) / 2];
+            }
+        }
+    }
+
+    free(window);
+    return 0;
+}
+
+// Naive erosion or dilation over the rectangle clipped to the image.
+static void validate_extreme(struct image *img, int max, int rx, int ry,
+                             struct image *out) {
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++) {
+            for (int c = 0; c < img->channels; c++) {
+                int value = max ? 0 : 255;
+                for (int sy = y - ry; sy <= y + ry; sy++) {
+                    for (int sx = x - rx; sx <= x + rx; sx++) {
+                        if (sx < 0 || sx >= img->width || sy < 0 ||
+                            sy >= img->height) {
+                            continue;
+                        }
+                        int v = img->bytes[(sy * img->width + sx) *
+                                               img->channels +
+                                           c];
+                        value = max ? (v > value ? v : value)
+                                    : (v < value ? v : value);
+                    }
+                }
+                out->bytes[(y * img->width + x) * img->channels + c] =
+                    (unsigned char)value;
+            }
+        }
+    }
+}
+
+// Naive morphology in the order of the operations that validate_operations
+// checks: erode, dilate, open and close.
+static int validate_morphology(struct image *img, int kind, int rx, int ry,
+                               struct image *out) {
+    struct image temp = {0};
+
+    if (kind < 2) {
+        validate_extreme(img, kind == 1, rx, ry, out);
+        return 0;
+    }
+    if (image_init(&temp, img->width, img->height, img->channels) != 0) {
+        return 1;
+    }
+    validate_extreme(img, kind == 3, rx, ry, &temp);
+    validate_extreme(&temp, kind == 2, rx, ry, out);
+    image_destroy(&temp);
+    return 0;
+}
+
+// Naive region statistics, in the order of the operations that
+// validate_operations checks: mean, stddev, threshold and abox.
+static void validate_statistics(struct image *img, int kind, int radius,
+                                int arg, int contrast, struct image *out) {
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++) {
+            for (int c = 0; c < img->channels; c++) {
+                int i = (y * img->width + x) * img->channels + c;
+                long long sum, squares;
+                int n = validate_window(img, x, y, c, radius, &sum, &squares);
+                int value;
+
+                if (kind == 0) {
+                    value = (int)(sum / n);
+                } else if (kind == 1) {
+                    value = validate_stddev(n, sum, squares);
+                } else if (kind == 2) {
+                    value = (img->bytes[i] + arg) * (long long)n > sum ? 255
+                                                                       : 0;
+                } else {
+                    int stddev = validate_stddev(n, sum, squares);
+                    stddev = stddev < contrast ? stddev : contrast;
+                    int r = radius - (radius - arg) * stddev / contrast;
+                    n = validate_window(img, x, y, c, r, &sum, &squares);
+                    value = (int)(sum / n);
+                }
+                out->bytes[i] = (unsigned char)value;
+            }
+        }
+    }
+}
+
+static float validate_resample_kernel(int filter, float x) {
+    if (filter == RESAMPLE_BOX) {
+        return x > -0.5f && x <= 0.5f ? 1.0f : 0.0f;
+    } else if (filter == RESAMPLE_BILINEAR) {
+        return fabsf(x) < 1.0f ? 1.0f - fabsf(x) : 0.0f;
+    }
+
+    if (x <= -3.0f || x >= 3.0f) {
+        return 0.0f;
+    } else if (x == 0.0f) {
+        return 1.0f;
+    }
+    double px = M_PI * x;
+    return (float)(sin(px) / px * sin(px / 3) / (px / 3));
+}
+
+// Naive resampling weights of output pixel i of an axis of in pixels
+// resampled to out: the stretched filter at every input pixel, normalized,
+// or the pixel under the center when they are all zero.
+static void validate_resample_weights(int in, int out, int filter, int i,
+                                      double *w) {
+    float scale = (float)in / out;
+    float stretch = scale > 1.0f ? scale : 1.0f;
+    float center = (i + 0.5f) * scale;
+    double total = 0.0;
+
+    for (int j = 0; j < in; j++) {
+        w[j] = validate_resample_kernel(filter, (j - center + 0.5f) / stretch);
+        total += w[j];
+    }
+    if (total == 0.0) {
+        w[(int)center < in ? (int)center : in - 1] = 1.0;
+        total = 1.0;
+    }
+    for (int j = 0; j < in; j++) {
+        w[j] /= total;
+    }
+}
+
+static unsigned char validate_resample_value(double value) {
+    value += CONVOLVE_ROUNDING_BIAS;
+    return value < 0.0 ? 0 : value > 255.0 ? 255 : (unsigned char)value;
+}
+
+// Naive resampling: rows along x into bytes, then columns along y, every
+// output value summed over the whole input line. Axes that keep their size
+// are left as they are.
+static int validate_resample(struct image *img, int width, int height,
+                             int filter, struct image *out) {
+    int result = 0;
+    int channels = img->channels;
+    unsigned char *rows = malloc((size_t)width * img->height * channels);
+    double *w = malloc(sizeof(double) *
+                       (img->width > img->height ? img->width : img->height));
+    if (rows == NULL || w == NULL ||
+        image_reserve(out, width, height, channels) != 0) {
+        return_defer(1);
+    }
+
+    for (int x = 0; x < width; x++) {
+        if (width != img->width) {
+            validate_resample_weights(img->width, width, filter, x, w);
+        }
+        for (int y = 0; y < img->height; y++) {
+            for (int c = 0; c < channels; c++) {
+                const unsigned char *src =
+                    img->bytes + (size_t)y * img->width * channels + c;
+                double sum = 0.0;
+                if (width == img->width) {
+                    sum = src[x * channels];
+                } else {
+                    for (int j = 0; j < img->width; j++) {
+                        sum += w[j] * src[j * channels];
+                    }
+                }
+                rows[((size_t)y * width + x) * channels + c] =
+                    validate_resample_value(sum);
+            }
+        }
+    }
+
+    for (int y = 0; y < height; y++) {
+        if (height != img->height) {
+            validate_resample_weights(img->height, height, filter, y, w);
+        }
+        for (int i = 0; i < width * channels; i++) {
+            double sum = 0.0;
+            if (height == img->height) {
+                sum = rows[(size_t)y * width * channels + i];
+            } else {
+                for (int j = 0; j < img->height; j++) {
+                    sum += w[j] * rows[(size_t)j * width * channels + i];
+                }
+            }
+            out->bytes[(size_t)y * width * channels + i] =
+                validate_resample_value(sum);
+        }
+    }
+
+defer:
+    free(rows);
+    free(w);
+    return result;
+}
+
+// Runs spec as a pipeline and compares it to the expected image.
+static int validate_operation(struct filter_context *ctx, const char *spec,
+                              struct image *img, struct image *expected,
+                              int tolerance, int index) {
+    int result = 0;
+    struct pipeline p = {0};
+    struct image out = {0};
+
+    if (pipeline_parse(&p, spec, NULL) != 0 ||
+        pipeline_apply(ctx, &p, img, &out, 1) != 0) {
+        LOG_ERROR("case %d: %s failed", index, spec);
+        return_defer(1);
+    }
+
+    if (out.width != expected->width || out.height != expected->height) {
+        LOG_ERROR("case %d: %s gives %dx%d instead of %dx%d", index, spec,
+                  out.width, out.height, expected->width, expected->height);
+        return_defer(1);
+    }
+
+    int error = validate_max_error(expected, &out);
+    if (error > tolerance) {
+        LOG_ERROR("case %d: %s differs by %d (%dx%dx%d)", index, spec, error,
+                  img->width, img->height, img->channels);
+        return_defer(1);
+    }
+
+defer:
+    pipeline_free(&p);
+    image_destroy(&out);
+    return result;
+}
+
+// Blurs img twice on the same context, and fails if the second call takes
+// memory from the buffer pool: once a context has seen an image of a size,
+// both Gaussian paths run out of its scratch memory alone.
+static int validate_gaussian_reuse(struct filter_context *ctx,
+                                   struct image *img, float sigma,
+                                   struct image *out, int index) {
+    struct buffer_pool_stats before, after;
+
+    if (gaussian_blur(ctx, img, sigma, out) != 0) {
+        return 1;
+    }
+    buffer_pool_get_stats(&before);
+    if (gaussian_blur(ctx, img, sigma, out) != 0) {
+        return 1;
+    }
+    buffer_pool_get_stats(&after);
+
+    if (after.hits + after.misses != before.hits + before.misses) {
+        LOG_ERROR("case %d: gaussian(%g) allocates on a warm context", index,
+                  sigma);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Compares every operation with random arguments to its naive definition.
+static int validate_operations(struct image *img, unsigned long long *state,
+                               struct filter_context *ctx, int index,
+                               int *runs) {
+    int result = 0;
+    struct image expected = {0};
+    char spec[VALIDATE_SPEC_MAX];
+
+    if (image_init(&expected, img->width, img->height, img->channels) != 0) {
+        return 1;
+    }
+
+    int radius = validate_range(state, 0, VALIDATE_MAX_RADIUS);
+    validate_box(img, radius, &expected);
+    snprintf(spec, sizeof(spec), "box(%d)", radius);
+    result += validate_operation(ctx, spec, img, &expected, 0, index);
+    (*runs)++;
+
+    // Sigmas past the sizes of the random images test the borders alone.
+    double sigma = validate_range(state, 5, 200) / 10.0;
+    if (validate_gaussian(img, sigma, &expected) != 0) {
+        image_destroy(&expected);
+        return 1;
+    }
+    snprintf(spec, sizeof(spec), "gaussian(%g)", sigma);
+    result += validate_operation(ctx, spec, img, &expected,
+                                 GAUSSIAN_MAX_ERROR, index);
+    result += validate_gaussian_reuse(ctx, img, (float)sigma, &expected,
+                                      index);
+    (*runs) += 2;
+
+    // Float magnitudes and angles on a level boundary may fall either side.
+    int scharr = validate_range(state, 0, 1);
+    int norm = validate_range(state, 1, 2);
+    double scale = 1.0 / (1 << validate_range(state, 0, 4));
+    int direction = validate_range(state, 0, 1);
+    validate_gradient(img, scharr ? 3 : 1, scharr ? 10 : 2, norm, scale,
+                      direction, &expected);
+    snprintf(spec, sizeof(spec), "%s(%d,%g,%d)", scharr ? "scharr" : "sobel",
+             norm, scale, direction);
+    result += validate_operation(ctx, spec, img, &expected, 1, index);
+    (*runs)++;
+
+    double sigma_s = validate_range(state, 5, 30) / 10.0;
+    double sigma_r = validate_range(state, 1, 80);
+    validate_bilateral(img, sigma_s, sigma_r, &expected);
+    snprintf(spec, sizeof(spec), "bilateral(%g,%g,%d)", sigma_s, sigma_r,
+             BILATERAL_EXACT);
+    result += validate_operation(ctx, spec, img, &expected, 1, index);
+    (*runs)++;
+
+    // The grid only approximates the filter, but keeps a step between two
+    // levels many sigma_r apart intact: each side is averaged with itself.
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++) {
+            for (int c = 0; c < img->channels; c++) {
+                expected.bytes[(y * img->width + x) * img->channels + c] =
+                    x < img->width / 2 ? 40 : 200;
+            }
+        }
+    }
+    sigma_s = validate_range(state, 5, 120) / 10.0;
+    sigma_r = validate_range(state, 1, 20);
+    snprintf(spec, sizeof(spec), "bilateral(%g,%g,%d)", sigma_s, sigma_r,
+             BILATERAL_GRID);
+    result += validate_operation(ctx, spec, &expected, &expected, 1, index);
+    (*runs)++;
+
+    // Amounts scale the float rounding of the blur, and a difference close
+    // to the threshold may fall either side of it.
+    sigma = validate_range(state, 5, 40) / 10.0;
+    double amount = validate_range(state, 0, 30) / 10.0;
+    int threshold = validate_range(state, 0, 1) * validate_range(state, 0, 20);
+    validate_unsharp(img, sigma, amount, threshold, &expected);
+    snprintf(spec, sizeof(spec), "unsharp(%g,%g,%d)", sigma, amount,
+             threshold);
+    result += validate_operation(ctx, spec, img, &expected, 1, index);
+    (*runs)++;
+
+    radius = validate_range(state, 0, VALIDATE_MAX_RADIUS);
+    if (validate_median(img, radius, &expected) != 0) {
+        image_destroy(&expected);
+        return 1;
+    }
+    snprintf(spec, sizeof(spec), "median(%d)", radius);
+    result += validate_operation(ctx, spec, img, &expected, 0, index);
+    (*runs)++;
+
+    static const char *morphology[] = {"erode", "dilate", "open", "close"};
+    for (int kind = 0; kind < 4; kind++) {
+        int rx = validate_range(state, 0, VALIDATE_MAX_RADIUS);
+        int ry = validate_range(state, 0, VALIDATE_MAX_RADIUS);
+        if (validate_morphology(img, kind, rx, ry, &expected) != 0) {
+            image_destroy(&expected);
+            return 1;
+        }
+        snprintf(spec, sizeof(spec), "%s(%d,%d)", morphology[kind], rx, ry);
+        result += validate_operation(ctx, spec, img, &expected, 0, index);
+        (*runs)++;
+    }
+
+    static const char *statistics[] = {"mean", "stddev", "threshold", "abox"};
+    for (int kind = 0; kind < 4; kind++) {
+        int radius = validate_range(state, 0, VALIDATE_MAX_RADIUS);
+        int arg = 0, contrast = 0;
+        if (kind == 0 || kind == 1) {
+            snprintf(spec, sizeof(spec), "%s(%d)", statistics[kind], radius);
+        } else if (kind == 2) {
+            arg = validate_range(state, -20, 20);
+            snprintf(spec, sizeof(spec), "%s(%d,%d)", statistics[kind],
+                     radius, arg);
+        } else {
+            arg = validate_range(state, 0, radius);
+            contrast = validate_range(state, 1, 64);
+            snprintf(spec, sizeof(spec), "%s(%d,%d,%d)", statistics[kind],
+                     arg, radius, contrast);
+        }
+        validate_statistics(img, kind, radius, arg, contrast, &expected);
+        result += validate_operation(ctx, spec, img, &expected, 0, index);
+        (*runs)++;
+    }
+
+    // Sizes up to twice the image, with one of them left to the aspect
+    // ratio a quarter of the time.
+    int width = validate_range(state, 1, 2 * img->width + 2);
+    int height = validate_range(state, 1, 2 * img->height + 2);
+    int filter = validate_range(state, RESAMPLE_BOX, RESAMPLE_LANCZOS3);
+    if (validate_random(state) % 4 == 0) {
+        height = (int)lround((double)img->height * width / img->width);
+        height = height < 1 ? 1 : height;
+        snprintf(spec, sizeof(spec), "resize(%d,0,%d)", width, filter);
+    } else {
+        snprintf(spec, sizeof(spec), "resize(%d,%d,%d)", width, height,
+                 filter);
+    }
+    if (validate_resample(img, width, height, filter, &expected) != 0) {
+        image_destroy(&expected);
+        return 1;
+    }
+    result += validate_operation(ctx, spec, img, &expected, 1, index);
+    (*runs)++;
+
+    image_destroy(&expected);
+    return result;
+}
+
+// Naive pyramid reduce of the level src, width by height, into dst: the 5x5
+// binomial window around every kept pixel with the edge pixels repeated.
+static void validate_reduce(const unsigned char *src, int width, int height,
+                            int channels, unsigned char *dst) {
+    static const int weights[5] = {1, 4, 6, 4, 1};
+    for (int y = 0; y < (height + 1) / 2; y++) {
+        for (int x = 0; x < (width + 1) / 2; x++) {
+            for (int c = 0; c < channels; c++) {
+                int sum = 0;
+                for (int j = 0; j < 5; j++) {
+                    int sy = 2 * y + j - 2;
+                    sy = sy < 0 ? 0 : sy >= height ? height - 1 : sy;
+                    for (int k = 0; k < 5; k++) {
+                        int sx = 2 * x + k - 2;
+                        sx = sx < 0 ? 0 : sx >= width ? width - 1 : sx;
+                        sum += weights[j] * weights[k] *
+                               src[(sy * width + sx) * channels + c];
+                    }
+                }
+                dst[(y * ((width + 1) / 2) + x) * channels + c] =
+                    (sum + 128) >> 8;
+            }
+        }
+    }
+}
+
+// Naive pyramid expand of pixel (x, y, c) from the level low, width by
+// height: the binomial window times four over the level with zeros between
+// its pixels.
+static int validate_expand(const unsigned char *low, int width, int height,
+                           int channels, int x, int y, int c) {
+    static const int weights[5] = {1, 4, 6, 4, 1};
+    int sum = 0;
+    for (int j = -2; j <= 2; j++) {
+        if ((y - j) % 2 != 0) {
+            continue;
+        }
+        int sy = (y - j) / 2;
+        sy = sy < 0 ? 0 : sy >= height ? height - 1 : sy;
+        for (int k = -2; k <= 2; k++) {
+            if ((x - k) % 2 != 0) {
+                continue;
+            }
+            int sx = (x - k) / 2;
+            sx = sx < 0 ? 0 : sx >= width ? width - 1 : sx;
+            sum += weights[j + 2] * weights[k + 2] *
+                   low[(sy * width + sx) * channels + c];
+        }
+    }
+    return (sum + 32) >> 6;
+}
+
+// Builds the pyramids of img with a random number of levels, compares every
+// Gaussian level to the naive reduce of the one before and every Laplacian
+// level to its naive definition, and collapses them back into img.
+static int validate_pyramid(struct image *img, unsigned long long *state,
+                            struct filter_context *ctx, int index,
+                            int *runs) {
+    int result = 0;
+    struct pyramid p = {0};
+    struct image out = {0};
+    unsigned char *expected = NULL;
+
+    int levels = validate_range(state, 1, 6);
+    if (pyramid_build(ctx, img, levels, 1, &p) != 0) {
+        LOG_ERROR("case %d: pyramid(%d) failed", index, levels);
+        return_defer(1);
+    }
+
+    int channels = img->channels;
+    expected = malloc((size_t)img->width * img->height * channels);
+    if (expected == NULL) {
+        return_defer(1);
+    }
+
+    for (int l = 0; l < p.levels; l++) {
+        const struct pyramid_level *level = &p.level[l];
+        size_t size = (size_t)level->width * level->height * channels;
+        if (l == 0) {
+            memcpy(expected, img->bytes, size);
+        } else {
+            const struct pyramid_level *above = &p.level[l - 1];
+            validate_reduce(pyramid_gaussian(&p, l - 1), above->width,
+                            above->height, channels, expected);
+        }
+        if (memcmp(expected, pyramid_gaussian(&p, l), size) != 0) {
+            LOG_ERROR("case %d: pyramid(%d) Gaussian level %d differs "
+                      "(%dx%dx%d)",
+                      index, levels, l, img->width, img->height, channels);
+            return_defer(1);
+        }
+        (*runs)++;
+
+        const unsigned char *g = pyramid_gaussian(&p, l);
+        const int16_t *lap = pyramid_laplacian(&p, l);
+        for (int y = 0; y < level->height; y++) {
+            for (int x = 0; x < level->width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    size_t i = ((size_t)y * level->width + x) * channels + c;
+                    int e = 0;
+                    if (l < p.levels - 1) {
+                        e = validate_expand(pyramid_gaussian(&p, l + 1),
+                                            p.level[l + 1].width,
+                                            p.level[l + 1].height, channels,
+                                            x, y, c);
+                    }
+                    if (lap[i] != g[i] - e) {
+                        LOG_ERROR("case %d: pyramid(%d) Laplacian level %d "
+                                  "differs at (%d, %d, %d)",
+                                  index, levels, l, x, y, c);
+                        return_defer(1);
+                    }
+                }
+            }
+        }
+        (*runs)++;
+    }
+
+    if (pyramid_collapse(ctx, &p, &out) != 0) {
+        return_defer(1);
+    }
+    int error = validate_max_error(img, &out);
+    if (error > 0) {
+        LOG_ERROR("case %d: pyramid(%d) collapse differs by %d (%dx%dx%d)",
+                  index, levels, error, img->width, img->height, channels);
+        return_defer(1);
+    }
+    (*runs)++;
+
+defer:
+    free(expected);
+    pyramid_destroy(&p);
+    image_destroy(&out);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    int result = 0;
+    struct validate_case vc = {0};
+    struct image expected = {0};
+    struct filter_context ctx = {0};
+
+    struct argparse_parser *parser =
+        argparse_new("validate", "compare every backend against the scalar "
+                                 "reference on random inputs",
+                     "0.0.1");
+    argparse_add_argument(parser, 'v', "version", "print version",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, 'h', "help", "print help",
+                          ARGUMENT_TYPE_FLAG);
+    argparse_add_argument(parser, 'n', "cases", "number of random cases",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 's', "seed", "random seed",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 'p', "threads",
+                          "largest number of threads to test",
+                          ARGUMENT_TYPE_VALUE);
+    argparse_add_argument(parser, 't', "tolerance",
+                          "largest allowed difference of a value (default 1)",
+                          ARGUMENT_TYPE_VALUE);
+
+    argparse_parse(parser, argc, argv);
+
+    if (argparse_get_flag(parser, "help")) {
+        argparse_print_help(parser);
+        return_defer(0);
+    }
+
+    if (argparse_get_flag(parser, "version")) {
+        argparse_print_version(parser);
+        return_defer(0);
+    }
+
+    int cases = VALIDATE_DEFAULT_CASES;
+    char *cases_str = argparse_get_value(parser, "cases");
+    if (cases_str) {
+        cases = atoi(cases_str);
+        if (cases <= 0) {
+            LOG_ERROR("cases must be a positive number");
+            return_defer(1);
+        }
+    }
+
+    unsigned long long seed = VALIDATE_DEFAULT_SEED;
+    char *seed_str = argparse_get_value(parser, "seed");
+    if (seed_str) {
+        seed = strtoull(seed_str, NULL, 10);
+    }
+    unsigned long long state = seed ? seed : 1;
+
+    int threads = VALIDATE_DEFAULT_THREADS;
+    char *threads_str = argparse_get_value(parser, "threads");
+    if (threads_str) {
+        threads = atoi(threads_str);
+        if (threads <= 0) {
+            LOG_ERROR("threads must be a positive number");
+            return_defer(1);
+        }
+    }
+
+    int tolerance = VALIDATE_TOLERANCE;
+    char *tolerance_str = argparse_get_value(parser, "tolerance");
+    if (tolerance_str) {
+        tolerance = atoi(tolerance_str);
+        if (tolerance < 0) {
+            LOG_ERROR("tolerance must not be negative");
+            return_defer(1);
+        }
+    }
+
+    if (filter_context_init(&ctx, threads, NULL) != 0) {
+        return_defer(1);
+    }
+
+    int failures = 0;
+    int runs = 0;
+
+    for (int i = 0; i < cases; i++) {
+        if (validate_case_init(&vc, &state) != 0 ||
+            validate_reference(&vc, &expected) != 0) {
+            LOG_ERROR("failed to allocate memory");
+            return_defer(1);
+        }
+
+        for (size_t b = 0; b < backend_count(); b++) {
+            const struct backend *backend = backend_at(b);
+            if (!backend->available()) {
+                continue;
+            }
+
+            // Thread counts cycle so that some runs have more threads than
+            // image rows.
+            int t = 1 + i % threads;
+            failures += validate_backend(&vc, &expected, backend, t,
+                                         tolerance, i);
+            runs++;
+        }
+
+        failures += validate_methods(&vc.img, &state, &ctx, i, &runs);
+        failures += validate_operations(&vc.img, &state, &ctx, i, &runs);
+        failures += validate_pyramid(&vc.img, &state, &ctx, i, &runs);
+
+        image_destroy(&vc.img);
+    }
+
+    for (size_t b = 0; b < backend_count(); b++) {
+        const struct backend *backend = backend_at(b);
+        LOG_INFO("%s backend: %s", backend->name,
+                 backend->available() ? "tested" : "not available");
+    }
+
+    if (failures > 0) {
+        LOG_ERROR("%d of %d runs differ from the scalar reference (seed %llu)",
+                  failures, runs, seed);
+        return_defer(1);
+    }
+
+    LOG_INFO("%d runs over %d cases match the scalar reference (seed %llu)",
+             runs, cases, seed);
+
+defer:
+    filter_context_destroy(&ctx);
+    image_destroy(&vc.img);
+    image_destroy(&expected);
+    if (parser)
+        argparse_free(parser);
+    return result;
+}